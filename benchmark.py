@@ -0,0 +1,214 @@
+import argparse
+import json
+import multiprocessing
+import os
+import platform
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+import numpy as np
+import mykmeanssp
+import kmeans_pp
+
+
+# Usage: python3 benchmark.py [--n 10000 100000] [--d 2 16] [--k 8 64] [--threads 1 4] [--batch-size 1024]
+#                             [--output results.json]
+# Every case runs in a fresh process, so its peak RSS is its own. The JSON report is written to stdout or --output,
+# and the exit status is 1 if the reference cases of test_readme.txt no longer match output_1/2/3.txt.
+# A fit stops before --iter iterations once no point changes cluster, so the throughput of every case counts only
+# the iterations it ran; its "iterations" and "converged" fields tell whether it stopped early.
+
+REFERENCE_CASES = [
+    ["3", "333", "0", "input_1_db_1.txt", "input_1_db_2.txt", "output_1.txt"],
+    ["7", "0", "input_2_db_1.txt", "input_2_db_2.txt", "output_2.txt"],
+    ["15", "750", "0", "input_3_db_1.txt", "input_3_db_2.txt", "output_3.txt"],
+]
+
+
+# *** Argument reading and processing *** #
+
+def read_arguments():
+    parser = argparse.ArgumentParser(description="Times the stages of mykmeanssp over grids of Gaussian blobs.")
+    parser.add_argument("--n", type=int, nargs="+", default=[10000, 100000], help="numbers of points")
+    parser.add_argument("--d", type=int, nargs="+", default=[2, 16], help="dimensions")
+    parser.add_argument("--k", type=int, nargs="+", default=[8, 64], help="numbers of clusters")
+    parser.add_argument("--threads", type=int, nargs="+", default=[1, os.cpu_count() or 1],
+                        help="thread counts to sweep")
+    parser.add_argument("--algorithm", nargs="+", default=["lloyd"], choices=["lloyd", "hamerly", "elkan"])
+    parser.add_argument("--iter", type=int, default=20,
+                        help="maximum iterations of every fit (eps is 0, so a fit only stops early once no point "
+                             "changes cluster)")
+    parser.add_argument("--seed", type=int, default=0, help="seed of the blobs and of k-means++")
+    parser.add_argument("--skip-load", action="store_true", help="do not time the loading of text files")
+    parser.add_argument("--batch-size", type=int, default=0,
+                        help="also time mini-batch k-means streamed from a text file in batches of this size")
+    parser.add_argument("--skip-reference", action="store_true", help="do not run the reference cases")
+    parser.add_argument("--output", help="where to write the JSON report (default: stdout)")
+
+    return parser.parse_args()
+
+
+# *** Data *** #
+
+def make_blobs(n, d, k, seed):
+    # k Gaussian blobs of unit variance, centered uniformly in [-2, 2]^d. The blobs overlap, so a fit keeps moving
+    # points between clusters for long enough to be timed. The same arguments give the same points
+    rng = np.random.default_rng(seed)
+    centers = rng.uniform(-2, 2, size=(k, d))
+    labels = rng.integers(0, k, size=n)
+    points = centers[labels] + rng.standard_normal(size=(n, d))
+
+    return np.ascontiguousarray(points, dtype=np.float64)
+
+
+def write_joined_files(points, directory):
+    # Splits the columns into the two keyed files load_joined reads, as the input files of kmeans_pp.py are
+    keys = np.arange(points.shape[0], dtype=np.float64).reshape(-1, 1)
+    half = (points.shape[1] + 1) // 2
+    paths = [os.path.join(directory, "db_1.txt"), os.path.join(directory, "db_2.txt")]
+
+    np.savetxt(paths[0], np.hstack([keys, points[:, :half]]), fmt="%.6f", delimiter=",")
+    np.savetxt(paths[1], np.hstack([keys, points[:, half:]]), fmt="%.6f", delimiter=",")
+
+    return paths
+
+
+def write_keyed_file(points, directory):
+    # One keyed file with every column, as kmeans_pp.read_chunks streams it
+    path = os.path.join(directory, "db.txt")
+    keys = np.arange(points.shape[0], dtype=np.float64).reshape(-1, 1)
+    np.savetxt(path, np.hstack([keys, points]), fmt="%.6f", delimiter=",")
+
+    return path
+
+
+def peak_rss_bytes():
+    peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+    # Linux reports kilobytes, macOS bytes
+    return peak if sys.platform == "darwin" else peak * 1024
+
+
+# *** Cases *** #
+
+def run_case(case):
+    n, d, k, threads, algorithm = case["n"], case["d"], case["k"], case["threads"], case["algorithm"]
+    result = dict(case)
+
+    start = time.perf_counter()
+    points = make_blobs(n, d, k, case["seed"])
+    result["generate_seconds"] = time.perf_counter() - start
+
+    if case["load"] and d >= 2:
+        with tempfile.TemporaryDirectory() as directory:
+            paths = write_joined_files(points, directory)
+            start = time.perf_counter()
+            mykmeanssp.load_joined(paths[0], paths[1])
+            result["load_seconds"] = time.perf_counter() - start
+
+    if case["batch_size"] > 0:
+        with tempfile.TemporaryDirectory() as directory:
+            path = write_keyed_file(points, directory)
+            start = time.perf_counter()
+            kmeans_pp.fit_minibatch(path, k, case["iter"], 0.0, case["batch_size"], case["seed"])
+            result["stream_seconds"] = time.perf_counter() - start
+
+    start = time.perf_counter()
+    chosen = mykmeanssp.init_pp(points, k, case["seed"], threads)
+    result["seeding_seconds"] = time.perf_counter() - start
+
+    info = {}
+    centroids = np.ascontiguousarray(points[list(chosen)])
+    start = time.perf_counter()
+    mykmeanssp.fit(points, centroids, case["iter"], 0.0, k, threads, algorithm, info, trace=True)
+    result["fit_seconds"] = time.perf_counter() - start
+
+    result["iterations"] = info["iterations"]
+    result["converged"] = info["iterations"] < case["iter"]
+    result["assign_seconds"] = sum(record["assign_seconds"] for record in info["trace"])
+    result["update_seconds"] = sum(record["update_seconds"] for record in info["trace"])
+    result["final_inertia"] = info["trace"][-1]["inertia"]
+    result["distance_evaluations"] = info["distance_evaluations"]
+    # Throughput of the iterations that ran, up to convergence, without the tracing pass or the setup of the run
+    result["points_iterations_per_second"] = n * info["iterations"] / (result["assign_seconds"] +
+                                                                        result["update_seconds"])
+    result["peak_rss_bytes"] = peak_rss_bytes()
+
+    return result
+
+
+def run_cases(args):
+    cases = []
+    for n in args.n:
+        for d in args.d:
+            for k in args.k:
+                for algorithm in args.algorithm:
+                    for threads in args.threads:
+                        cases.append({"n": n, "d": d, "k": k, "threads": threads, "algorithm": algorithm,
+                                      "iter": args.iter, "seed": args.seed, "load": not args.skip_load,
+                                      "batch_size": args.batch_size})
+
+    # One fresh process per case keeps the peak RSS of every case apart
+    results = []
+    context = multiprocessing.get_context("spawn")
+    with context.Pool(1, maxtasksperchild=1) as pool:
+        for case in cases:
+            if case["k"] >= case["n"]:
+                continue
+            results.append(pool.apply(run_case, (case,)))
+            print("n=%(n)d d=%(d)d k=%(k)d threads=%(threads)d %(algorithm)s: %(points_iterations_per_second).3g "
+                  "points*iterations/s over %(iterations)d iterations" % results[-1], file=sys.stderr)
+
+    return results
+
+
+# *** Reference cases *** #
+
+def run_reference_cases():
+    # Runs kmeans_pp.py on the cases of test_readme.txt and compares its output with the expected one
+    directory = os.path.dirname(os.path.abspath(__file__))
+    results = []
+
+    for number, case in enumerate(REFERENCE_CASES, 1):
+        start = time.perf_counter()
+        process = subprocess.run([sys.executable, "kmeans_pp.py"] + case[:-1], cwd=directory,
+                                 capture_output=True, text=True)
+        seconds = time.perf_counter() - start
+
+        with open(os.path.join(directory, case[-1])) as expected:
+            matches = process.returncode == 0 and process.stdout == expected.read()
+        results.append({"case": number, "matches": matches, "seconds": seconds})
+
+    return results
+
+
+def main():
+    args = read_arguments()
+
+    report = {
+        "machine": {
+            "platform": platform.platform(),
+            "python": platform.python_version(),
+            "cpus": os.cpu_count(),
+            "simd": mykmeanssp.simd,
+        },
+        "reference": [] if args.skip_reference else run_reference_cases(),
+        "runs": run_cases(args),
+    }
+
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as output:
+            output.write(text + "\n")
+    else:
+        print(text)
+
+    if not all(result["matches"] for result in report["reference"]):
+        print("A reference case does not match its expected output!", file=sys.stderr)
+        exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,8 @@
 import sys
+import itertools
 import numpy as np
 import pandas as pd
 from math import sqrt
-from numpy import random
 import mykmeanssp
 
 
@@ -40,41 +40,18 @@ def read_arguments():
     file_name_1 = sys.argv[i]
     file_name_2 = sys.argv[j]
 
-    # Create DataFrames from the provided files
-    if file_name_1[-4:] == ".txt":  # In case a txt file is provided
-        data_1 = np.genfromtxt(file_name_1, dtype=float, encoding=None, delimiter=",")  # A two-dimensional numpy array
-        df1 = pd.DataFrame(data_1)
-
-    else:  # In case a csv file is provided
-        df1 = pd.read_csv(file_name_1, header=None)
-
-    if file_name_2[-4:] == ".txt":  # In case a txt file is provided
-        data_2 = np.genfromtxt(file_name_2, dtype=float, encoding=None, delimiter=",")  # A two-dimensional numpy array
-        df2 = pd.DataFrame(data_2)
-
-    else:  # In case a csv file is provided
-        df2 = pd.read_csv(file_name_2, header=None)
-
-    return flag_K, flag_iter, K, iter, eps, df1, df2
+    return flag_K, flag_iter, K, iter, eps, file_name_1, file_name_2
 
 
 def initialize():
     # Reading user arguments
-    flag_K, flag_iter, K, iter, eps, df1, df2 = read_arguments()
-
-    # Combine both input files by inner join using the first column in each file as a key
-    data = pd.merge(df1, df2, on=df1.columns[0])
-
-    data.columns = ['index'] + [f'x{i}' for i in range(1, data.shape[1])]
-
-    data['index'] = data['index'].astype(int)
-    data = data.set_index('index')
+    flag_K, flag_iter, K, iter, eps, file_name_1, file_name_2 = read_arguments()
 
-    # Sort the data points by the key in ascending order
-    sorted_indices = np.argsort(data.index)
-    data = data.iloc[sorted_indices]
+    # Combine both input files by inner join using the first column in each file as a key, sorted by the key.
+    # The C extension parses both files in parallel and joins them straight into one float64 matrix
+    keys, data = mykmeanssp.load_joined(file_name_1, file_name_2)
 
-    return flag_K, flag_iter, K, iter, eps, data
+    return flag_K, flag_iter, K, iter, eps, np.asarray(keys), np.asarray(data)
 
 
 # *** Algorithm *** #
@@ -96,33 +73,42 @@ def dist(x1, x2):
     return sqrt(np.sum(np.square(x1 - x2)))
 
 
-def init_centroids(data, K):
-    idx = data.index.tolist()
-    N = data.shape[0]
-    centroids = []
-    centroids_index = []
+def init_centroids(data, keys, K, seed, method="k-means++"):
+    # k-means++ runs in the C extension, which only compares each point with the newest centroid in every round
+    # and returns the same choices as numpy.random.seed(seed) followed by D^2 sampling with numpy.random.choice.
+    # "k-means||" oversamples candidates in a few parallel rounds instead of K sequential ones
+    idx = keys.tolist()
+    values = np.ascontiguousarray(data, dtype=np.float64)
 
-    # Choose one center uniformly at random
-    i = random.randint(N)
-    new_centroid = data.iloc[i].values
-    centroids.append(new_centroid)
-    centroids_index.append(idx[i])
+    if method == "k-means||":
+        chosen = mykmeanssp.init_parallel(values, K, seed)
+    else:
+        chosen = mykmeanssp.init_pp(values, K, seed)
 
-    # Repeat until K centers have been chosen
-    for _ in range(1, K):
-        distances = np.sqrt(np.sum(np.square(data.values - np.array(centroids)[:, np.newaxis]), axis=2))
-        min_distances = np.min(distances, axis=0)
-        sum_dist = np.sum(min_distances)
-        probabilities = min_distances / sum_dist
-
-        l = np.random.choice(range(N), 1, p=probabilities)[0]
-        new_centroid = data.iloc[l].values
-        centroids.append(new_centroid)
-        centroids_index.append(idx[l])
+    centroids = [values[l] for l in chosen]
+    centroids_index = [idx[l] for l in chosen]
 
     return centroids, centroids_index
 
 
+def read_chunks(file_name, batch_size):
+    # Yields the rows of a keyed csv/txt file as contiguous float64 matrices of at most batch_size rows, without the
+    # key in the first column, as load_joined drops it. The file is never held whole
+    for chunk in pd.read_csv(file_name, header=None, chunksize=batch_size):
+        yield np.ascontiguousarray(chunk.values[:, 1:], dtype=np.float64)
+
+
+def fit_minibatch(file_name, K, iter, eps, batch_size, seed=0):
+    # Mini-batch k-means over a keyed file streamed with read_chunks: the centroids are seeded with k-means++ on the
+    # first chunk, which then goes through the run like every other one
+    chunks = read_chunks(file_name, batch_size)
+    first = next(chunks)
+    centroids = np.ascontiguousarray(first[list(mykmeanssp.init_pp(first, K, seed))])
+
+    return np.asarray(mykmeanssp.fit(itertools.chain([first], chunks), centroids, iter, eps, K,
+                                     batch_size=batch_size))
+
+
 def print_vectors(vectors):
     str1 = ''
 
@@ -132,22 +118,20 @@ def print_vectors(vectors):
 
 
 def k_means_pp_algorithm():
-    flag_K, flag_iter, K, iter, eps, data = initialize()
+    flag_K, flag_iter, K, iter, eps, keys, data = initialize()
     valid_args = check_arguments(flag_K, flag_iter, K, data.shape[0], iter)
 
     if valid_args:
-        np.random.seed(0)
-        centroids, centroids_index = init_centroids(data, K)
-
-        for i in range(0, len(centroids)):
-            centroids[i] = centroids[i].tolist()
+        centroids, centroids_index = init_centroids(data, keys, K, 0)
 
-        data = data.values.tolist()
+        # Both matrices are handed to the C extension as contiguous float64 buffers, without copying
+        centroids = np.ascontiguousarray(centroids, dtype=np.float64)
 
-        centroids = mykmeanssp.fit(data, centroids, iter, eps, K)
+        centroids = np.asarray(mykmeanssp.fit(data, centroids, iter, eps, K))
 
         print(','.join(map(str, centroids_index)))
         print_vectors(centroids)
 
 
-k_means_pp_algorithm()
+if __name__ == "__main__":
+    k_means_pp_algorithm()
@@ -0,0 +1,136 @@
+import multiprocessing
+from multiprocessing import shared_memory
+import numpy as np
+import mykmeanssp
+
+
+# Sharded k-means: every worker process owns a contiguous slice of the points and, each iteration, labels them and
+# updates the partial sums and counts of its clusters (mykmeanssp.shard_assign). The coordinator reduces the partial
+# sums into the new centroids (mykmeanssp.combine_shards) and the workers read them for the next iteration.
+# The points, centroids, labels and partial sums live in shared memory, and the processes only exchange a few
+# bytes per iteration over pipes. The slices and the reduction are those of mykmeanssp.fit with n_threads=n_shards,
+# so both return the same centroids.
+
+
+# *** Shared memory *** #
+
+def create_shared_array(shape, dtype, blocks):
+    size = max(int(np.prod(shape)) * np.dtype(dtype).itemsize, 1)
+    block = shared_memory.SharedMemory(create=True, size=size)
+    blocks.append(block)
+    array = np.ndarray(shape, dtype=dtype, buffer=block.buf)
+    array.fill(0)
+
+    return array, (block.name, shape, np.dtype(dtype).str)
+
+
+def attach_shared_array(description, blocks):
+    name, shape, dtype = description
+    block = shared_memory.SharedMemory(name=name)
+    blocks.append(block)
+
+    return np.ndarray(shape, dtype=dtype, buffer=block.buf)
+
+
+# *** Shards *** #
+
+def shard_bounds(N, n_shards, shard):
+    # The partition of the workers of mykmeanssp.fit
+    return N * shard // n_shards, N * (shard + 1) // n_shards
+
+
+def run_shard(shard, n_shards, descriptions, connection):
+    blocks = []
+    try:
+        data, centroids, labels, sums, counts = [attach_shared_array(description, blocks)
+                                                 for description in descriptions]
+        begin, end = shard_bounds(data.shape[0], n_shards, shard)
+        points, shard_labels = data[begin:end], labels[begin:end]
+
+        # Every message is whether to refresh the sums, until None
+        while True:
+            refresh = connection.recv()
+            if refresh is None:
+                break
+            try:
+                connection.send(mykmeanssp.shard_assign(points, centroids, shard_labels, sums[shard], counts[shard],
+                                                        refresh))
+            except Exception as error:
+                connection.send(error)
+    finally:
+        # The views must go before the blocks they map can be closed
+        data = centroids = labels = sums = counts = points = shard_labels = None
+        for block in blocks:
+            block.close()
+        connection.close()
+
+
+# *** Algorithm *** #
+
+def fit_sharded(data, centroids, iter, eps, K, n_shards=2, info=None):
+    # Returns the K final centroids as a float64 array, like np.asarray(mykmeanssp.fit(data, centroids, iter, eps, K,
+    # n_shards)). If info is a dict, it receives 'iterations'
+    data = np.ascontiguousarray(data, dtype=np.float64)
+    centroids = np.ascontiguousarray(centroids, dtype=np.float64)
+    N, d = data.shape
+
+    if K <= 0 or centroids.shape[0] < K or centroids.shape[1] != d:
+        raise ValueError("centroids must have at least K rows and the same dimension as the data")
+    n_shards = max(1, min(n_shards, N))
+
+    blocks, processes, connections = [], [], []
+    try:
+        shared_data, data_description = create_shared_array((N, d), np.float64, blocks)
+        shared_centroids, centroids_description = create_shared_array((K, d), np.float64, blocks)
+        labels, labels_description = create_shared_array((N,), np.int32, blocks)
+        sums, sums_description = create_shared_array((n_shards, K, d), np.float64, blocks)
+        counts, counts_description = create_shared_array((n_shards, K), np.int32, blocks)
+        shared_data[:] = data
+        shared_centroids[:] = centroids[:K]
+        descriptions = [data_description, centroids_description, labels_description, sums_description,
+                        counts_description]
+
+        context = multiprocessing.get_context("spawn")
+        for shard in range(n_shards):
+            parent, child = context.Pipe()
+            process = context.Process(target=run_shard, args=(shard, n_shards, descriptions, child), daemon=True)
+            process.start()
+            child.close()
+            processes.append(process)
+            connections.append(parent)
+
+        iteration, converged, refresh = 0, False, True
+        while not converged and iteration < iter:
+            iteration += 1
+            for connection in connections:
+                connection.send(refresh)
+
+            replies = [connection.recv() for connection in connections]
+            for reply in replies:
+                if isinstance(reply, Exception):
+                    raise reply
+
+            # Every label is new on the first iteration, whatever the labels were initialized to
+            reassigned = N if iteration == 1 else sum(replies)
+            converged, refresh = mykmeanssp.combine_shards(shared_centroids, sums, counts, eps, iteration,
+                                                           reassigned)
+
+        result = shared_centroids.copy()
+        if info is not None:
+            info["iterations"] = iteration
+    finally:
+        for connection in connections:
+            try:
+                connection.send(None)
+            except OSError:
+                pass
+            connection.close()
+        for process in processes:
+            process.join()
+
+        shared_data = shared_centroids = labels = sums = counts = None
+        for block in blocks:
+            block.close()
+            block.unlink()
+
+    return result
@@ -1,743 +1,7075 @@
-#define PY_SSIZE_T_CLEAN
-#include <Python.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <math.h>
-#include <ctype.h>
-#include <float.h>
-
-/* To Compile:
- * gcc -ansi -Wall -Wextra -Werror -pedantic-errors kmeans.c -o kmeans -lm
- * */
-
-static int N = 0;
-static int d = 1; /* Dimension is at least 1. */
-static int K = 0;
-static int iter = 200;
-static double eps = 0.001;
-
-static struct vector *backup_vectors;
-static struct vector *backup_centroids;
-static struct vector **backup_clusters;
-
-/* Structs definitions */
-struct entry {
-    double value;
-    struct entry *next;
-};
-
-struct vector {
-    struct vector *next;
-    struct entry *entries;
-};
-
-/* Functions declarations */
-int main(int argc, char *argv[]);
-struct vector* read_data_points();
-void print_vectors(struct vector *vectors);
-void print_centroids(struct vector *centroids);
-int check_argument(int smallest, char arg[], int largest);
-int is_number(char number[]);
-
-struct vector* k_means(struct vector *vectors, struct vector *centroids);
-struct vector* copy_first_K_vectors(struct vector* vectors);
-struct entry* copy_entries(struct entry* original_entries);
-struct vector** assign_data_points_to_clusters(struct vector *data_points, struct vector *centroids);
-int arg_min_dist(struct vector data_point, struct vector *centroids);
-struct vector* get_new_centroids(struct vector **clusters);
-struct vector* zero_vector();
-int compute_flag_delta(struct vector *old_centroids, struct vector *new_centroids);
-
-struct entry* sum_entries(struct entry *u, struct entry *v);
-struct vector* sum_vectors_in_cluster(struct vector *cluster);
-struct vector divide_by_scalar(struct vector v, double scalar);
-int count_vectors_in_cluster(struct vector *cluster);
-double dist(struct vector u, struct vector v);
-void free_vectors(struct vector *head);
-void free_centroids(struct vector *centroids);
-void free_entries(struct entry *head);
-void free_clusters(struct vector **clusters);
-void mem_error();
-void free_backups();
-
-static struct vector* convert_from_python_to_c(PyObject *list_of_lists);
-static PyObject* convert_from_c_to_python(struct vector* centroids);
-
-/* Code */
-int main(int argc, char *argv[]) {
-    return 0;
-}
-
-/** Argument reading and processing **/
-
-struct vector* read_data_points(){
-
-    struct vector *head_vec, *curr_vec;
-    struct entry *head_entry, *curr_entry;
-    double n;
-    char c;
-
-    head_entry = malloc(sizeof(struct entry));
-    if (head_entry == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-    curr_entry = head_entry;
-    curr_entry->next = NULL;
-
-    curr_vec = malloc(sizeof(struct vector));
-    if (curr_vec == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-    curr_vec->next = NULL;
-    head_vec = curr_vec;
-    backup_vectors = head_vec;
-
-    while (scanf("%lf%c", &n, &c) == 2) {
-
-        /* We have read all the entries for the current vector */
-        if (c == '\n') {
-
-            curr_entry->value = n;
-            curr_vec->entries = head_entry;
-            curr_vec->next = calloc(1, sizeof(struct vector));
-            if (curr_vec->next == NULL) {   /* Memory allocation failed */
-                mem_error();
-            }
-            curr_vec = curr_vec->next;
-            curr_vec->next = NULL;
-            head_entry = malloc(sizeof(struct entry));
-            if (head_entry == NULL) {   /* Memory allocation failed */
-                mem_error();
-            }
-            curr_entry = head_entry;
-            curr_entry->next = NULL;
-
-            /* Count the number of vectors N */
-            N++;
-            continue;
-        }
-
-        /* Read the next entry of the current vector */
-        curr_entry->value = n;
-        curr_entry->next = malloc(sizeof(struct entry));
-        if (curr_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        curr_entry = curr_entry->next;
-        curr_entry->next = NULL;
-
-        /* Count the dimension d */
-        if (N == 0)
-            d++;
-    }
-
-    free_entries(head_entry);
-
-    return head_vec;
-}
-
-void print_vectors(struct vector *vectors) {
-    struct vector* curr_vec = vectors;
-
-    while (curr_vec != NULL) {
-        struct entry* entry = curr_vec->entries;
-        while (entry != NULL) {
-            printf("%.4f ", entry->value);
-            entry = entry->next;
-        }
-        printf("\n");
-        fflush(stdout); 
-        curr_vec = curr_vec->next;
-    }
-}
-
-void print_centroids(struct vector *centroids) {
-    struct entry* entry;
-    int i = 0;
-    for (; i < K; i++) {
-        entry = centroids[i].entries;
-        while (entry != NULL) {
-            if (entry->next == NULL)
-                printf("%.4f", entry->value);
-            else
-                printf("%.4f,", entry->value);
-            entry = entry->next;
-        }
-        printf("\n");
-        fflush(stdout); 
-    }
-}
-
-/* Returns 1 if and only if all requirements of the argument are met. */
-int check_argument(int smallest, char arg[], int largest){
-    int flag_is_num = is_number(arg);
-    int num;
-
-    if (flag_is_num == 1) {
-        num = atoi(arg);
-        if (num <= smallest || largest <= num)
-            return 0;
-        return 1;
-    }
-    return 0;
-}
-
-/* Returns 1 if and only if number is an integer. */
-int is_number(char number[]) {
-    int i = 0;
-
-    if (number == NULL || number[0] == '\0') {
-        return 0;
-    }
-
-    /* Checking for negative numbers */
-    if (number[0] == '-')
-        i = 1;
-
-    for (; number[i] != 0; i++) {
-        /* If (number[i] > '9' || number[i] < '0') */
-        if (!isdigit(number[i])) {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-/*  input: Linked list of vectors.
-    output: array of vectors */
-struct vector* k_means(struct vector *vectors, struct vector *centroids_) {
-    int iteration_number = 0;
-    int flag_delta = 0;
-    struct vector **clusters;
-    struct vector *new_centroids, *centroids;
-
-    centroids = copy_first_K_vectors(centroids_);
-
-    /* Initialize centroids as first K vectors */
-    backup_centroids = centroids;
-
-    /* Repeat until convergence of centroids or until iteration_number == iter */
-    while ((flag_delta == 0) && (iteration_number < iter)) {
-
-        iteration_number++;
-
-        /* Free previous clusters */
-        if (iteration_number > 1 && clusters != NULL)
-            free_clusters(clusters);
-
-        /* Assign every x_i to the closest cluster */
-        clusters = assign_data_points_to_clusters(vectors, centroids);
-        backup_clusters = clusters;
-
-        /* Get new centroids */
-        new_centroids = get_new_centroids(clusters);
-        backup_centroids = centroids;
-        
-
-        /* Check convergence of centroids */
-        flag_delta = compute_flag_delta(centroids, new_centroids);
-
-        /* Free previous centroids */
-        free_centroids(centroids);
-
-        /* Update centroids */
-        centroids = new_centroids;
-    }
-
-    free_clusters(clusters);
-
-    return centroids;
-}
-
-struct vector* copy_first_K_vectors(struct vector* vectors){
-    struct vector *centroids;
-    struct vector *curr_vec;
-    struct vector *curr_cent;
-    int i = 0;
-
-    centroids = malloc(K * sizeof(struct vector));
-    if (centroids == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-
-    curr_vec = vectors;
-    for (; i < K; i++) {
-        curr_cent = &centroids[i];
-        curr_cent->entries = copy_entries(curr_vec->entries);
-        curr_cent->next = NULL;
-        curr_vec = curr_vec->next;
-    }
-
-    return centroids;
-}
-
-struct entry* copy_entries(struct entry* original_entries) {
-    struct entry* new_entries = NULL;
-    struct entry* current = original_entries;
-    struct entry* prev = NULL;
-    struct entry *new_entry;
-
-    while (current != NULL) {
-        new_entry = malloc(sizeof(struct entry));
-        if (new_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        new_entry->value = current->value;
-        new_entry->next = NULL;
-
-        if (prev != NULL)
-            prev->next = new_entry;
-        else
-            new_entries = new_entry;
-
-        prev = new_entry;
-        current = current->next;
-
-    }
-
-    return new_entries;
-}
-
-/* 
- * Returns an array of pointers of length K.
- * Each pointer in the array represents a centroid and points to a linked list of data points assigned to that centroid.
- * clusters[i] means that the cluster at index i has centroid indexed i as its closest centroid.
- */
-struct vector** assign_data_points_to_clusters(struct vector *data_points, struct vector *centroids) {
-    struct vector **clusters;
-    struct vector *curr_data_point = data_points; /* used to iterate over the data points. */
-    struct vector *data_point; /* used to make a copy of a data point. */
-    int i = 0;
-    int min_index = -1;
-
-    clusters = malloc(K * sizeof(struct vector*));
-    if (clusters == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-
-    for (; i < K; i++)
-        clusters[i] = NULL;
-
-    i = 0;
-    for (; i < N; i++) {
-        data_point = malloc(sizeof(struct vector));
-        if (data_point == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        data_point->entries = copy_entries(curr_data_point->entries);
-        data_point->next = NULL;
-                
-        min_index = arg_min_dist(*data_point, centroids);
-
-        if (clusters[min_index] != NULL)
-            data_point->next = clusters[min_index];
-
-        clusters[min_index] = data_point;
-        curr_data_point = curr_data_point->next;
-    }
-
-    return clusters;
-}
-
-int arg_min_dist(struct vector data_point, struct vector *centroids) {
-    double min_dis = DBL_MAX;
-    int min_index = -1;
-    int i = 0;
-    double distance;
-
-    for(; i < K; i++) {
-
-        distance = dist(data_point, centroids[i]);
-        if (distance < min_dis) {
-            min_dis = distance;
-            min_index = i;
-        }
-
-    }
-
-    return min_index;
-}
-
-/*
- * Returns a new array of length K which contains updated centroids.
-*/
-struct vector* get_new_centroids(struct vector **clusters) {
-    struct vector *new_centroids = malloc(K * sizeof(struct vector));
-    int i = 0, k = -1;
-    struct vector *sum_vector;
-
-    if (new_centroids == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-
-    i = 0;
-
-    /* For each centroid */
-    for (; i < K; ++i) {
-
-        /* Count number of vectors in cluster. */
-        k = count_vectors_in_cluster(clusters[i]);
-
-        /* Sum the vectors in its cluster. */
-        sum_vector = sum_vectors_in_cluster(clusters[i]);
-
-        /* Divide by the number of vectors in the cluster. */
-        new_centroids[i] = divide_by_scalar(*sum_vector, k);
-
-        free_entries(sum_vector->entries);
-        free(sum_vector);
-    }
-
-    return new_centroids;
-}
-
-struct entry* sum_entries(struct entry *u, struct entry *v) {
-    struct entry* new_entries = NULL;
-    struct entry* curr1 = u;
-    struct entry* curr2 = v;
-    struct entry* prev = NULL;
-    struct entry *new_entry;
-    double sum = 0;
-
-    while (curr1 != NULL && curr2 != NULL) {
-        new_entry = calloc(1, sizeof(struct entry));
-        sum = curr1->value + curr2->value;
-
-        if (new_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-
-        new_entry->value = sum;
-        new_entry->next = NULL;
-
-        if (prev != NULL)
-            prev->next = new_entry;
-        else
-            new_entries = new_entry;
-
-        prev = new_entry;
-        curr1 = curr1->next;
-        curr2 = curr2->next;
-    }
-
-    return new_entries;
-}
-
-struct vector* zero_vector(){
-    struct vector *v = calloc(1, sizeof(struct vector));
-    struct entry* zero_entries = NULL;
-    struct entry* prev = NULL;
-    struct entry *new_entry;
-    int i = 0;
-
-    for (; i < d; i++) {
-        new_entry = malloc(sizeof(struct entry));
-        if (new_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        new_entry->value = 0;
-        new_entry->next = NULL;
-
-        if (prev != NULL)
-            prev->next = new_entry;
-        else
-            zero_entries = new_entry;
-
-        prev = new_entry;
-    }
-
-    v->entries = zero_entries;
-    v->next = NULL;
-
-    return v;
-}
-
-struct vector* sum_vectors_in_cluster(struct vector *cluster) {
-   struct vector *curr_cluster_vector = cluster;
-   struct vector *sum_vector = zero_vector();
-
-   while (curr_cluster_vector != NULL){
-        struct entry *temp = sum_vector->entries;
-        sum_vector->entries = sum_entries(curr_cluster_vector->entries, temp);
-        free_entries(temp);
-
-        curr_cluster_vector = curr_cluster_vector->next;
-   }
-   return sum_vector;
-}
-
-struct vector divide_by_scalar(struct vector v, double scalar) {
-    struct vector result_vector;
-    struct entry* new_entries = NULL;
-    struct entry* curr_entry = v.entries;
-    struct entry* prev_entry = NULL;
-
-    while (curr_entry != NULL) {
-        struct entry* new_entry = malloc(sizeof(struct entry));
-        if (new_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-
-        new_entry->value = curr_entry->value / scalar;
-        new_entry->next = NULL;
-
-        if (prev_entry != NULL)
-            prev_entry->next = new_entry;
-        else
-            new_entries = new_entry;
-
-        prev_entry = new_entry;
-        curr_entry = curr_entry->next;
-    }
-
-    result_vector.entries = new_entries;
-    result_vector.next = NULL;
-
-    return result_vector;
-}
-
-int count_vectors_in_cluster(struct vector *cluster) {
-    struct vector *curr_vector = cluster;
-    int cnt = 0;
-
-    while (curr_vector != NULL) {
-        cnt++;
-        curr_vector = curr_vector->next;
-    }
-
-    return cnt;
-}
-
-/*
- * pre-condition: length of old_centroids == length of new_centroids.
- * returns: 1 if and only if each delta is strictly less than eps.
-*/
-int compute_flag_delta(struct vector *old_centroids, struct vector *new_centroids) {
-    int flag_delta = 1;
-    double delta = 0;
-    int i = 0;
-
-    for(; i < K; i++) {
-        delta = dist(old_centroids[i], new_centroids[i]);
-        if (delta >= eps){
-            flag_delta = 0;
-            break;
-        }
-
-    }
-
-    return flag_delta;
-}
-
-
-double dist(struct vector u, struct vector v) {
-    int i = 0;
-
-    struct entry *u_entry = u.entries;
-    struct entry *v_entry = v.entries;
-    double sum = 0;
-
-    for(; i < d; i++) {
-        sum += pow(u_entry->value - v_entry->value, 2);
-        u_entry = u_entry->next;
-        v_entry = v_entry->next;
-    }
-
-    return sqrt(sum);
-}
-
-void free_vectors(struct vector *head) {
-    if (head != NULL){
-        free_entries(head->entries);
-        free_vectors(head->next);
-        free(head);
-    }
-    head = NULL;
-    backup_vectors = head;
-}
-
-void free_centroids(struct vector *centroids) {
-    int i = 0;
-
-    for(; i < K; i++)
-        free_entries(centroids[i].entries);
-
-    free(centroids);
-    centroids = NULL;
-    backup_centroids = centroids;
-}
-
-void free_entries(struct entry *head) {
-    if (head != NULL){
-        free_entries(head->next);
-        free(head);
-    }
-    head = NULL;
-}
-
-void free_clusters(struct vector **clusters) {
-    int i = 0;
-
-    if (clusters == NULL)
-        return;
-
-    for(; i < K; i++) {
-        free_vectors(clusters[i]);
-    }
-
-    free(clusters);
-    clusters = NULL;
-    backup_clusters = clusters;
-}
-
-void mem_error(){
-    printf("Failed to allocate memory\n");
-
-    exit(1);
-}
-
-void free_backups(){
-    if (backup_clusters != NULL) free_clusters(backup_clusters);
-    if (backup_centroids != NULL) free_centroids(backup_centroids);
-    if (backup_vectors != NULL) free_vectors(backup_vectors);
-}
-
-
-/**  HW2 CODE  **/
-
-static PyObject* k_means_module_imp(PyObject *self, PyObject *args)
-{
-    PyObject *list_of_lists;
-    PyObject *list_of_lists2;
-
-    struct vector *centroids;
-    struct vector *vectors;
-
-    if(!PyArg_ParseTuple(args, "OOidi", &list_of_lists, &list_of_lists2, &iter, &eps, &K)) {
-        return NULL; /* In the CPython API, a NULL value is never valid for a
-                        PyObject* so it is used to signal that an error has occurred. */
-    }
-
-    centroids = convert_from_python_to_c(list_of_lists2);
-    vectors = convert_from_python_to_c(list_of_lists);
-
-    centroids = k_means(vectors, centroids);
-
-    PyObject *python_centroids = convert_from_c_to_python(centroids);
-
-    free_centroids(centroids);
-    free_vectors(vectors);
-    free_backups();
-
-    return Py_BuildValue("O", python_centroids);
-}
-
-static struct vector* convert_from_python_to_c(PyObject *list_of_lists) {
-    PyObject *list;
-    PyObject *item;
-
-    N = PyObject_Length(list_of_lists);
-    d = PyObject_Length(PyList_GetItem(list_of_lists, 0));
-
-    struct vector *head_vec, *curr_vec;
-    struct entry *head_entry, *curr_entry;
-
-    head_entry = malloc(sizeof(struct entry));
-    if (head_entry == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-    curr_entry = head_entry;
-    curr_entry->next = NULL;
-
-    curr_vec = malloc(sizeof(struct vector));
-    if (curr_vec == NULL) {   /* Memory allocation failed */
-        mem_error();
-    }
-    curr_vec->next = NULL;
-    head_vec = curr_vec;
-    backup_vectors = head_vec;
-
-    int i,j;
-    for (i = 0; i < N; i++) {
-        list = PyList_GetItem(list_of_lists, i);
-        for (j = 0; j < d; j++) {
-            item = PyList_GetItem(list, j);
-            double num = PyFloat_AsDouble(item);
-            curr_entry->value = num;
-            if (j+1 < d){
-                curr_entry->next = malloc(sizeof(struct entry));
-                if (curr_entry == NULL) {   /* Memory allocation failed */
-                    mem_error();
-                }
-                curr_entry = curr_entry->next;
-            }
-            curr_entry->next = NULL;
-        }
-
-        curr_vec->entries = head_entry;
-        curr_vec->next = calloc(1, sizeof(struct vector));
-        if (curr_vec->next == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        curr_vec = curr_vec->next;
-        curr_vec->next = NULL;
-        head_entry = malloc(sizeof(struct entry));
-        if (head_entry == NULL) {   /* Memory allocation failed */
-            mem_error();
-        }
-        curr_entry = head_entry;
-        curr_entry->next = NULL;
-    }
-
-    free_entries(head_entry);
-
-    return head_vec;
-}
-
-static PyObject* convert_from_c_to_python(struct vector *centroids){
-    PyObject *list_of_lists;
-
-    list_of_lists = PyList_New(K);
-    
-    int i,j;
-    for (i = 0; i < K; i++) {
-        PyList_SetItem(list_of_lists, i, PyList_New(d));
-        struct entry *curr_entry = centroids[i].entries;
-        for (j = 0; j < d; j++) {
-            PyObject* python_double = Py_BuildValue("d", curr_entry->value);
-            PyList_SetItem(PyList_GetItem(list_of_lists, i), j, python_double);
-            curr_entry = curr_entry->next;
-        }
-    }
-
-    return list_of_lists;
-}
-
-static PyMethodDef kmeansMethods[] = {
-    {"fit",                   /* the Python method name that will be used */
-      (PyCFunction) k_means_module_imp, /* the C-function that implements the Python function and returns static PyObject*  */
-      METH_VARARGS,           /* flags indicating parameters
-accepted for this function */
-      PyDoc_STR("An implementation of kmeans algorithm with smart initialization of the centroids.")}, /*  The docstring for the function */
-    {NULL, NULL, 0, NULL}     /* The last entry must be all NULL as shown to act as a
-                                 sentinel. Python looks for this entry to know that all
-                                 of the functions for the module have been defined. */
-};
-
-static struct PyModuleDef kmeansmodule = {
-    PyModuleDef_HEAD_INIT,
-    "mykmeanssp", /* name of module */
-    NULL, /* module documentation, may be NULL */
-    -1,  /* size of per-interpreter state of the module, or -1 if the module keeps state in global variables. */
-    kmeansMethods /* the PyMethodDef array from before containing the methods of the extension */
-};
-
-PyMODINIT_FUNC PyInit_mykmeanssp(void)
-{
-    PyObject *m;
-    m = PyModule_Create(&kmeansmodule);
-    if (!m) {
-        return NULL;
-    }
-    return m;
-}
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <ctype.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define KMEANS_X86_KERNELS 1
+#else
+#define KMEANS_X86_KERNELS 0
+#endif
+
+/* To Compile:
+ * gcc -ansi -Wall -Wextra -Werror -pedantic-errors kmeans.c -o kmeans -lm
+ * */
+
+#define ARENA_BLOCK_SIZE (1 << 20) /* Default size of a single arena block (1 MiB). */
+#define ARENA_ALIGNMENT 64         /* Every allocation starts on a cache line. */
+#define ROW_ALIGNMENT 4            /* Rows are padded to a multiple of 4 doubles (32 bytes). */
+#define POINT_FILE_MAGIC "KMPOINTS" /* First 8 bytes of a binary point file. */
+#define POINT_FILE_VERSION 1
+#define POINT_FILE_BLOCK_BYTES (4 << 20) /* Point files are streamed in blocks of 4 MiB. */
+#define POINT_FILE_WILL_NEED 0     /* Paging hints given to advise_point_file. */
+#define POINT_FILE_DONT_NEED 1
+#define PARSE_CHUNK_MIN_BYTES (1 << 16) /* Text smaller than this is parsed by one worker. */
+#define SMALL_D_MAX 16             /* Lloyd has an instance for every dimension up to this one. */
+#define DISTANCE_LANES 8           /* Partial sums of a squared distance, in the order every kernel shares. */
+#define GEMM_MIN_WORK 1024         /* K * d from which Lloyd computes distances with the blocked engine. */
+#define GEMM_PANEL 8               /* Centroids packed together by pack_centroids. */
+#define GEMM_PANEL_ROWS 4          /* Points multiplied with a panel at once. */
+#define GEMM_POINT_BLOCK 64        /* Points per score tile, a multiple of GEMM_PANEL_ROWS. */
+#define GEMM_CENTROID_BLOCK 256    /* Centroids per cache tile, a multiple of GEMM_PANEL. */
+#define GEMM_TIE_SLACK 8           /* Scores within GEMM_TIE_SLACK times their rounding error are checked again. */
+#define SUMS_REFRESH_PERIOD 16     /* k_means sums every point again every this many iterations. */
+#define BOUND_SLACK 1e-9           /* Relative slack of the Hamerly/Elkan bounds, well above d * DBL_EPSILON. */
+#define INDEX_MIN_K 16             /* Fewer centroids are simply scanned by the centroid index. */
+#define INDEX_BOUNDS_MAX_K 2048    /* More centroids are scanned too, their K x K distances being too large. */
+#define KD_TREE_MAX_D 8            /* The centroid index is a k-d tree up to this dimension. */
+#define KD_LEAF_SIZE 4             /* Centroids per k-d tree leaf. */
+#define KD_MAX_DEPTH 64            /* Bound on the depth of a k-d tree of at most INT_MAX centroids. */
+#define PREDICT_POOL_MIN_ROWS 4096 /* Fewer points are labelled by the calling thread alone. */
+#define PREDICT_GIL_MIN_ROWS 64    /* predict_batch keeps the GIL for fewer points. */
+#define CORESET_SEED_SAMPLE 64     /* Uniform candidates per center of the rough solution a coreset is sampled from. */
+
+/* Smoothing of the inertia of streamed mini-batches, whose total size is unknown: about the last 100 batches. */
+#define MINIBATCH_STREAM_ALPHA (2.0 / 101)
+
+/* The algorithms k_means can run. They all produce exactly the same labels. */
+#define ALGORITHM_LLOYD 0
+#define ALGORITHM_HAMERLY 1
+#define ALGORITHM_ELKAN 2
+
+/* The kinds of centroid index. */
+#define INDEX_SCAN 0
+#define INDEX_KD_TREE 1
+#define INDEX_BOUNDS 2
+
+/* The squared distance kernels selected once per process by init_distance_kernels. */
+static double (*squared_dist_kernel)(const double *u, const double *v, int n);
+static double (*squared_dist_f32_kernel)(const float *u, const float *v, int n);
+static const char *distance_kernel_name;
+static pthread_once_t distance_kernels_once = PTHREAD_ONCE_INIT;
+
+/* The panel kernel of the blocked distance engine, selected with squared_dist_kernel. */
+static void (*score_panel_kernel)(const double *const *x, const double *panel, const double *norms, int n,
+                                  double *out, int out_stride);
+
+/* Structs definitions */
+
+/*
+ * A bump allocator made of a chain of blocks.
+ * All the memory of a run is taken from a single arena and released at once by free_arena.
+ */
+struct arena_block {
+    struct arena_block *next;
+    size_t capacity;
+    size_t used;
+    char *data;
+};
+
+struct arena {
+    struct arena_block *blocks;
+    long long allocations;      /* Calls to arena_alloc since init_arena. */
+    long long allocated_bytes;  /* The bytes they took, padding included. */
+};
+
+/*
+ * A dense row-major matrix.
+ * Row i starts at values + i * stride, and only its first cols values are meaningful.
+ */
+struct matrix {
+    double *values;
+    int rows;
+    int cols;
+    int stride;
+};
+
+/* A matrix of float32 values, for data points stored in single precision. ROW works on both. */
+struct matrix_f {
+    float *values;
+    int rows;
+    int cols;
+    int stride;
+};
+
+/*
+ * The parameters of one call. Every module function fills its own context and passes it down (the workers reach
+ * it through their pool), so concurrent calls share nothing but the read-only distance kernels.
+ */
+struct context {
+    int N;        /* Number of data points. */
+    int d;        /* Dimension, at least 1. */
+    int K;        /* Number of clusters. */
+    int iter;     /* Maximal number of iterations. */
+    double eps;   /* The run has converged once no centroid moves by eps or more, or no point changes cluster. */
+};
+
+/* A worker of the pool, with its share of the data points and its private partial results. */
+struct worker {
+    struct worker_pool *pool;
+    pthread_t thread;
+    int id;
+    int begin;           /* The worker owns the data points [begin, end). */
+    int end;
+    struct matrix sums;  /* K x d partial sums of the owned points of each cluster. */
+    int *counts;         /* K partial cluster sizes. */
+    double *weights;     /* K partial cluster weights of a weighted run. */
+    long long distance_evaluations;  /* Point to centroid distances computed over the whole run. */
+    double *scratch;     /* d doubles of scratch space. */
+    double *tile;        /* GEMM_POINT_BLOCK x padded K scores of the blocked distance engine, K scores of the
+                            sparse kernels, or NULL. */
+    double block_sum;    /* A sum over the owned points, for the tasks that reduce one. */
+    int block_count;     /* A count over the owned points, for the tasks that reduce one. */
+    int reassigned;      /* Owned points whose label changed in the last assignment. */
+};
+
+/* A fixed set of threads that run the same task over their own slice of the data points. */
+struct worker_pool {
+    const struct context *ctx;
+    int n_threads;
+    int weighted;              /* The clusters are divided by the sum of their weights rather than their size. */
+    struct worker *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t work_done;
+    unsigned long generation;  /* Incremented every time a new task is posted. */
+    int pending;               /* Number of threads still running the current task. */
+    int stop;
+    void (*task)(struct worker *, void *);
+    void *arg;
+};
+
+/*
+ * The state kept between iterations by the triangle inequality algorithms (Hamerly and Elkan).
+ * All the bounds are on plain (not squared) distances.
+ */
+struct bounds {
+    double *upper;           /* N upper bounds on the distance from each point to its centroid. */
+    double *lower;           /* Lower bounds on the distances to the other centroids: N for Hamerly, N x K for Elkan. */
+    double *drifts;          /* K distances moved by the centroids in the last iteration. */
+    double max_drift;
+    double second_max_drift;
+    int max_drift_index;
+    double *separations;     /* K halves of the distance from each centroid to its closest other centroid. */
+    double *half_distances;  /* K x K halves of the centroid to centroid distances, for Elkan only. */
+};
+
+/* The centroids of the current iteration, as the blocked distance engine reads them. */
+struct gemm_centroids {
+    int padded_K;            /* K rounded up to whole panels. */
+    double *panels;          /* padded_K x d, packed by pack_centroids. */
+    double *norms;           /* padded_K squared centroid norms, 0 for the padding. */
+    double max_norm_root;    /* The largest centroid norm. */
+    double *point_norms;     /* N squared point norms, computed once per run. */
+};
+
+/* The fixed size header of a binary point file. */
+struct point_file_header {
+    char magic[8];         /* POINT_FILE_MAGIC */
+    uint32_t version;      /* POINT_FILE_VERSION */
+    uint32_t dtype;        /* 'd' for float64 or 'f' for float32. */
+    uint64_t rows;         /* N */
+    uint64_t cols;         /* d */
+    uint64_t data_offset;  /* Where the row-major values start. */
+    char reserved[24];
+};
+
+/* A point file mapped into memory. */
+struct point_file {
+    void *base;
+    size_t length;
+    char dtype;
+    char *data;            /* The first row. */
+    struct matrix points;  /* The rows, straight in the mapping, when dtype is 'd'. */
+    struct matrix_f points32;  /* The rows when dtype is 'f'. */
+    size_t row_bytes;
+    int block_rows;        /* Rows walked between two paging hints. */
+};
+
+/* The values of a text point file, parsed into a dense rows x cols matrix. */
+struct text_table {
+    double *values;
+    int rows;
+    int cols;
+    const char *error;  /* What is wrong with the file, or NULL. */
+    int error_line;
+    int os_error;       /* errno when the file could not be read. */
+};
+
+/* A row of a table and its key, for the join. */
+struct keyed_row {
+    double key;
+    int row;
+};
+
+/* A piece of a text point file, parsed by one worker. */
+struct text_chunk {
+    const char *begin;  /* Starts a line. */
+    const char *end;    /* Ends a line, or the text. */
+    struct text_table table;
+    int lines;          /* Number of lines, blank ones included. */
+};
+
+/* The arguments of the parsing task. */
+struct parse_step {
+    struct text_chunk *chunks;
+    int *status;
+};
+
+/* The arguments shared by the tasks of one Lloyd iteration. */
+struct lloyd_step {
+    struct matrix *data_points;     /* NULL when the data points are float32. */
+    struct matrix_f *data_points32; /* The float32 data points, or NULL. */
+    struct matrix_f centroids32;    /* The centroids rounded to float32, for data_points32. */
+    struct matrix *centroids;
+    int *labels;
+    int algorithm;
+    struct bounds *bounds;  /* NULL for Lloyd. */
+    struct gemm_centroids *gemm;  /* Set when Lloyd runs on the blocked distance engine. */
+    int first_pass;         /* The labels and bounds are not initialized yet. */
+    int refresh_sums;       /* The partial sums are summed again from every point, rather than updated. */
+    const double *weights;  /* The N weights of a weighted run, or NULL. */
+    struct point_file *file;  /* The file the data points are mapped from, or NULL. */
+    void (*assign_range)(struct worker *worker, struct lloyd_step *step, int begin, int end);
+};
+
+/* The Mersenne Twister state of numpy.random.RandomState. */
+struct mt19937 {
+    uint32_t key[624];
+    int pos;
+};
+
+/* The arguments shared by the tasks of one round of k-means++ seeding. */
+struct seeding_step {
+    struct matrix *data_points;
+    const double *newest;    /* The centroid chosen in the previous round. */
+    int first_round;
+    double *min_distances;   /* N distances from each point to its closest chosen centroid. */
+    double *probabilities;   /* N */
+    double total;            /* The pairwise sum of min_distances. */
+    size_t *leaf_offsets;    /* The subtrees of the pairwise summation summed by the workers. */
+    size_t *leaf_sizes;
+    double *leaf_sums;
+    int n_leaves;
+};
+
+/* The arguments shared by the tasks of k-means|| seeding. */
+struct parallel_seeding_step {
+    struct matrix *data_points;
+    int *candidates;          /* The indices of the candidates, in the order they were sampled. */
+    int n_candidates;
+    int first_new;            /* The candidates added since the distances were last updated. */
+    int *closest;             /* N: the candidate closest to each point. */
+    int *sampled;             /* N: where each worker writes the points it sampled, from its begin on. */
+    struct seeding_step cost_sum;  /* Its min_distances are the N squared distances to the closest candidate. */
+    double cost;
+    double oversampling;
+    uint64_t seed;
+    int round;
+};
+
+/* The state of a mini-batch k-means run. */
+struct minibatch {
+    struct matrix centroids;
+    struct matrix previous;  /* The centroids before the last step. */
+    double *weights;         /* K: the number of points each centroid has absorbed. */
+    int *labels;             /* batch_size */
+    int batch_size;
+    int max_no_improvement;  /* Stop after this many steps without a better smoothed inertia (0: never). */
+    double alpha;            /* Smoothing factor of the exponentially weighted average of the batch inertia. */
+    double ewa_inertia;
+    double best_inertia;
+    int no_improvement;
+    int steps;
+};
+
+/* What one iteration of k_means did, as recorded by a traced run. */
+struct iteration_stats {
+    int iteration;            /* From 1. */
+    double assign_seconds;    /* Wall time of the assignment, partial sums included. */
+    double update_seconds;    /* Wall time of the new centroids, the convergence check and the bound drifts. */
+    double inertia;           /* Sum of the squared distances of the points to the centroids they were assigned to. */
+    int reassigned;           /* Points whose label changed, all of them on the first iteration. */
+    double max_shift;         /* The largest distance a centroid moved by. */
+    long long allocations;    /* Arena allocations made by the iteration. */
+};
+
+/*
+ * The per-iteration instrumentation of k_means, which costs nothing but a test per iteration when a run is not
+ * traced. The records are malloc'd and released by free_run_trace.
+ */
+struct run_trace {
+    struct iteration_stats *iterations;  /* One record per iteration run. */
+    int count;
+    int capacity;
+    int every;                /* The callback runs after every this many iterations. */
+    int (*callback)(struct run_trace *trace, const struct iteration_stats *record);  /* Nonzero stops the run. */
+    void *callback_data;
+};
+
+/* Counters reported at the end of a run. */
+struct run_stats {
+    int iterations;
+    long long distance_evaluations;
+    long long skipped_distance_evaluations;  /* Compared with plain Lloyd, which computes N x K per iteration. */
+    long long allocations;                   /* Arena allocations made by the run, and their total size. */
+    long long allocated_bytes;
+    struct run_trace *trace;                 /* Set by the caller to trace k_means, or NULL. */
+};
+
+/* One run of fit_many: its parameters, and its results once it is done. */
+struct batched_run {
+    int K;
+    unsigned long seed;
+    int iter;
+    double eps;
+    int algorithm;
+    int *indices;             /* K: the data points chosen by k-means++. */
+    struct matrix centroids;  /* K x d final centroids. */
+    double inertia;           /* Sum of the squared distances of the points to their closest final centroid. */
+    int iterations;
+    int status;               /* 0, or -1 if the data has fewer than K distinct points. */
+};
+
+/* The queue of runs that the workers of fit_many take from. */
+struct batched_runs_step {
+    struct matrix *data_points;
+    struct batched_run *runs;
+    struct keyed_row *order;  /* The runs by decreasing cost, so the longest ones start first. */
+    int n_runs;
+    int next;                 /* The next entry of order to run. */
+    pthread_mutex_t lock;
+};
+
+/*
+ * A sparse matrix in compressed sparse row (CSR) form: the non-zeros of row i are values[indptr[i], indptr[i + 1]),
+ * in the columns indices[indptr[i], indptr[i + 1]).
+ */
+struct csr_matrix {
+    const long long *indptr;  /* rows + 1 */
+    const int *indices;
+    const double *values;
+    int rows;
+    int cols;
+};
+
+/* The arguments shared by the tasks of a sparse k-means iteration or prediction. */
+struct sparse_step {
+    const struct csr_matrix *points;
+    struct matrix transposed;  /* d x K: the centroids column by column, set by prepare_sparse_centroids. */
+    double *centroid_norms;    /* K squared norms of the centroids. */
+    int *labels;
+    int refresh_sums;          /* The partial sums are summed again from every point, rather than updated. */
+};
+
+/* A node of the k-d tree of a centroid index. */
+struct kd_node {
+    int axis;       /* The coordinate the node splits on, or -1 for a leaf. */
+    double split;   /* The centroids under left have their axis coordinate <= split, those under right >= split. */
+    int left;
+    int right;
+    int begin;      /* A leaf holds the centroids order[begin, end). */
+    int end;
+};
+
+/*
+ * An index over fixed centroids, answering nearest centroid queries with exactly the label arg_min_dist gives:
+ * a k-d tree in low dimensions, and otherwise a scan that skips the centroids the triangle inequality rules out.
+ */
+struct centroid_index {
+    int kind;                  /* INDEX_SCAN, INDEX_KD_TREE or INDEX_BOUNDS. */
+    struct matrix *centroids;
+    struct arena arena;        /* Released whenever the index is rebuilt. */
+    struct kd_node *nodes;     /* The root is nodes[0]. */
+    int *order;                /* K: the centroids, leaf by leaf. */
+    double *half_distances;    /* K x K: half the distance between two centroids, less BOUND_SLACK. */
+    double *separations;       /* K: the smallest of the half distances of each centroid. */
+};
+
+/* The arguments of predict_task. */
+struct predict_step {
+    struct centroid_index *index;
+    struct matrix *points;
+    int *labels;
+};
+
+/* The arguments shared by the passes of a coreset construction. */
+struct coreset_step {
+    struct matrix *data_points;
+    struct matrix centers;         /* The rough solution the sensitivities are measured against. */
+    struct centroid_index index;   /* Over centers. */
+    double *partial_costs;         /* n_threads x centers.rows: the squared distances to each center, per worker. */
+    double *costs;                 /* The sums of the partial costs and the sizes of the clusters of the centers. */
+    int *sizes;
+    double mean_cost;              /* The cost of the solution over N. */
+    double alpha;
+    double total_sensitivity;
+    double m;                      /* The expected size of the coreset. */
+    uint64_t seed;
+    int **sampled;                 /* Per worker: the points it sampled and their weights, malloc'd. */
+    double **sampled_weights;
+    int *n_sampled;
+};
+
+/*
+ * A model kept between calls: its training points, their labels, and the per-cluster sums and counts under those
+ * labels, so new points are folded in without going over the old ones again.
+ */
+struct model {
+    struct context ctx;       /* N is the number of points held. */
+    int capacity;             /* Rows allocated in points and labels. */
+    struct matrix points;     /* N x d, oldest first. */
+    int *labels;              /* N: the cluster each point was last assigned to. */
+    struct arena arena;       /* Holds the K x d buffers, which never change size. */
+    struct matrix centroids;
+    struct matrix sums;       /* The sums of the points of each cluster. */
+    int *counts;
+    int iterations;           /* Lloyd iterations run by the last fit or partial_fit. */
+    struct centroid_index index;  /* Over centroids, rebuilt whenever they change. */
+};
+
+#define ROW(m, i) ((m)->values + (size_t)(i) * (size_t)(m)->stride)
+
+/* Functions declarations */
+int main(int argc, char *argv[]);
+struct matrix read_data_points(struct context *ctx, struct arena *arena);
+void print_vectors(struct matrix *vectors);
+void print_centroids(struct matrix *centroids);
+int check_argument(int smallest, char arg[], int largest);
+int is_number(char number[]);
+
+struct matrix k_means(const struct context *ctx, struct arena *arena, struct matrix *vectors,
+                      struct matrix_f *vectors32, const double *weights, struct matrix *centroids, int n_threads,
+                      int algorithm, struct point_file *file, struct run_stats *stats, int *labels);
+void copy_first_K_vectors(struct matrix *centroids, struct matrix *vectors);
+void init_run_trace(struct run_trace *trace, int every, int (*callback)(struct run_trace *,
+                    const struct iteration_stats *), void *callback_data);
+void free_run_trace(struct run_trace *trace);
+int record_iteration(struct run_trace *trace, struct worker_pool *pool, struct lloyd_step *step,
+                     struct matrix *new_centroids, struct iteration_stats *record);
+static void trace_task(struct worker *worker, void *arg);
+double elapsed_seconds(const struct timespec *start, const struct timespec *end);
+void assign_data_points_to_clusters(struct worker_pool *pool, struct lloyd_step *step);
+static void assign_task(struct worker *worker, void *arg);
+static void assign_blocks(struct worker *worker, struct lloyd_step *step);
+static void lloyd_range(struct worker *worker, struct lloyd_step *step, int begin, int end);
+static void (*const lloyd_range_fixed_d[SMALL_D_MAX + 1])(struct worker *, struct lloyd_step *, int, int);
+static void lloyd_range_f32(struct worker *worker, struct lloyd_step *step, int begin, int end);
+static void weighted_lloyd_range(struct worker *worker, struct lloyd_step *step, int begin, int end);
+void narrow_centroids(struct matrix_f *centroids32, struct matrix *centroids);
+static void gemm_range(struct worker *worker, struct lloyd_step *step, int begin, int end);
+static void point_norms_task(struct worker *worker, void *arg);
+void init_gemm(struct gemm_centroids *gemm, struct arena *arena, struct worker_pool *pool);
+void pack_centroids(struct gemm_centroids *gemm, struct matrix *centroids);
+static void hamerly_range(struct worker *worker, struct lloyd_step *step, int begin, int end);
+static void elkan_range(struct worker *worker, struct lloyd_step *step, int begin, int end);
+static void separation_task(struct worker *worker, void *arg);
+void compute_centroid_drifts(struct bounds *bounds, struct matrix *old_centroids, struct matrix *new_centroids);
+double loosen_upper_bound(double upper, double drift);
+double loosen_lower_bound(double lower, double drift);
+void init_bounds(const struct context *ctx, struct bounds *bounds, struct arena *arena, int algorithm);
+static void clear_partial_sums(struct worker *worker);
+static void add_to_partial_sums(struct worker *worker, int label, const double *data_point);
+static void add_to_partial_sums_f32(struct worker *worker, int label, const float *data_point);
+static void remove_from_partial_sums(struct worker *worker, int label, const double *data_point);
+static void remove_from_partial_sums_f32(struct worker *worker, int label, const float *data_point);
+static void update_partial_sums(struct worker *worker, const struct lloyd_step *step, int old_label, int label,
+                                const double *data_point);
+static void update_partial_sums_f32(struct worker *worker, const struct lloyd_step *step, int old_label, int label,
+                                    const float *data_point);
+static void add_weighted_to_partial_sums(struct worker *worker, int label, const double *data_point, double weight);
+static void remove_weighted_from_partial_sums(struct worker *worker, int label, const double *data_point,
+                                              double weight);
+static void update_weighted_partial_sums(struct worker *worker, const struct lloyd_step *step, int old_label,
+                                         int label, const double *data_point, double weight);
+int arg_min_dist(const double *data_point, struct matrix *centroids);
+int arg_min_dist_f32(const float *data_point, struct matrix_f *centroids);
+int arg_min_two_dist(const double *data_point, struct matrix *centroids, double *best, double *second);
+void get_new_centroids(struct worker_pool *pool, struct matrix *new_centroids, struct matrix *old_centroids);
+int compute_flag_delta(const struct context *ctx, struct matrix *old_centroids, struct matrix *new_centroids);
+
+void divide_by_scalar(double *v, double scalar, int n);
+
+void init_minibatch(const struct context *ctx, struct minibatch *mb, struct arena *arena,
+                    struct matrix *initial_centroids, int batch_size, int max_no_improvement, double alpha);
+int minibatch_step(struct worker_pool *pool, struct minibatch *mb, struct matrix *batch);
+static void minibatch_assign_task(struct worker *worker, void *arg);
+struct matrix minibatch_k_means(const struct context *ctx, struct arena *arena, struct matrix *vectors,
+                                struct matrix *initial_centroids, int batch_size, int max_no_improvement,
+                                unsigned long seed, int n_threads, struct run_stats *stats);
+
+void mt19937_seed(struct mt19937 *state, uint32_t seed);
+uint32_t mt19937_next(struct mt19937 *state);
+double mt19937_next_double(struct mt19937 *state);
+uint32_t mt19937_bounded(struct mt19937 *state, uint32_t max);
+double pairwise_sum(const double *a, size_t n);
+static void collect_pairwise_leaves(size_t offset, size_t n, size_t max_leaf, struct seeding_step *step);
+static double combine_pairwise_leaves(size_t n, size_t max_leaf, struct seeding_step *step, int *leaf);
+double numpy_dist(const double *u, const double *v, double *scratch, int n);
+int init_pp(const struct context *ctx, struct arena *arena, struct matrix *data_points, unsigned long seed,
+            int n_threads, int *indices);
+static void min_distances_task(struct worker *worker, void *arg);
+static void pairwise_leaves_task(struct worker *worker, void *arg);
+static void probabilities_task(struct worker *worker, void *arg);
+int sample_index(struct worker_pool *pool, struct seeding_step *step, double u);
+
+uint64_t splitmix64(uint64_t x);
+static double point_coin(uint64_t seed, int round, int i);
+int init_parallel(const struct context *ctx, struct arena *arena, struct matrix *data_points, unsigned long seed,
+                  int rounds, double oversampling, int n_threads, int *indices);
+static void candidate_distances_task(struct worker *worker, void *arg);
+static void oversample_task(struct worker *worker, void *arg);
+int recluster_candidates(const struct context *ctx, struct arena *arena, struct matrix *data_points,
+                         const int *candidates, const double *weights, int m, struct mt19937 *rng, int *indices);
+
+int build_coreset(const struct context *ctx, struct arena *arena, struct matrix *data_points, int m,
+                  unsigned long seed, int n_threads, int **indices, double **weights);
+static void coreset_cost_task(struct worker *worker, void *arg);
+static void coreset_sample_task(struct worker *worker, void *arg);
+int coreset_k_means(const struct context *ctx, struct arena *arena, struct matrix *data_points, int m,
+                    unsigned long seed, int n_threads, struct run_stats *stats, struct matrix *centroids,
+                    int *labels);
+
+void run_batched(struct arena *arena, struct matrix *data_points, struct batched_run *runs, int n_runs,
+                 int n_threads);
+static void batched_runs_task(struct worker *worker, void *arg);
+void run_one_batched(struct matrix *data_points, struct batched_run *run);
+double compute_inertia(struct matrix *data_points, struct matrix *centroids);
+
+int refresh_sums_due(int iteration, int reassigned, int N);
+int assign_shard(struct arena *arena, struct matrix *points, struct matrix *centroids, int *labels,
+                 struct matrix *sums, int *counts, int refresh);
+int combine_shards(struct arena *arena, struct matrix *centroids, struct matrix *sums, int **counts, int n,
+                   double eps, int reassigned);
+
+struct matrix sparse_k_means(const struct context *ctx, struct arena *arena, const struct csr_matrix *points,
+                             struct matrix *centroids, int n_threads, struct run_stats *stats, int *labels);
+void sparse_predict(struct arena *arena, const struct csr_matrix *points, struct matrix *centroids, int n_threads,
+                    int *labels);
+void init_sparse_step(struct sparse_step *step, struct arena *arena, struct worker_pool *pool,
+                      const struct csr_matrix *points, int K, int d);
+void prepare_sparse_centroids(struct sparse_step *step, struct matrix *centroids);
+int sparse_arg_min(const struct sparse_step *step, int i, double *scores);
+static void sparse_assign_task(struct worker *worker, void *arg);
+static void sparse_predict_task(struct worker *worker, void *arg);
+static void add_sparse_to_partial_sums(struct worker *worker, int label, const struct csr_matrix *points, int i);
+static void remove_sparse_from_partial_sums(struct worker *worker, int label, const struct csr_matrix *points,
+                                            int i);
+static void update_sparse_partial_sums(struct worker *worker, const struct sparse_step *step, int old_label,
+                                       int label, int i);
+
+void init_model(struct model *model, struct matrix *initial_centroids, int K, int iter, double eps);
+void free_model(struct model *model);
+void reserve_model_points(struct model *model, int rows);
+void model_add_points(struct model *model, struct matrix *points);
+void model_drop_points(struct model *model, int n);
+void model_update_centroids(struct model *model);
+void model_fit(struct model *model, int iter, int n_threads, int algorithm);
+void model_predict(struct model *model, struct matrix *points, int n_threads, int *labels);
+void predict_labels(struct centroid_index *index, struct matrix *points, int n_threads, int *labels);
+static void predict_task(struct worker *worker, void *arg);
+
+void build_centroid_index(struct centroid_index *index, struct matrix *centroids);
+static int build_kd_node(struct centroid_index *index, int *n_nodes, int begin, int end);
+static void select_along_axis(struct centroid_index *index, int axis, int begin, int end, int mid);
+int index_nearest(const struct centroid_index *index, const double *point, int guess);
+static int kd_tree_nearest(const struct centroid_index *index, const double *point);
+static int bounds_nearest(const struct centroid_index *index, const double *point, int guess);
+void index_predict(const struct centroid_index *index, struct matrix *points, int begin, int end, int *labels);
+
+char* read_text_stream(FILE *in, size_t *length);
+char* read_text_file(const char *path, size_t *length);
+double parse_double(const char *p, char **end);
+int parse_text_range(const char *p, const char *end, struct text_chunk *chunk);
+static void parse_chunks_task(struct worker *worker, void *arg);
+int parse_text_table(struct worker_pool *pool, const char *text, size_t length, struct text_table *table);
+int load_text_table(struct worker_pool *pool, const char *path, struct text_table *table);
+static int compare_keyed_rows(const void *a, const void *b);
+struct keyed_row* sort_table_keys(struct text_table *table);
+int join_tables(struct text_table *left, struct text_table *right, struct matrix *points, long long **keys);
+
+int open_point_file(const char *path, struct point_file *file, const char **error);
+void close_point_file(struct point_file *file);
+void advise_point_file(struct point_file *file, int begin, int end, int advice);
+long page_size();
+int write_point_file(const char *path, struct matrix *points, struct matrix_f *points32);
+
+double squared_dist(const double *u, const double *v, int n);
+double squared_dist_scalar(const double *u, const double *v, int n);
+static inline double squared_dist_lanes(const double *u, const double *v, int n);
+double squared_dist_f32_scalar(const float *u, const float *v, int n);
+double dot_product(const double *u, const double *v, int n);
+void init_distance_kernels();
+
+void init_arena(struct arena *arena);
+void* arena_alloc(struct arena *arena, size_t size);
+void free_arena(struct arena *arena);
+struct matrix alloc_matrix(struct arena *arena, int rows, int cols);
+struct matrix_f alloc_matrix_f(struct arena *arena, int rows, int cols);
+
+void init_worker_pool(struct worker_pool *pool, const struct context *ctx, struct arena *arena, int n_threads);
+void partition_worker_pool(struct worker_pool *pool, int n);
+void run_worker_pool(struct worker_pool *pool, void (*task)(struct worker *, void *), void *arg);
+void destroy_worker_pool(struct worker_pool *pool);
+static void* worker_main(void *arg);
+int available_cpus();
+void mem_error();
+
+struct py_matrix;
+static int convert_from_python_to_c(PyObject *obj, struct arena *arena, struct py_matrix *out, int keep_float32);
+static struct matrix convert_from_list_to_c(PyObject *list_of_lists, struct arena *arena);
+static void release_py_matrix(struct py_matrix *pm);
+static char buffer_item_type(const char *format);
+static int integer_item_size(Py_buffer *view);
+static int is_int32_buffer(Py_buffer *view);
+struct py_csr;
+static int is_csr_object(PyObject *obj);
+static int get_csr_parts(PyObject *obj, PyObject **parts, Py_ssize_t *rows, Py_ssize_t *cols);
+static long long integer_item(Py_buffer *view, Py_ssize_t k);
+static int convert_csr_from_python(PyObject *obj, struct arena *arena, struct py_csr *out);
+static void release_py_csr(struct py_csr *pc);
+static PyObject* fit_sparse(struct context *ctx, PyObject *data, PyObject *centroids_object, int n_threads,
+                            PyObject *info);
+static int get_output_buffer(PyObject *obj, Py_buffer *view, char type, Py_ssize_t items, const char *name);
+static int check_shard_labels(const int *labels, int n, int K);
+static int get_weights_buffer(PyObject *obj, Py_buffer *view, int n);
+static int parse_algorithm(const char *name);
+static int check_n_threads(int n_threads);
+static PyObject* fit_minibatch_stream(struct context *ctx, PyObject *batches, PyObject *centroids_object,
+                                      int batch_size, int max_no_improvement, int n_threads, PyObject *info);
+static PyObject* run_seeding(struct context *ctx, PyObject *data, unsigned long seed, int n_threads,
+                             int parallel, int rounds, double oversampling);
+static int fill_info(PyObject *info, struct run_stats *stats);
+static PyObject* iteration_stats_to_python(const struct iteration_stats *record);
+static int call_python_trace(struct run_trace *trace, const struct iteration_stats *record);
+static int fill_trace(PyObject *info, struct run_trace *trace);
+static int parse_batched_run(PyObject *config, int index, int n_points, struct batched_run *run);
+static PyObject* batched_run_to_python(struct batched_run *run);
+static PyObject* convert_from_c_to_python(struct matrix *centroids);
+static PyObject* convert_from_c_to_buffer(struct matrix *m);
+static PyObject* wrap_array(PyObject *module, void *items, const char *format, Py_ssize_t itemsize, int rows,
+                            int cols);
+static PyObject* convert_array_to_buffer(const void *items, int n, size_t item_size, const char *format);
+static int kmeans_module_exec(PyObject *m);
+
+/* The Python side of a traced fit: its callback, and the thread state saved while the run releases the GIL. */
+struct python_trace {
+    PyObject *callback;   /* NULL without a callback. */
+    PyThreadState *thread_state;
+    int failed;           /* The callback raised. */
+};
+
+struct kmeans_object;
+static int kmeans_object_init(struct kmeans_object *self, PyObject *args, PyObject *kwargs);
+static void kmeans_object_dealloc(struct kmeans_object *self);
+static int begin_model_call(struct kmeans_object *self);
+static int convert_model_points(struct kmeans_object *self, PyObject *obj, struct arena *arena,
+                                struct py_matrix *out);
+static int convert_model_csr(struct kmeans_object *self, PyObject *obj, struct arena *arena, struct py_csr *out);
+
+/* Code */
+int main(int argc, char *argv[]) {
+    return 0;
+}
+
+/** Argument reading and processing **/
+
+struct matrix read_data_points(struct context *ctx, struct arena *arena){
+
+    struct matrix vectors;
+    struct worker_pool pool;
+    struct text_table table;
+    char *text;
+    size_t length;
+    int i, status;
+
+    text = read_text_stream(stdin, &length);
+    if (text == NULL) {
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    /* Parse the input on every CPU; the pool has no points or clusters yet */
+    ctx->N = 0;
+    ctx->K = 0;
+    ctx->d = 0;
+    init_worker_pool(&pool, ctx, arena, 0);
+    status = parse_text_table(&pool, text, length, &table);
+    destroy_worker_pool(&pool);
+    free(text);
+
+    if (status < 0) {   /* Every row must have the dimension d of the first one */
+        printf("An Error Has Occurred\n");
+        exit(1);
+    }
+
+    ctx->N = table.rows;
+    ctx->d = table.cols;
+
+    vectors = alloc_matrix(arena, ctx->N, ctx->d);
+    for (i = 0; i < ctx->N; i++)
+        memcpy(ROW(&vectors, i), table.values + (size_t)i * ctx->d, ctx->d * sizeof(double));
+
+    free(table.values);
+
+    return vectors;
+}
+
+void print_vectors(struct matrix *vectors) {
+    int i, j;
+
+    for (i = 0; i < vectors->rows; i++) {
+        const double *row = ROW(vectors, i);
+        for (j = 0; j < vectors->cols; j++)
+            printf("%.4f ", row[j]);
+        printf("\n");
+        fflush(stdout);
+    }
+}
+
+void print_centroids(struct matrix *centroids) {
+    int i = 0, j;
+    for (; i < centroids->rows; i++) {
+        const double *row = ROW(centroids, i);
+        for (j = 0; j < centroids->cols; j++) {
+            if (j == centroids->cols - 1)
+                printf("%.4f", row[j]);
+            else
+                printf("%.4f,", row[j]);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+}
+
+/* Returns 1 if and only if all requirements of the argument are met. */
+int check_argument(int smallest, char arg[], int largest){
+    int flag_is_num = is_number(arg);
+    int num;
+
+    if (flag_is_num == 1) {
+        num = atoi(arg);
+        if (num <= smallest || largest <= num)
+            return 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Returns 1 if and only if number is an integer. */
+int is_number(char number[]) {
+    int i = 0;
+
+    if (number == NULL || number[0] == '\0') {
+        return 0;
+    }
+
+    /* Checking for negative numbers */
+    if (number[0] == '-')
+        i = 1;
+
+    for (; number[i] != 0; i++) {
+        /* If (number[i] > '9' || number[i] < '0') */
+        if (!isdigit(number[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*  input: matrix of N data points and matrix of K initial centroids.
+    output: matrix of K final centroids, allocated from the arena.
+    algorithm is one of the ALGORITHM_* constants, file is the point file vectors are mapped from (or NULL),
+    and stats receives the counters of the run, and every iteration if its trace is set. labels, if not NULL,
+    receives the N labels of the last assignment, whose cluster means are the final centroids. */
+/*
+ * Exactly one of vectors and vectors32 holds the data points. Only Lloyd runs on float32 data points: their
+ * centroids are still summed and kept in float64, and rounded to float32 for the distances every iteration.
+ * weights, if not NULL, are N non-negative weights of float64 points for Lloyd: every point counts weights[i] times
+ * in the sums and sizes of the clusters, as the points of a coreset stand for the many points they were sampled from.
+ */
+struct matrix k_means(const struct context *ctx, struct arena *arena, struct matrix *vectors,
+                      struct matrix_f *vectors32, const double *weights, struct matrix *centroids_, int n_threads,
+                      int algorithm, struct point_file *file, struct run_stats *stats, int *labels) {
+    int iteration_number = 0;
+    int flag_delta = 0, stopped = 0;
+    int t, reassigned = ctx->N;
+    struct worker_pool pool;
+    struct bounds bounds;
+    struct gemm_centroids gemm;
+    struct lloyd_step step;
+    struct matrix centroids, new_centroids, tmp;
+    struct run_trace *trace = stats->trace;
+    struct iteration_stats record;
+    struct timespec start, assigned, updated;
+    long long allocations = arena->allocations, allocated_bytes = arena->allocated_bytes;
+
+    /* Every buffer is allocated once and reused by every iteration */
+    centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    new_centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    init_worker_pool(&pool, ctx, arena, n_threads);
+
+    step.data_points = vectors;
+    step.data_points32 = vectors32;
+    step.labels = labels != NULL ? labels : arena_alloc(arena, (size_t)ctx->N * sizeof(int));
+    step.algorithm = algorithm;
+    step.bounds = NULL;
+    step.gemm = NULL;
+    step.first_pass = 1;
+    step.weights = weights;
+    step.file = file;
+    step.assign_range = lloyd_range;
+    if (ctx->d <= SMALL_D_MAX)
+        step.assign_range = lloyd_range_fixed_d[ctx->d];
+    if (algorithm == ALGORITHM_HAMERLY)
+        step.assign_range = hamerly_range;
+    if (algorithm == ALGORITHM_ELKAN)
+        step.assign_range = elkan_range;
+    if (algorithm != ALGORITHM_LLOYD) {
+        init_bounds(ctx, &bounds, arena, algorithm);
+        step.bounds = &bounds;
+    }
+
+    if (vectors32 != NULL) {
+        step.centroids32 = alloc_matrix_f(arena, ctx->K, ctx->d);
+        step.assign_range = lloyd_range_f32;
+    }
+
+    if (weights != NULL) {
+        step.assign_range = weighted_lloyd_range;
+        pool.weighted = 1;
+    }
+
+    /* With many centroids of many dimensions, the distances are a matrix product worth blocking */
+    if (algorithm == ALGORITHM_LLOYD && vectors32 == NULL && weights == NULL && ctx->K >= GEMM_PANEL &&
+        ctx->d >= GEMM_PANEL &&
+        (long long)ctx->K * ctx->d >= GEMM_MIN_WORK) {
+        init_gemm(&gemm, arena, &pool);
+        step.gemm = &gemm;
+        step.assign_range = gemm_range;
+        run_worker_pool(&pool, point_norms_task, &step);
+    }
+
+    copy_first_K_vectors(&centroids, centroids_);
+
+    /* Repeat until convergence of centroids or until iteration_number == iter */
+    while ((flag_delta == 0) && !stopped && (iteration_number < ctx->iter)) {
+
+        iteration_number++;
+        step.centroids = &centroids;
+
+        /* The partial sums are updated with the points that changed cluster, and summed again now and then
+           to bound the rounding error that builds up, or when so many points changed that it is cheaper */
+        step.refresh_sums = step.first_pass || refresh_sums_due(iteration_number, reassigned, ctx->N);
+        if (trace != NULL) {
+            record.iteration = iteration_number;
+            record.allocations = arena->allocations;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        /* The bounded algorithms prune with the distances between the current centroids */
+        if (step.bounds != NULL)
+            run_worker_pool(&pool, separation_task, &step);
+
+        if (step.data_points32 != NULL)
+            narrow_centroids(&step.centroids32, &centroids);
+
+        /* Centroids too large for the expanded form fall back to the direct differences */
+        if (step.gemm != NULL) {
+            pack_centroids(step.gemm, &centroids);
+            step.assign_range = isfinite(step.gemm->max_norm_root * step.gemm->max_norm_root) ?
+                                gemm_range : lloyd_range;
+        }
+
+        /* Assign every x_i to the closest cluster, accumulating the cluster sums on the way */
+        assign_data_points_to_clusters(&pool, &step);
+        if (trace != NULL)
+            clock_gettime(CLOCK_MONOTONIC, &assigned);
+
+        reassigned = 0;
+        for (t = 0; t < pool.n_threads; t++)
+            reassigned += pool.workers[t].reassigned;
+        if (step.first_pass)
+            reassigned = ctx->N;
+
+        /* Get new centroids */
+        get_new_centroids(&pool, &new_centroids, &centroids);
+
+        /* Check convergence of centroids. When no point changed cluster, the centroids are already the means
+           of their clusters and would not move again, whatever eps is */
+        flag_delta = reassigned == 0 || compute_flag_delta(ctx, &centroids, &new_centroids);
+
+        if (step.bounds != NULL)
+            compute_centroid_drifts(step.bounds, &centroids, &new_centroids);
+
+        if (trace != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &updated);
+            record.assign_seconds = elapsed_seconds(&start, &assigned);
+            record.update_seconds = elapsed_seconds(&assigned, &updated);
+            record.allocations = arena->allocations - record.allocations;
+            record.reassigned = reassigned;
+            stopped = record_iteration(trace, &pool, &step, &new_centroids, &record);
+        }
+
+        /* Update centroids */
+        tmp = centroids;
+        centroids = new_centroids;
+        new_centroids = tmp;
+        step.first_pass = 0;
+    }
+
+    stats->iterations = iteration_number;
+    stats->distance_evaluations = 0;
+    for (t = 0; t < pool.n_threads; t++)
+        stats->distance_evaluations += pool.workers[t].distance_evaluations;
+    stats->skipped_distance_evaluations = (long long)iteration_number * ctx->N * ctx->K - stats->distance_evaluations;
+    stats->allocations = arena->allocations - allocations;
+    stats->allocated_bytes = arena->allocated_bytes - allocated_bytes;
+
+    destroy_worker_pool(&pool);
+
+    return centroids;
+}
+
+/** Run tracing **/
+
+void init_run_trace(struct run_trace *trace, int every, int (*callback)(struct run_trace *,
+                    const struct iteration_stats *), void *callback_data) {
+    trace->iterations = NULL;
+    trace->count = 0;
+    trace->capacity = 0;
+    trace->every = every > 0 ? every : 1;
+    trace->callback = callback;
+    trace->callback_data = callback_data;
+}
+
+void free_run_trace(struct run_trace *trace) {
+    free(trace->iterations);
+    trace->iterations = NULL;
+    trace->count = trace->capacity = 0;
+}
+
+/*
+ * Completes the record of an iteration with the inertia of the assignment, taken in one more pass over the points,
+ * and the largest centroid shift, stores it and runs the callback when due. Returns nonzero if the callback asks
+ * to stop.
+ */
+int record_iteration(struct run_trace *trace, struct worker_pool *pool, struct lloyd_step *step,
+                     struct matrix *new_centroids, struct iteration_stats *record) {
+    struct iteration_stats *records;
+    double shift;
+    int i, t, capacity;
+
+    run_worker_pool(pool, trace_task, step);
+    record->inertia = 0;
+    for (t = 0; t < pool->n_threads; t++)
+        record->inertia += pool->workers[t].block_sum;
+
+    record->max_shift = 0;
+    for (i = 0; i < new_centroids->rows; i++) {
+        shift = squared_dist(ROW(step->centroids, i), ROW(new_centroids, i), new_centroids->cols);
+        if (shift > record->max_shift)
+            record->max_shift = shift;
+    }
+    record->max_shift = sqrt(record->max_shift);
+
+    if (trace->count == trace->capacity) {
+        capacity = trace->capacity < 64 ? 64 : 2 * trace->capacity;
+        records = realloc(trace->iterations, (size_t)capacity * sizeof(struct iteration_stats));
+        if (records == NULL)
+            mem_error();
+        trace->iterations = records;
+        trace->capacity = capacity;
+    }
+    trace->iterations[trace->count++] = *record;
+
+    if (trace->callback != NULL && record->iteration % trace->every == 0)
+        return trace->callback(trace, record);
+    return 0;
+}
+
+/*
+ * Sums the squared distances of the owned points to the centroids they were assigned to into block_sum, each times
+ * its weight in a weighted run.
+ */
+static void trace_task(struct worker *worker, void *arg) {
+    struct lloyd_step *step = arg;
+    const double *centroid;
+    const float *point32;
+    double inertia = 0, diff;
+    int i, j, label;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        label = step->labels[i];
+        centroid = ROW(step->centroids, label);
+        if (step->data_points32 != NULL) {
+            point32 = ROW(step->data_points32, i);
+            for (j = 0; j < step->centroids->cols; j++) {
+                diff = point32[j] - centroid[j];
+                inertia += diff * diff;
+            }
+        } else if (step->weights != NULL) {
+            inertia += step->weights[i] * squared_dist(ROW(step->data_points, i), centroid, step->centroids->cols);
+        } else {
+            inertia += squared_dist(ROW(step->data_points, i), centroid, step->centroids->cols);
+        }
+    }
+
+    worker->block_sum = inertia;
+}
+
+double elapsed_seconds(const struct timespec *start, const struct timespec *end) {
+    return (double)(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+void copy_first_K_vectors(struct matrix *centroids, struct matrix *vectors){
+    int i = 0;
+
+    for (; i < centroids->rows; i++)
+        memcpy(ROW(centroids, i), ROW(vectors, i), centroids->cols * sizeof(double));
+}
+
+/*
+ * step->labels[j] becomes the index of the closest centroid to data point j.
+ * The workers also leave the per-cluster partial sums and counts of their points for get_new_centroids.
+ */
+void assign_data_points_to_clusters(struct worker_pool *pool, struct lloyd_step *step) {
+    run_worker_pool(pool, assign_task, step);
+}
+
+/*
+ * Runs the assignment of the algorithm (step->assign_range) over the data points owned by the worker.
+ * Points mapped from a file are walked in blocks with paging hints.
+ */
+static void assign_task(struct worker *worker, void *arg) {
+    struct lloyd_step *step = arg;
+
+    if (step->refresh_sums)
+        clear_partial_sums(worker);
+    worker->reassigned = 0;
+
+    if (step->file != NULL)
+        assign_blocks(worker, step);
+    else
+        step->assign_range(worker, step, worker->begin, worker->end);
+}
+
+/*
+ * Walks the worker's points in blocks of file->block_rows rows: the pages of the next block are requested while
+ * the current one is processed, and the pages of a finished block are released, so a pass streams through files
+ * larger than memory without evicting everything else.
+ */
+static void assign_blocks(struct worker *worker, struct lloyd_step *step) {
+    int begin, end, next_end;
+
+    for (begin = worker->begin; begin < worker->end; begin = end) {
+        end = worker->end - begin > step->file->block_rows ? begin + step->file->block_rows : worker->end;
+
+        if (end < worker->end) {
+            next_end = worker->end - end > step->file->block_rows ? end + step->file->block_rows : worker->end;
+            advise_point_file(step->file, end, next_end, POINT_FILE_WILL_NEED);
+        }
+
+        step->assign_range(worker, step, begin, end);
+
+        advise_point_file(step->file, begin, end, POINT_FILE_DONT_NEED);
+    }
+}
+
+/*
+ * Labels the data points [begin, end) and, in the same pass, adds each of them to the partial sum and
+ * count of its cluster, so every point is read once per iteration and nothing is allocated.
+ */
+static void lloyd_range(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    int i, label;
+    const double *data_point;
+
+    for (i = begin; i < end; i++) {
+        data_point = ROW(step->data_points, i);
+        label = arg_min_dist(data_point, step->centroids);
+        update_partial_sums(worker, step, step->labels[i], label, data_point);
+        step->labels[i] = label;
+    }
+
+    worker->distance_evaluations += (long long)(end - begin) * ctx->K;
+}
+
+/* lloyd_range for a weighted run, whose points join the sums of their clusters times their weight. */
+static void weighted_lloyd_range(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    int i, label;
+    const double *data_point;
+
+    for (i = begin; i < end; i++) {
+        data_point = ROW(step->data_points, i);
+        label = arg_min_dist(data_point, step->centroids);
+        update_weighted_partial_sums(worker, step, step->labels[i], label, data_point, step->weights[i]);
+        step->labels[i] = label;
+    }
+
+    worker->distance_evaluations += (long long)(end - begin) * ctx->K;
+}
+
+/*
+ * lloyd_range for a dimension D fixed at compile time, instantiated for every D up to SMALL_D_MAX: the compiler
+ * unrolls the distance and the accumulation and keeps the point in registers. The distance is summed in the lane
+ * order every distance kernel shares, so the labels are still the ones arg_min_dist gives.
+ */
+#define DEFINE_LLOYD_RANGE_FIXED_D(D)                                                                            \
+static void lloyd_range_d##D(struct worker *worker, struct lloyd_step *step, int begin, int end) {               \
+    const struct context *ctx = worker->pool->ctx;                                                               \
+    double x[D];                                                                                                 \
+    double distance, min_dis;                                                                                    \
+    const double *data_point, *centroid;                                                                         \
+    double *sum;                                                                                                 \
+    int i, j, c, label, old_label, closer;                                                                       \
+                                                                                                                 \
+    for (i = begin; i < end; i++) {                                                                              \
+        data_point = ROW(step->data_points, i);                                                                  \
+        for (j = 0; j < D; j++)                                                                                  \
+            x[j] = data_point[j];                                                                                \
+                                                                                                                 \
+        min_dis = DBL_MAX;                                                                                       \
+        label = -1;                                                                                              \
+        for (c = 0; c < ctx->K; c++) {                                                                           \
+            centroid = ROW(step->centroids, c);                                                                  \
+            distance = squared_dist_lanes(x, centroid, D);                                                       \
+            /* Selected with a mask rather than a branch, which the nearest centroid would mispredict */         \
+            closer = -(distance < min_dis);                                                                      \
+            label ^= (label ^ c) & closer;                                                                       \
+            min_dis = distance < min_dis ? distance : min_dis;                                                   \
+        }                                                                                                        \
+                                                                                                                 \
+        old_label = step->labels[i];                                                                             \
+        step->labels[i] = label;                                                                                 \
+        if (label != old_label) {                                                                                \
+            worker->reassigned++;                                                                                \
+            if (!step->refresh_sums)                                                                             \
+                remove_from_partial_sums(worker, old_label, x);                                                  \
+        }                                                                                                        \
+        if (label != old_label || step->refresh_sums) {                                                          \
+            sum = ROW(&worker->sums, label);                                                                     \
+            for (j = 0; j < D; j++)                                                                              \
+                sum[j] += x[j];                                                                                  \
+            worker->counts[label]++;                                                                             \
+        }                                                                                                        \
+    }                                                                                                            \
+                                                                                                                 \
+    worker->distance_evaluations += (long long)(end - begin) * ctx->K;                                           \
+}
+
+DEFINE_LLOYD_RANGE_FIXED_D(1)
+DEFINE_LLOYD_RANGE_FIXED_D(2)
+DEFINE_LLOYD_RANGE_FIXED_D(3)
+DEFINE_LLOYD_RANGE_FIXED_D(4)
+DEFINE_LLOYD_RANGE_FIXED_D(5)
+DEFINE_LLOYD_RANGE_FIXED_D(6)
+DEFINE_LLOYD_RANGE_FIXED_D(7)
+DEFINE_LLOYD_RANGE_FIXED_D(8)
+DEFINE_LLOYD_RANGE_FIXED_D(9)
+DEFINE_LLOYD_RANGE_FIXED_D(10)
+DEFINE_LLOYD_RANGE_FIXED_D(11)
+DEFINE_LLOYD_RANGE_FIXED_D(12)
+DEFINE_LLOYD_RANGE_FIXED_D(13)
+DEFINE_LLOYD_RANGE_FIXED_D(14)
+DEFINE_LLOYD_RANGE_FIXED_D(15)
+DEFINE_LLOYD_RANGE_FIXED_D(16)
+
+/* The fixed dimension instances of lloyd_range, indexed by d. */
+static void (*const lloyd_range_fixed_d[SMALL_D_MAX + 1])(struct worker *, struct lloyd_step *, int, int) = {
+    NULL, lloyd_range_d1, lloyd_range_d2, lloyd_range_d3, lloyd_range_d4, lloyd_range_d5, lloyd_range_d6,
+    lloyd_range_d7, lloyd_range_d8, lloyd_range_d9, lloyd_range_d10, lloyd_range_d11, lloyd_range_d12,
+    lloyd_range_d13, lloyd_range_d14, lloyd_range_d15, lloyd_range_d16
+};
+
+/* lloyd_range for float32 data points, which are compared with the float32 copy of the centroids. */
+static void lloyd_range_f32(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    int i, label;
+    const float *data_point;
+
+    for (i = begin; i < end; i++) {
+        data_point = ROW(step->data_points32, i);
+        label = arg_min_dist_f32(data_point, &step->centroids32);
+        update_partial_sums_f32(worker, step, step->labels[i], label, data_point);
+        step->labels[i] = label;
+    }
+
+    worker->distance_evaluations += (long long)(end - begin) * ctx->K;
+}
+
+/* Rounds the centroids to the float32 copy that float32 data points are compared with. */
+void narrow_centroids(struct matrix_f *centroids32, struct matrix *centroids) {
+    int i, j;
+
+    for (i = 0; i < centroids->rows; i++)
+        for (j = 0; j < centroids->cols; j++)
+            ROW(centroids32, i)[j] = (float)ROW(centroids, i)[j];
+}
+
+/*
+ * The blocked distance engine: ||x - c||^2 = ||x||^2 - 2 x.c + ||c||^2, where the panel kernel computes the scores
+ * ||c||^2 - 2 x.c of a tile of points and all the centroids together, and ||x||^2 is the same for every centroid.
+ * The expansion is less accurate than the direct difference, so every centroid whose score is within the rounding
+ * error of the best one is compared again with squared_dist; the label is then exactly the one arg_min_dist gives.
+ */
+static void gemm_range(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    struct gemm_centroids *gemm = step->gemm;
+    const double *x[GEMM_PANEL_ROWS];
+    const double *data_point;
+    double *tile = worker->tile, *scores;
+    double best, second, limit, root, distance, min_dis;
+    int block, rows, p, q, j, c, c_begin, c_end, label;
+
+    for (block = begin; block < end; block += GEMM_POINT_BLOCK) {
+        rows = end - block < GEMM_POINT_BLOCK ? end - block : GEMM_POINT_BLOCK;
+
+        /* Tiles of GEMM_CENTROID_BLOCK centroids keep their panels in cache while the points go by */
+        for (c_begin = 0; c_begin < gemm->padded_K; c_begin += GEMM_CENTROID_BLOCK) {
+            c_end = c_begin + GEMM_CENTROID_BLOCK < gemm->padded_K ? c_begin + GEMM_CENTROID_BLOCK : gemm->padded_K;
+            for (p = 0; p < rows; p += GEMM_PANEL_ROWS) {
+                /* A short last group repeats its last point, whose extra scores are never read */
+                for (q = 0; q < GEMM_PANEL_ROWS; q++)
+                    x[q] = ROW(step->data_points, block + (p + q < rows ? p + q : rows - 1));
+                for (j = c_begin; j < c_end; j += GEMM_PANEL)
+                    score_panel_kernel(x, gemm->panels + (size_t)j * ctx->d, gemm->norms + j, ctx->d,
+                                       tile + (size_t)p * gemm->padded_K + j, gemm->padded_K);
+            }
+        }
+
+        for (p = 0; p < rows; p++) {
+            data_point = ROW(step->data_points, block + p);
+            scores = tile + (size_t)p * gemm->padded_K;
+
+            best = DBL_MAX;
+            second = DBL_MAX;
+            label = 0;
+            for (c = 0; c < ctx->K; c++) {
+                if (scores[c] < second) {
+                    if (scores[c] < best) {
+                        second = best;
+                        best = scores[c];
+                        label = c;
+                    }
+                    else {
+                        second = scores[c];
+                    }
+                }
+            }
+
+            root = sqrt(gemm->point_norms[block + p]) + gemm->max_norm_root;
+            limit = best + GEMM_TIE_SLACK * (ctx->d + 4) * DBL_EPSILON * root * root;
+
+            /* The runner-up is within the rounding error: settle the near-tie with the direct differences */
+            if (second <= limit) {
+                min_dis = DBL_MAX;
+                for (c = 0; c < ctx->K; c++) {
+                    if (scores[c] > limit)
+                        continue;
+                    distance = squared_dist(data_point, ROW(step->centroids, c), ctx->d);
+                    if (distance < min_dis) {
+                        min_dis = distance;
+                        label = c;
+                    }
+                }
+            }
+
+            update_partial_sums(worker, step, step->labels[block + p], label, data_point);
+            step->labels[block + p] = label;
+        }
+    }
+
+    worker->distance_evaluations += (long long)(end - begin) * ctx->K;
+}
+
+/* Computes the squared norms of the points owned by a worker, once per run. */
+static void point_norms_task(struct worker *worker, void *arg) {
+    const struct context *ctx = worker->pool->ctx;
+    struct lloyd_step *step = arg;
+    const double *data_point;
+    int i;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        data_point = ROW(step->data_points, i);
+        step->gemm->point_norms[i] = dot_product(data_point, data_point, ctx->d);
+    }
+}
+
+/* Allocates the blocked engine of a run: the centroid panels, the norms and a score tile per worker. */
+void init_gemm(struct gemm_centroids *gemm, struct arena *arena, struct worker_pool *pool) {
+    const struct context *ctx = pool->ctx;
+    int t;
+
+    gemm->padded_K = (ctx->K + GEMM_PANEL - 1) / GEMM_PANEL * GEMM_PANEL;
+    gemm->panels = arena_alloc(arena, (size_t)gemm->padded_K * ctx->d * sizeof(double));
+    gemm->norms = arena_alloc(arena, (size_t)gemm->padded_K * sizeof(double));
+    gemm->point_norms = arena_alloc(arena, (size_t)ctx->N * sizeof(double));
+
+    for (t = 0; t < pool->n_threads; t++)
+        pool->workers[t].tile = arena_alloc(arena, (size_t)GEMM_POINT_BLOCK * gemm->padded_K * sizeof(double));
+}
+
+/*
+ * Packs the centroids into panels of GEMM_PANEL centroids stored dimension by dimension, so that the panel
+ * kernel reads one dimension of the whole panel with one load. The padding centroids are zero.
+ */
+void pack_centroids(struct gemm_centroids *gemm, struct matrix *centroids) {
+    double *panel;
+    const double *centroid;
+    double max_norm = 0;
+    int d = centroids->cols;
+    int j, l, i;
+
+    memset(gemm->panels, 0, (size_t)gemm->padded_K * d * sizeof(double));
+    for (j = 0; j < centroids->rows; j++) {
+        panel = gemm->panels + (size_t)(j / GEMM_PANEL * GEMM_PANEL) * d;
+        l = j % GEMM_PANEL;
+        centroid = ROW(centroids, j);
+        for (i = 0; i < d; i++)
+            panel[(size_t)i * GEMM_PANEL + l] = centroid[i];
+
+        gemm->norms[j] = dot_product(centroid, centroid, d);
+        if (gemm->norms[j] > max_norm)
+            max_norm = gemm->norms[j];
+    }
+    for (; j < gemm->padded_K; j++)
+        gemm->norms[j] = 0;
+
+    gemm->max_norm_root = sqrt(max_norm);
+}
+
+/*
+ * Hamerly's algorithm: every point keeps an upper bound on the distance to its centroid and one lower bound on
+ * the distance to all the other centroids, and is only compared with the centroids when the bounds overlap.
+ */
+static void hamerly_range(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    struct bounds *bounds = step->bounds;
+    int i, label;
+    double upper, lower, limit, best, second;
+    const double *data_point;
+
+    for (i = begin; i < end; i++) {
+        data_point = ROW(step->data_points, i);
+
+        if (step->first_pass) {
+            label = arg_min_two_dist(data_point, step->centroids, &best, &second);
+            worker->distance_evaluations += ctx->K;
+            bounds->upper[i] = sqrt(best) * (1 + BOUND_SLACK);
+            bounds->lower[i] = sqrt(second) * (1 - BOUND_SLACK);
+            update_partial_sums(worker, step, step->labels[i], label, data_point);
+            step->labels[i] = label;
+            continue;
+        }
+
+        label = step->labels[i];
+        upper = loosen_upper_bound(bounds->upper[i], bounds->drifts[label]);
+        lower = loosen_lower_bound(bounds->lower[i], label == bounds->max_drift_index ?
+                                                     bounds->second_max_drift : bounds->max_drift);
+        limit = lower > bounds->separations[label] ? lower : bounds->separations[label];
+
+        if (upper >= limit) {
+            /* Tighten the upper bound, and scan every centroid if it still overlaps */
+            best = squared_dist(data_point, ROW(step->centroids, label), ctx->d);
+            worker->distance_evaluations++;
+            upper = sqrt(best) * (1 + BOUND_SLACK);
+
+            if (upper >= limit) {
+                label = arg_min_two_dist(data_point, step->centroids, &best, &second);
+                worker->distance_evaluations += ctx->K;
+                upper = sqrt(best) * (1 + BOUND_SLACK);
+                lower = sqrt(second) * (1 - BOUND_SLACK);
+            }
+        }
+
+        bounds->upper[i] = upper;
+        bounds->lower[i] = lower;
+        update_partial_sums(worker, step, step->labels[i], label, data_point);
+        step->labels[i] = label;
+    }
+}
+
+/*
+ * Elkan's algorithm: every point keeps an upper bound on the distance to its centroid and a lower bound on the
+ * distance to each centroid, so every centroid is skipped separately.
+ * Ties are broken towards the smaller index, exactly as in arg_min_dist.
+ */
+static void elkan_range(struct worker *worker, struct lloyd_step *step, int begin, int end) {
+    const struct context *ctx = worker->pool->ctx;
+    struct bounds *bounds = step->bounds;
+    int i, j, label, tight;
+    double upper, limit, best = 0, distance;
+    double *lower;
+    const double *data_point, *half_distances;
+
+    for (i = begin; i < end; i++) {
+        data_point = ROW(step->data_points, i);
+        lower = bounds->lower + (size_t)i * ctx->K;
+
+        if (step->first_pass) {
+            label = -1;
+            best = DBL_MAX;
+            for (j = 0; j < ctx->K; j++) {
+                distance = squared_dist(data_point, ROW(step->centroids, j), ctx->d);
+                lower[j] = sqrt(distance) * (1 - BOUND_SLACK);
+                if (distance < best) {
+                    best = distance;
+                    label = j;
+                }
+            }
+            worker->distance_evaluations += ctx->K;
+            bounds->upper[i] = sqrt(best) * (1 + BOUND_SLACK);
+            update_partial_sums(worker, step, step->labels[i], label, data_point);
+            step->labels[i] = label;
+            continue;
+        }
+
+        label = step->labels[i];
+        upper = loosen_upper_bound(bounds->upper[i], bounds->drifts[label]);
+        for (j = 0; j < ctx->K; j++)
+            lower[j] = loosen_lower_bound(lower[j], bounds->drifts[j]);
+        tight = 0;
+
+        if (upper >= bounds->separations[label]) {
+            for (j = 0; j < ctx->K; j++) {
+                if (j == label)
+                    continue;
+
+                half_distances = bounds->half_distances + (size_t)label * ctx->K;
+                limit = lower[j] > half_distances[j] ? lower[j] : half_distances[j];
+                if (upper < limit)
+                    continue;
+
+                if (!tight) {
+                    best = squared_dist(data_point, ROW(step->centroids, label), ctx->d);
+                    worker->distance_evaluations++;
+                    upper = sqrt(best) * (1 + BOUND_SLACK);
+                    lower[label] = sqrt(best) * (1 - BOUND_SLACK);
+                    tight = 1;
+                    if (upper < limit)
+                        continue;
+                }
+
+                distance = squared_dist(data_point, ROW(step->centroids, j), ctx->d);
+                worker->distance_evaluations++;
+                lower[j] = sqrt(distance) * (1 - BOUND_SLACK);
+                if (distance < best || (distance == best && j < label)) {
+                    best = distance;
+                    label = j;
+                    upper = sqrt(distance) * (1 + BOUND_SLACK);
+                }
+            }
+        }
+
+        bounds->upper[i] = upper;
+        update_partial_sums(worker, step, step->labels[i], label, data_point);
+        step->labels[i] = label;
+    }
+}
+
+/*
+ * Computes half the distance between every pair of centroids for the bounded algorithms.
+ * Worker t handles a contiguous share of the centroids.
+ */
+static void separation_task(struct worker *worker, void *arg) {
+    const struct context *ctx = worker->pool->ctx;
+    struct lloyd_step *step = arg;
+    struct bounds *bounds = step->bounds;
+    int n_threads = worker->pool->n_threads;
+    int begin = (int)((long long)ctx->K * worker->id / n_threads);
+    int end = (int)((long long)ctx->K * (worker->id + 1) / n_threads);
+    int i, j;
+    double half, closest;
+
+    for (i = begin; i < end; i++) {
+        closest = DBL_MAX;
+        for (j = 0; j < ctx->K; j++) {
+            if (j == i)
+                continue;
+            half = 0.5 * sqrt(squared_dist(ROW(step->centroids, i), ROW(step->centroids, j), ctx->d)) *
+                   (1 - BOUND_SLACK);
+            if (bounds->half_distances != NULL)
+                bounds->half_distances[(size_t)i * ctx->K + j] = half;
+            if (half < closest)
+                closest = half;
+        }
+        bounds->separations[i] = ctx->K > 1 ? closest : DBL_MAX;
+    }
+}
+
+/* Records how far every centroid moved, which is how much the bounds of the points must be loosened. */
+void compute_centroid_drifts(struct bounds *bounds, struct matrix *old_centroids, struct matrix *new_centroids) {
+    int i = 0;
+    double drift;
+
+    bounds->max_drift = 0;
+    bounds->second_max_drift = 0;
+    bounds->max_drift_index = -1;
+
+    for (; i < old_centroids->rows; i++) {
+        drift = sqrt(squared_dist(ROW(old_centroids, i), ROW(new_centroids, i), old_centroids->cols)) *
+                (1 + BOUND_SLACK);
+        bounds->drifts[i] = drift;
+        if (drift > bounds->max_drift) {
+            bounds->second_max_drift = bounds->max_drift;
+            bounds->max_drift = drift;
+            bounds->max_drift_index = i;
+        }
+        else if (drift > bounds->second_max_drift) {
+            bounds->second_max_drift = drift;
+        }
+    }
+}
+
+/*
+ * The bounds are loosened by a relative BOUND_SLACK on every update, which covers the rounding of the distances
+ * they are built from, so a point is only skipped when its label cannot change under exact comparison.
+ */
+double loosen_upper_bound(double upper, double drift) {
+    return (upper + drift) * (1 + BOUND_SLACK);
+}
+
+double loosen_lower_bound(double lower, double drift) {
+    return lower - drift - BOUND_SLACK * (lower + drift);
+}
+
+void init_bounds(const struct context *ctx, struct bounds *bounds, struct arena *arena, int algorithm) {
+    size_t lower_count = algorithm == ALGORITHM_ELKAN ? (size_t)ctx->N * ctx->K : (size_t)ctx->N;
+
+    bounds->upper = arena_alloc(arena, (size_t)ctx->N * sizeof(double));
+    bounds->lower = arena_alloc(arena, lower_count * sizeof(double));
+    bounds->drifts = arena_alloc(arena, (size_t)ctx->K * sizeof(double));
+    bounds->separations = arena_alloc(arena, (size_t)ctx->K * sizeof(double));
+    bounds->half_distances = NULL;
+    if (algorithm == ALGORITHM_ELKAN)
+        bounds->half_distances = arena_alloc(arena, (size_t)ctx->K * ctx->K * sizeof(double));
+}
+
+static void clear_partial_sums(struct worker *worker) {
+    memset(worker->sums.values, 0, (size_t)worker->sums.rows * worker->sums.stride * sizeof(double));
+    memset(worker->counts, 0, (size_t)worker->sums.rows * sizeof(int));
+    memset(worker->weights, 0, (size_t)worker->sums.rows * sizeof(double));
+}
+
+static void add_to_partial_sums(struct worker *worker, int label, const double *data_point) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] += data_point[j];
+    worker->counts[label]++;
+}
+
+/* The float32 points are summed in float64, like the others. */
+static void add_to_partial_sums_f32(struct worker *worker, int label, const float *data_point) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] += data_point[j];
+    worker->counts[label]++;
+}
+
+static void remove_from_partial_sums(struct worker *worker, int label, const double *data_point) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] -= data_point[j];
+    worker->counts[label]--;
+}
+
+static void remove_from_partial_sums_f32(struct worker *worker, int label, const float *data_point) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] -= data_point[j];
+    worker->counts[label]--;
+}
+
+/*
+ * Brings the partial sums of the worker up to date with the new label of a point, called before the label is
+ * stored. When the sums are refreshed every point is added again; otherwise only a point whose label changed moves
+ * from one sum to the other, so late iterations cost O(changed x d) instead of O(N x d).
+ */
+static void update_partial_sums(struct worker *worker, const struct lloyd_step *step, int old_label, int label,
+                                const double *data_point) {
+    if (label != old_label) {
+        worker->reassigned++;
+        if (!step->refresh_sums)
+            remove_from_partial_sums(worker, old_label, data_point);
+    }
+    if (label != old_label || step->refresh_sums)
+        add_to_partial_sums(worker, label, data_point);
+}
+
+static void add_weighted_to_partial_sums(struct worker *worker, int label, const double *data_point, double weight) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] += weight * data_point[j];
+    worker->counts[label]++;
+    worker->weights[label] += weight;
+}
+
+static void remove_weighted_from_partial_sums(struct worker *worker, int label, const double *data_point,
+                                              double weight) {
+    double *sum = ROW(&worker->sums, label);
+    int j = 0;
+
+    for (; j < worker->sums.cols; j++)
+        sum[j] -= weight * data_point[j];
+    worker->counts[label]--;
+    worker->weights[label] -= weight;
+}
+
+static void update_weighted_partial_sums(struct worker *worker, const struct lloyd_step *step, int old_label,
+                                         int label, const double *data_point, double weight) {
+    if (label != old_label) {
+        worker->reassigned++;
+        if (!step->refresh_sums)
+            remove_weighted_from_partial_sums(worker, old_label, data_point, weight);
+    }
+    if (label != old_label || step->refresh_sums)
+        add_weighted_to_partial_sums(worker, label, data_point, weight);
+}
+
+static void update_partial_sums_f32(struct worker *worker, const struct lloyd_step *step, int old_label, int label,
+                                    const float *data_point) {
+    if (label != old_label) {
+        worker->reassigned++;
+        if (!step->refresh_sums)
+            remove_from_partial_sums_f32(worker, old_label, data_point);
+    }
+    if (label != old_label || step->refresh_sums)
+        add_to_partial_sums_f32(worker, label, data_point);
+}
+
+/* Squared distances are compared, since the square root does not change which centroid is the closest. */
+int arg_min_dist(const double *data_point, struct matrix *centroids) {
+    double min_dis = DBL_MAX;
+    int min_index = -1;
+    int i = 0;
+    double distance;
+
+    for(; i < centroids->rows; i++) {
+
+        distance = squared_dist(data_point, ROW(centroids, i), centroids->cols);
+        if (distance < min_dis) {
+            min_dis = distance;
+            min_index = i;
+        }
+
+    }
+
+    return min_index;
+}
+
+int arg_min_dist_f32(const float *data_point, struct matrix_f *centroids) {
+    double min_dis = DBL_MAX;
+    int min_index = -1;
+    int i = 0;
+    double distance;
+
+    for (; i < centroids->rows; i++) {
+        distance = squared_dist_f32_kernel(data_point, ROW(centroids, i), centroids->cols);
+        if (distance < min_dis) {
+            min_dis = distance;
+            min_index = i;
+        }
+    }
+
+    return min_index;
+}
+
+/* Like arg_min_dist, and also returns the smallest and second smallest squared distances. */
+int arg_min_two_dist(const double *data_point, struct matrix *centroids, double *best, double *second) {
+    int min_index = -1;
+    int i = 0;
+    double distance;
+
+    *best = DBL_MAX;
+    *second = DBL_MAX;
+
+    for (; i < centroids->rows; i++) {
+        distance = squared_dist(data_point, ROW(centroids, i), centroids->cols);
+        if (distance < *best) {
+            *second = *best;
+            *best = distance;
+            min_index = i;
+        }
+        else if (distance < *second) {
+            *second = distance;
+        }
+    }
+
+    return min_index;
+}
+
+/*
+ * Writes the updated centroids into new_centroids.
+ * The partial sums left by assign_data_points_to_clusters are reduced in worker order,
+ * so the result only depends on the number of threads and not on their scheduling.
+ * An empty cluster keeps its previous centroid, as does one of zero weight in a weighted run.
+*/
+void get_new_centroids(struct worker_pool *pool, struct matrix *new_centroids, struct matrix *old_centroids) {
+    struct worker *worker;
+    int i = 0, j, t, k;
+    double *sum_vector, weight;
+    const double *partial;
+
+    /* For each centroid */
+    for (; i < new_centroids->rows; ++i) {
+        sum_vector = ROW(new_centroids, i);
+
+        /* Count number of vectors in cluster. */
+        k = 0;
+        for (t = 0; t < pool->n_threads; t++)
+            k += pool->workers[t].counts[i];
+
+        /* A weighted cluster is divided by its weight, which its points' sums were scaled by */
+        weight = k;
+        if (pool->weighted) {
+            weight = 0;
+            for (t = 0; t < pool->n_threads; t++)
+                weight += pool->workers[t].weights[i];
+        }
+
+        if (k == 0 || !(weight > 0)) {
+            memcpy(sum_vector, ROW(old_centroids, i), new_centroids->cols * sizeof(double));
+            continue;
+        }
+
+        /* Sum the vectors in its cluster. */
+        memcpy(sum_vector, ROW(&pool->workers[0].sums, i), new_centroids->cols * sizeof(double));
+        for (t = 1; t < pool->n_threads; t++) {
+            worker = &pool->workers[t];
+            partial = ROW(&worker->sums, i);
+            for (j = 0; j < new_centroids->cols; j++)
+                sum_vector[j] += partial[j];
+        }
+
+        /* Divide by the number of vectors in the cluster. */
+        divide_by_scalar(sum_vector, weight, new_centroids->cols);
+    }
+}
+
+void divide_by_scalar(double *v, double scalar, int n) {
+    int j = 0;
+
+    for (; j < n; j++)
+        v[j] /= scalar;
+}
+
+/*
+ * pre-condition: length of old_centroids == length of new_centroids.
+ * returns: 1 if and only if each delta is strictly less than eps.
+ * The squared deltas are compared with eps * eps, which saves a square root per centroid.
+*/
+int compute_flag_delta(const struct context *ctx, struct matrix *old_centroids, struct matrix *new_centroids) {
+    int flag_delta = 1;
+    double delta = 0;
+    double eps_squared = ctx->eps * ctx->eps;
+    int i = 0;
+
+    for(; i < ctx->K; i++) {
+        delta = squared_dist(ROW(old_centroids, i), ROW(new_centroids, i), ctx->d);
+        if (delta >= eps_squared){
+            flag_delta = 0;
+            break;
+        }
+
+    }
+
+    return flag_delta;
+}
+
+
+/** Mini-batch k-means **/
+
+/*
+ * Mini-batch k-means (Sculley, "Web-Scale K-Means Clustering"): every step assigns one batch of points to the
+ * current centroids and moves each centroid towards the mean of its batch points with its own learning rate,
+ * weight / (points it has absorbed so far), so the centroids are running means of every point they received.
+ * A run stops after iter steps, when the centroids move less than eps, or when the smoothed batch inertia
+ * has not improved for max_no_improvement steps in a row.
+ */
+
+void init_minibatch(const struct context *ctx, struct minibatch *mb, struct arena *arena,
+                    struct matrix *initial_centroids, int batch_size, int max_no_improvement, double alpha) {
+    mb->centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    mb->previous = alloc_matrix(arena, ctx->K, ctx->d);
+    mb->weights = arena_alloc(arena, (size_t)ctx->K * sizeof(double));
+    mb->labels = arena_alloc(arena, (size_t)batch_size * sizeof(int));
+    mb->batch_size = batch_size;
+    mb->max_no_improvement = max_no_improvement;
+    mb->alpha = alpha;
+    mb->steps = 0;
+    mb->no_improvement = 0;
+    mb->ewa_inertia = 0;
+    mb->best_inertia = DBL_MAX;
+
+    copy_first_K_vectors(&mb->centroids, initial_centroids);
+}
+
+/*
+ * Runs one mini-batch step over the rows of batch (at most batch_size of them).
+ * Returns 1 if the run has converged, 0 otherwise.
+ */
+int minibatch_step(struct worker_pool *pool, struct minibatch *mb, struct matrix *batch) {
+    const struct context *ctx = pool->ctx;
+    struct lloyd_step step;
+    double *centroid, inertia = 0;
+    const double *partial;
+    int i, j, t, count;
+
+    partition_worker_pool(pool, batch->rows);
+
+    step.data_points = batch;
+    step.data_points32 = NULL;
+    step.centroids = &mb->centroids;
+    step.labels = mb->labels;
+    step.bounds = NULL;
+    step.file = NULL;
+    run_worker_pool(pool, minibatch_assign_task, &step);
+
+    memcpy(mb->previous.values, mb->centroids.values, (size_t)ctx->K * mb->centroids.stride * sizeof(double));
+
+    for (i = 0; i < ctx->K; i++) {
+        count = 0;
+        for (t = 0; t < pool->n_threads; t++)
+            count += pool->workers[t].counts[i];
+        if (count == 0)
+            continue;
+
+        /* centroid += (sum - count * centroid) / weight, the running mean of everything it absorbed */
+        mb->weights[i] += count;
+        centroid = ROW(&mb->centroids, i);
+        for (j = 0; j < ctx->d; j++) {
+            double sum = 0;
+            for (t = 0; t < pool->n_threads; t++) {
+                partial = ROW(&pool->workers[t].sums, i);
+                sum += partial[j];
+            }
+            centroid[j] += (sum - count * centroid[j]) / mb->weights[i];
+        }
+    }
+
+    for (t = 0; t < pool->n_threads; t++)
+        inertia += pool->workers[t].block_sum;
+    inertia /= batch->rows;
+
+    mb->steps++;
+    if (mb->steps == 1)
+        mb->ewa_inertia = inertia;
+    else
+        mb->ewa_inertia = mb->ewa_inertia * (1 - mb->alpha) + inertia * mb->alpha;
+
+    if (mb->ewa_inertia < mb->best_inertia) {
+        mb->best_inertia = mb->ewa_inertia;
+        mb->no_improvement = 0;
+    }
+    else {
+        mb->no_improvement++;
+    }
+
+    if (mb->max_no_improvement > 0 && mb->no_improvement >= mb->max_no_improvement)
+        return 1;
+
+    return compute_flag_delta(ctx, &mb->previous, &mb->centroids);
+}
+
+/* Like assign_task, and also sums the squared distances of the points to their centroids into block_sum. */
+static void minibatch_assign_task(struct worker *worker, void *arg) {
+    const struct context *ctx = worker->pool->ctx;
+    struct lloyd_step *step = arg;
+    int i, label;
+    double best, second, inertia = 0;
+    const double *data_point;
+
+    clear_partial_sums(worker);
+
+    for (i = worker->begin; i < worker->end; i++) {
+        data_point = ROW(step->data_points, i);
+        label = arg_min_two_dist(data_point, step->centroids, &best, &second);
+        step->labels[i] = label;
+        inertia += best;
+        add_to_partial_sums(worker, label, data_point);
+    }
+
+    worker->block_sum = inertia;
+    worker->distance_evaluations += (long long)(worker->end - worker->begin) * ctx->K;
+}
+
+/*
+ * Mini-batch k-means over an in-memory matrix of N points: every step gathers batch_size points drawn uniformly
+ * (with a Mersenne Twister seeded with seed) into a reused batch buffer.
+ */
+struct matrix minibatch_k_means(const struct context *ctx, struct arena *arena, struct matrix *vectors,
+                                struct matrix *initial_centroids, int batch_size, int max_no_improvement,
+                                unsigned long seed, int n_threads, struct run_stats *stats) {
+    struct context batch_ctx = *ctx;
+    struct worker_pool pool;
+    struct minibatch mb;
+    struct matrix batch;
+    struct mt19937 rng;
+    int i, converged = 0, n_points = ctx->N;
+    double alpha;
+    long long allocations = arena->allocations, allocated_bytes = arena->allocated_bytes;
+
+    if (batch_size > n_points)
+        batch_size = n_points;
+
+    /* The smoothing of the batch inertia, as in scikit-learn */
+    alpha = 2.0 * batch_size / (n_points + 1);
+    if (alpha > 1)
+        alpha = 1;
+
+    batch_ctx.N = batch_size;  /* The pool works on one batch at a time */
+    init_worker_pool(&pool, &batch_ctx, arena, n_threads);
+
+    init_minibatch(ctx, &mb, arena, initial_centroids, batch_size, max_no_improvement, alpha);
+    batch = alloc_matrix(arena, batch_size, ctx->d);
+    mt19937_seed(&rng, (uint32_t)seed);
+
+    while (!converged && mb.steps < ctx->iter) {
+        for (i = 0; i < batch_size; i++)
+            memcpy(ROW(&batch, i), ROW(vectors, mt19937_bounded(&rng, (uint32_t)(n_points - 1))),
+                   ctx->d * sizeof(double));
+
+        converged = minibatch_step(&pool, &mb, &batch);
+    }
+
+    stats->iterations = mb.steps;
+    stats->distance_evaluations = (long long)mb.steps * batch_size * ctx->K;
+    stats->skipped_distance_evaluations = 0;
+    stats->allocations = arena->allocations - allocations;
+    stats->allocated_bytes = arena->allocated_bytes - allocated_bytes;
+
+    destroy_worker_pool(&pool);
+
+    return mb.centroids;
+}
+
+/** k-means++ seeding **/
+
+/*
+ * init_pp reproduces the D^2 sampling of init_centroids in kmeans_pp.py run after numpy.random.seed(seed):
+ * the first centroid is numpy.random.randint(N) and every following one is
+ * numpy.random.choice(N, p=min_distances / sum(min_distances)), where min_distances are the (not squared)
+ * distances from every point to its closest chosen centroid.
+ * To return the same indices, every floating point operation the script depends on is done in NumPy's order:
+ * the Mersenne Twister of the legacy RandomState, NumPy's pairwise summation, and choice's cumulative sums.
+ */
+
+#define MT_STATE_LEN 624
+#define PAIRWISE_BLOCK 128  /* NumPy sums blocks of up to 128 values with 8 accumulators. */
+#define MAX_PAIRWISE_LEAVES 256
+
+/* Seeds like numpy.random.seed(seed) with an integer seed. */
+void mt19937_seed(struct mt19937 *state, uint32_t seed) {
+    int pos = 0;
+
+    for (; pos < MT_STATE_LEN; pos++) {
+        state->key[pos] = seed;
+        seed = (uint32_t)(1812433253UL * (seed ^ (seed >> 30)) + pos + 1);
+    }
+    state->pos = MT_STATE_LEN;
+}
+
+uint32_t mt19937_next(struct mt19937 *state) {
+    static const uint32_t mag01[2] = {0x0UL, 0x9908b0dfUL};
+    const uint32_t upper_mask = 0x80000000UL, lower_mask = 0x7fffffffUL;
+    uint32_t y;
+    int i = 0;
+
+    if (state->pos == MT_STATE_LEN) {
+        for (; i < MT_STATE_LEN - 397; i++) {
+            y = (state->key[i] & upper_mask) | (state->key[i + 1] & lower_mask);
+            state->key[i] = state->key[i + 397] ^ (y >> 1) ^ mag01[y & 0x1UL];
+        }
+        for (; i < MT_STATE_LEN - 1; i++) {
+            y = (state->key[i] & upper_mask) | (state->key[i + 1] & lower_mask);
+            state->key[i] = state->key[i + (397 - MT_STATE_LEN)] ^ (y >> 1) ^ mag01[y & 0x1UL];
+        }
+        y = (state->key[MT_STATE_LEN - 1] & upper_mask) | (state->key[0] & lower_mask);
+        state->key[MT_STATE_LEN - 1] = state->key[396] ^ (y >> 1) ^ mag01[y & 0x1UL];
+        state->pos = 0;
+    }
+
+    y = state->key[state->pos++];
+    y ^= (y >> 11);
+    y ^= (y << 7) & 0x9d2c5680UL;
+    y ^= (y << 15) & 0xefc60000UL;
+    y ^= (y >> 18);
+
+    return y;
+}
+
+/* numpy.random.random_sample(): a double in [0, 1) with 53 random bits. */
+double mt19937_next_double(struct mt19937 *state) {
+    uint32_t a = mt19937_next(state) >> 5, b = mt19937_next(state) >> 6;
+
+    return (a * 67108864.0 + b) / 9007199254740992.0;
+}
+
+/* numpy.random.randint(max + 1) for max < 2^32: masked rejection sampling. */
+uint32_t mt19937_bounded(struct mt19937 *state, uint32_t max) {
+    uint32_t mask = max, value;
+
+    if (max == 0)
+        return 0;
+    if (max == 0xFFFFFFFFUL)
+        return mt19937_next(state);
+
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+
+    while ((value = (mt19937_next(state) & mask)) > max)
+        ;
+
+    return value;
+}
+
+/* numpy.sum of n contiguous doubles: blocks of 8 accumulators, split in halves above PAIRWISE_BLOCK values. */
+double pairwise_sum(const double *a, size_t n) {
+    double r[8], res;
+    size_t i, j, n2;
+
+    if (n < 8) {
+        res = 0.;
+        for (i = 0; i < n; i++)
+            res += a[i];
+        return res;
+    }
+    if (n <= PAIRWISE_BLOCK) {
+        for (j = 0; j < 8; j++)
+            r[j] = a[j];
+        for (i = 8; i < n - (n % 8); i += 8)
+            for (j = 0; j < 8; j++)
+                r[j] += a[i + j];
+        res = ((r[0] + r[1]) + (r[2] + r[3])) + ((r[4] + r[5]) + (r[6] + r[7]));
+        for (; i < n; i++)
+            res += a[i];
+        return res;
+    }
+
+    n2 = n / 2;
+    n2 -= n2 % 8;
+    return pairwise_sum(a, n2) + pairwise_sum(a + n2, n - n2);
+}
+
+/*
+ * Lists the subtrees of the pairwise summation of n values that have at most max_leaf values, in order.
+ * Summing the leaves separately and combining them with combine_pairwise_leaves gives pairwise_sum exactly.
+ */
+static void collect_pairwise_leaves(size_t offset, size_t n, size_t max_leaf, struct seeding_step *step) {
+    size_t n2;
+
+    if (n <= max_leaf || n <= PAIRWISE_BLOCK) {
+        step->leaf_offsets[step->n_leaves] = offset;
+        step->leaf_sizes[step->n_leaves] = n;
+        step->n_leaves++;
+        return;
+    }
+
+    n2 = n / 2;
+    n2 -= n2 % 8;
+    collect_pairwise_leaves(offset, n2, max_leaf, step);
+    collect_pairwise_leaves(offset + n2, n - n2, max_leaf, step);
+}
+
+static double combine_pairwise_leaves(size_t n, size_t max_leaf, struct seeding_step *step, int *leaf) {
+    size_t n2;
+    double left;
+
+    if (n <= max_leaf || n <= PAIRWISE_BLOCK)
+        return step->leaf_sums[(*leaf)++];
+
+    n2 = n / 2;
+    n2 -= n2 % 8;
+    left = combine_pairwise_leaves(n2, max_leaf, step, leaf);
+    return left + combine_pairwise_leaves(n - n2, max_leaf, step, leaf);
+}
+
+/* The distance computed by np.sqrt(np.sum(np.square(u - v))) in n dimensions, with scratch holding n doubles. */
+double numpy_dist(const double *u, const double *v, double *scratch, int n) {
+    int j = 0;
+    double diff;
+
+    for (; j < n; j++) {
+        diff = u[j] - v[j];
+        scratch[j] = diff * diff;
+    }
+
+    return sqrt(0. + pairwise_sum(scratch, n));
+}
+
+/*
+ * Chooses K initial centroids with k-means++ (D^2 sampling) and writes the indices of the chosen data points
+ * into indices. Every round only compares the points with the newest centroid, and the distance updates,
+ * the normalization and the cumulative sums run on the worker pool.
+ * Returns 0, or -1 if the remaining distances are all zero (fewer than K distinct points).
+ */
+int init_pp(const struct context *ctx, struct arena *arena, struct matrix *data_points, unsigned long seed,
+            int n_threads, int *indices) {
+    struct worker_pool pool;
+    struct seeding_step step;
+    struct mt19937 rng;
+    int c, i, leaf, status = 0;
+    size_t max_leaf;
+    double total;
+
+    init_worker_pool(&pool, ctx, arena, n_threads);
+    mt19937_seed(&rng, (uint32_t)seed);
+
+    step.data_points = data_points;
+    step.min_distances = arena_alloc(arena, (size_t)ctx->N * sizeof(double));
+    step.probabilities = arena_alloc(arena, (size_t)ctx->N * sizeof(double));
+    step.leaf_offsets = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(size_t));
+    step.leaf_sizes = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(size_t));
+    step.leaf_sums = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(double));
+    step.n_leaves = 0;
+
+    /* About 64 leaves, which is at most 2 * 64 + 1 */
+    max_leaf = (size_t)ctx->N / 64;
+    collect_pairwise_leaves(0, (size_t)ctx->N, max_leaf, &step);
+
+    /* Choose one center uniformly at random */
+    indices[0] = (int)mt19937_bounded(&rng, (uint32_t)(ctx->N - 1));
+
+    /* Repeat until K centers have been chosen */
+    for (c = 1; c < ctx->K; c++) {
+        step.newest = ROW(data_points, indices[c - 1]);
+        step.first_round = (c == 1);
+        run_worker_pool(&pool, min_distances_task, &step);
+        run_worker_pool(&pool, pairwise_leaves_task, &step);
+
+        leaf = 0;
+        total = 0. + combine_pairwise_leaves((size_t)ctx->N, max_leaf, &step, &leaf);
+        if (!(total > 0)) {
+            status = -1;
+            break;
+        }
+
+        step.total = total;
+        run_worker_pool(&pool, probabilities_task, &step);
+
+        indices[c] = sample_index(&pool, &step, mt19937_next_double(&rng));
+    }
+
+    for (i = c; i < ctx->K; i++)
+        indices[i] = -1;
+
+    destroy_worker_pool(&pool);
+
+    return status;
+}
+
+/* Updates the distance of the worker's points to their closest centroid. */
+static void min_distances_task(struct worker *worker, void *arg) {
+    struct seeding_step *step = arg;
+    int i;
+    double distance;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        distance = numpy_dist(ROW(step->data_points, i), step->newest, worker->scratch, step->data_points->cols);
+        if (step->first_round || distance < step->min_distances[i])
+            step->min_distances[i] = distance;
+    }
+}
+
+/* Sums the leaves of the pairwise summation of the distances that the worker owns. */
+static void pairwise_leaves_task(struct worker *worker, void *arg) {
+    struct seeding_step *step = arg;
+    int leaf = worker->id;
+
+    for (; leaf < step->n_leaves; leaf += worker->pool->n_threads)
+        step->leaf_sums[leaf] = pairwise_sum(step->min_distances + step->leaf_offsets[leaf], step->leaf_sizes[leaf]);
+}
+
+/* Normalizes the worker's distances into probabilities and sums them in order, as cumsum would. */
+static void probabilities_task(struct worker *worker, void *arg) {
+    struct seeding_step *step = arg;
+    int i;
+    double sum = 0;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        step->probabilities[i] = step->min_distances[i] / step->total;
+        sum += step->probabilities[i];
+    }
+
+    worker->block_sum = sum;
+}
+
+/*
+ * Returns numpy's cdf.searchsorted(u, side='right') for cdf = probabilities.cumsum() / probabilities.cumsum()[-1].
+ * The prefix sums of the worker blocks locate the sample in parallel. They differ from numpy's sequential
+ * cumulative sums by at most about N * DBL_EPSILON, so when u falls closer than that to a boundary,
+ * the answer is confirmed with the sequential sums.
+ */
+int sample_index(struct worker_pool *pool, struct seeding_step *step, double u) {
+    const struct context *ctx = pool->ctx;
+    int t, i, index = -1;
+    double total = 0, offset = 0, target, tolerance, previous, cumulative;
+    const double *p = step->probabilities;
+
+    for (t = 0; t < pool->n_threads; t++)
+        total += pool->workers[t].block_sum;
+
+    target = u * total;
+    tolerance = 4 * ((double)ctx->N + 2) * DBL_EPSILON * total;
+
+    /* The block holding the sample */
+    for (t = 0; t < pool->n_threads - 1; t++) {
+        if (offset + pool->workers[t].block_sum > target)
+            break;
+        offset += pool->workers[t].block_sum;
+    }
+
+    previous = offset;
+    cumulative = offset;
+    for (i = pool->workers[t].begin; i < pool->workers[t].end; i++) {
+        cumulative += p[i];
+        if (cumulative > target) {
+            index = i;
+            break;
+        }
+        previous = cumulative;
+    }
+
+    if (index >= 0 && cumulative - target > tolerance && (index == 0 || target - previous > tolerance))
+        return index;
+
+    /* Too close to call: replay numpy exactly */
+    cumulative = 0;
+    for (i = 0; i < ctx->N; i++)
+        cumulative += p[i];
+    total = cumulative;
+
+    cumulative = 0;
+    for (i = 0; i < ctx->N; i++) {
+        cumulative += p[i];
+        if (cumulative / total > u)
+            return i;
+    }
+
+    return ctx->N - 1;
+}
+
+/** k-means|| seeding **/
+
+/*
+ * k-means|| (Bahmani et al., "Scalable K-Means++"): starting from one uniformly chosen point, every round samples
+ * each point independently with probability min(1, oversampling * D(x)^2 / cost), where D(x) is the distance
+ * to the closest candidate so far and cost is the sum of D(x)^2. After the rounds, every candidate is weighted
+ * by the number of points closest to it, and K of them are chosen by weighted k-means++ (D^2 sampling).
+ * The rounds run on the worker pool and draw their coins from a counter-based generator, so the result does not
+ * depend on the number of threads.
+ */
+
+/* splitmix64: a well mixed 64-bit value from a 64-bit counter. */
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+/* The coin of point i in the given round, uniform in [0, 1). */
+static double point_coin(uint64_t seed, int round, int i) {
+    uint64_t x = splitmix64(seed ^ splitmix64(((uint64_t)round << 32) | (uint32_t)i));
+
+    return (double)(x >> 11) / 9007199254740992.0;
+}
+
+/*
+ * Chooses K initial centroids with k-means|| and writes the indices of the chosen data points into indices.
+ * oversampling <= 0 means 2 * K.
+ * Returns 0, or -1 if the data has fewer than K distinct points.
+ */
+int init_parallel(const struct context *ctx, struct arena *arena, struct matrix *data_points, unsigned long seed,
+                  int rounds, double oversampling, int n_threads, int *indices) {
+    struct worker_pool pool;
+    struct parallel_seeding_step step;
+    struct mt19937 rng;
+    int r, t, i, count, leaf, farthest;
+    size_t max_leaf;
+    double *weights;
+
+    init_worker_pool(&pool, ctx, arena, n_threads);
+    mt19937_seed(&rng, (uint32_t)seed);
+
+    step.data_points = data_points;
+    step.seed = splitmix64(seed);
+    step.oversampling = oversampling > 0 ? oversampling : 2.0 * ctx->K;
+    step.candidates = arena_alloc(arena, (size_t)ctx->N * sizeof(int));
+    step.closest = arena_alloc(arena, (size_t)ctx->N * sizeof(int));
+    step.sampled = arena_alloc(arena, (size_t)ctx->N * sizeof(int));
+
+    /* The cost is summed with the pairwise leaves of init_pp, which do not depend on the number of threads */
+    step.cost_sum.min_distances = arena_alloc(arena, (size_t)ctx->N * sizeof(double));
+    step.cost_sum.leaf_offsets = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(size_t));
+    step.cost_sum.leaf_sizes = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(size_t));
+    step.cost_sum.leaf_sums = arena_alloc(arena, MAX_PAIRWISE_LEAVES * sizeof(double));
+    step.cost_sum.n_leaves = 0;
+    max_leaf = (size_t)ctx->N / 64;
+    collect_pairwise_leaves(0, (size_t)ctx->N, max_leaf, &step.cost_sum);
+
+    /* Choose one candidate uniformly at random */
+    step.candidates[0] = (int)mt19937_bounded(&rng, (uint32_t)(ctx->N - 1));
+    step.n_candidates = 1;
+    step.first_new = 0;
+    step.round = 0;
+
+    for (r = 0; r <= rounds; r++) {
+        /* Compare every point with the candidates added by the previous round */
+        run_worker_pool(&pool, candidate_distances_task, &step);
+        step.first_new = step.n_candidates;
+
+        if (r == rounds)
+            break;
+
+        run_worker_pool(&pool, pairwise_leaves_task, &step.cost_sum);
+        leaf = 0;
+        step.cost = 0. + combine_pairwise_leaves((size_t)ctx->N, max_leaf, &step.cost_sum, &leaf);
+        if (!(step.cost > 0))
+            break;
+
+        step.round = r + 1;
+        run_worker_pool(&pool, oversample_task, &step);
+
+        /* Gather the points sampled by the workers, in index order */
+        for (t = 0; t < pool.n_threads; t++) {
+            count = pool.workers[t].block_count;
+            memcpy(step.candidates + step.n_candidates, step.sampled + pool.workers[t].begin, count * sizeof(int));
+            step.n_candidates += count;
+        }
+    }
+
+    /*
+     * Too few candidates: add the point farthest from them, one at a time, comparing every point with each new
+     * candidate so that the next one is farthest from all of them and the weights count the closest points.
+     */
+    while (step.n_candidates < ctx->K) {
+        farthest = 0;
+        for (i = 1; i < ctx->N; i++)
+            if (step.cost_sum.min_distances[i] > step.cost_sum.min_distances[farthest])
+                farthest = i;
+        if (!(step.cost_sum.min_distances[farthest] > 0)) {
+            destroy_worker_pool(&pool);
+            return -1;
+        }
+        step.candidates[step.n_candidates++] = farthest;
+        run_worker_pool(&pool, candidate_distances_task, &step);
+        step.first_new = step.n_candidates;
+    }
+
+    /* Weigh every candidate by the number of points closest to it */
+    weights = arena_alloc(arena, (size_t)step.n_candidates * sizeof(double));
+    for (i = 0; i < ctx->N; i++)
+        weights[step.closest[i]] += 1;
+
+    destroy_worker_pool(&pool);
+
+    return recluster_candidates(ctx, arena, data_points, step.candidates, weights, step.n_candidates, &rng, indices);
+}
+
+/* Updates the squared distance of the worker's points to their closest candidate with the newest candidates. */
+static void candidate_distances_task(struct worker *worker, void *arg) {
+    struct parallel_seeding_step *step = arg;
+    double *min_distances = step->cost_sum.min_distances;
+    const double *data_point;
+    double distance;
+    int i, c;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        data_point = ROW(step->data_points, i);
+        for (c = step->first_new; c < step->n_candidates; c++) {
+            distance = squared_dist(data_point, ROW(step->data_points, step->candidates[c]), step->data_points->cols);
+            if (c == 0 || distance < min_distances[i]) {
+                min_distances[i] = distance;
+                step->closest[i] = c;
+            }
+        }
+    }
+}
+
+/* Flips the coins of the worker's points, writing the sampled ones at step->sampled + begin. */
+static void oversample_task(struct worker *worker, void *arg) {
+    struct parallel_seeding_step *step = arg;
+    const double *min_distances = step->cost_sum.min_distances;
+    double scale = step->oversampling / step->cost;
+    int i, count = 0;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        if (min_distances[i] > 0 && point_coin(step->seed, step->round, i) < min_distances[i] * scale)
+            step->sampled[worker->begin + count++] = i;
+    }
+
+    worker->block_count = count;
+}
+
+/*
+ * Weighted k-means++ over the m candidates: the first one is chosen with probability proportional to its weight,
+ * and every following one proportionally to its weight times its squared distance to the closest chosen one.
+ */
+int recluster_candidates(const struct context *ctx, struct arena *arena, struct matrix *data_points,
+                         const int *candidates, const double *weights, int m, struct mt19937 *rng, int *indices) {
+    double *min_distances = arena_alloc(arena, (size_t)m * sizeof(double));
+    double total, target, distance;
+    const double *newest;
+    int c, i, chosen;
+
+    for (i = 0; i < m; i++)
+        min_distances[i] = 1;  /* Before the first choice, only the weights count */
+
+    for (c = 0; c < ctx->K; c++) {
+        total = 0;
+        for (i = 0; i < m; i++)
+            total += weights[i] * min_distances[i];
+        if (!(total > 0))
+            return -1;
+
+        /* The last candidate with a positive score absorbs the rounding of the running sum */
+        target = mt19937_next_double(rng) * total;
+        chosen = -1;
+        for (i = 0; i < m; i++) {
+            if (weights[i] * min_distances[i] > 0) {
+                chosen = i;
+                target -= weights[i] * min_distances[i];
+                if (target < 0)
+                    break;
+            }
+        }
+
+        indices[c] = candidates[chosen];
+        newest = ROW(data_points, candidates[chosen]);
+        for (i = 0; i < m; i++) {
+            distance = squared_dist(ROW(data_points, candidates[i]), newest, ctx->d);
+            if (c == 0 || distance < min_distances[i])
+                min_distances[i] = distance;
+        }
+    }
+
+    return 0;
+}
+
+/** Coresets **/
+
+/*
+ * A coreset is a small weighted sample of the data points whose weighted cost approximates the cost of the whole
+ * data under any K centroids, so k-means over it is nearly k-means over the data for a fraction of the work.
+ * build_coreset samples by sensitivity (Bachem, Lucic and Krause, "Practical Coreset Constructions for Machine
+ * Learning"), around a rough solution B of K centers chosen by k-means++ among a uniform sample of the points:
+ * point x in the cluster B_x of B is sampled with a probability proportional to
+ *     alpha d(x, B)^2 / c + 2 alpha cost(B_x) / (|B_x| c) + 4 N / |B_x|,
+ * where c is the mean squared distance to B and alpha = 16 (log K + 2), and weighted by the inverse of its
+ * probability, so the weighted cost is an unbiased estimate of the cost of the data. Each point is sampled on its own
+ * coin of the counter-based generator of k-means||, which makes the construction two passes over the data: one for
+ * the sizes and costs of the clusters of B, one for the coins. The coreset holds about m points.
+ */
+int build_coreset(const struct context *ctx, struct arena *arena, struct matrix *data_points, int m,
+                  unsigned long seed, int n_threads, int **indices, double **weights) {
+    struct context centers_ctx = *ctx;
+    struct worker_pool pool;
+    struct coreset_step step;
+    struct mt19937 rng;
+    double *ones, cost = 0;
+    int *candidates, *chosen;
+    int n_candidates, n_centers = 0, count = 0, t, c, i;
+
+    /* The rough solution: k-means++ among a uniform sample, or a single point if it has fewer than K distinct ones */
+    mt19937_seed(&rng, (uint32_t)seed);
+    n_candidates = (long long)CORESET_SEED_SAMPLE * ctx->K < ctx->N ? CORESET_SEED_SAMPLE * ctx->K : ctx->N;
+    candidates = arena_alloc(arena, (size_t)n_candidates * sizeof(int));
+    ones = arena_alloc(arena, (size_t)n_candidates * sizeof(double));
+    for (i = 0; i < n_candidates; i++) {
+        candidates[i] = (int)mt19937_bounded(&rng, (uint32_t)(ctx->N - 1));
+        ones[i] = 1;
+    }
+    chosen = arena_alloc(arena, (size_t)ctx->K * sizeof(int));
+    n_centers = ctx->K;
+    if (recluster_candidates(ctx, arena, data_points, candidates, ones, n_candidates, &rng, chosen) < 0) {
+        chosen[0] = candidates[0];
+        n_centers = 1;
+    }
+
+    step.data_points = data_points;
+    step.centers = alloc_matrix(arena, n_centers, ctx->d);
+    for (c = 0; c < n_centers; c++)
+        memcpy(ROW(&step.centers, c), ROW(data_points, chosen[c]), ctx->d * sizeof(double));
+    init_arena(&step.index.arena);
+    build_centroid_index(&step.index, &step.centers);
+
+    centers_ctx.K = n_centers;
+    init_worker_pool(&pool, &centers_ctx, arena, n_threads);
+
+    /* First pass: the size and cost of every cluster of the rough solution */
+    step.partial_costs = arena_alloc(arena, (size_t)pool.n_threads * n_centers * sizeof(double));
+    run_worker_pool(&pool, coreset_cost_task, &step);
+
+    step.costs = arena_alloc(arena, (size_t)n_centers * sizeof(double));
+    step.sizes = arena_alloc(arena, (size_t)n_centers * sizeof(int));
+    for (c = 0; c < n_centers; c++) {
+        step.costs[c] = 0;
+        step.sizes[c] = 0;
+        for (t = 0; t < pool.n_threads; t++) {
+            step.costs[c] += step.partial_costs[(size_t)t * n_centers + c];
+            step.sizes[c] += pool.workers[t].counts[c];
+        }
+        cost += step.costs[c];
+        if (step.sizes[c] > 0)
+            count++;
+    }
+
+    /* The sensitivities sum to N (3 alpha + 4 x the nonempty clusters), less the cost terms when the cost is 0 */
+    step.mean_cost = cost / ctx->N;
+    step.alpha = 16 * (log(n_centers) + 2);
+    step.total_sensitivity = 4.0 * ctx->N * count + (step.mean_cost > 0 ? 3 * step.alpha * ctx->N : 0);
+
+    /* Second pass: every point flips its coin */
+    step.m = m;
+    step.seed = splitmix64(seed);
+    step.sampled = arena_alloc(arena, (size_t)pool.n_threads * sizeof(int *));
+    step.sampled_weights = arena_alloc(arena, (size_t)pool.n_threads * sizeof(double *));
+    step.n_sampled = arena_alloc(arena, (size_t)pool.n_threads * sizeof(int));
+    run_worker_pool(&pool, coreset_sample_task, &step);
+
+    /* Gather the points sampled by the workers, in index order */
+    count = 0;
+    for (t = 0; t < pool.n_threads; t++)
+        count += step.n_sampled[t];
+    *indices = arena_alloc(arena, (size_t)(count > 0 ? count : 1) * sizeof(int));
+    *weights = arena_alloc(arena, (size_t)(count > 0 ? count : 1) * sizeof(double));
+    count = 0;
+    for (t = 0; t < pool.n_threads; t++) {
+        memcpy(*indices + count, step.sampled[t], (size_t)step.n_sampled[t] * sizeof(int));
+        memcpy(*weights + count, step.sampled_weights[t], (size_t)step.n_sampled[t] * sizeof(double));
+        count += step.n_sampled[t];
+        free(step.sampled[t]);
+        free(step.sampled_weights[t]);
+    }
+
+    destroy_worker_pool(&pool);
+    free_arena(&step.index.arena);
+
+    return count;
+}
+
+/* Sums the squared distances of the worker's points to their closest center, and counts them, per center. */
+static void coreset_cost_task(struct worker *worker, void *arg) {
+    struct coreset_step *step = arg;
+    double *costs = step->partial_costs + (size_t)worker->id * step->centers.rows;
+    const double *data_point;
+    int i, c = 0;
+
+    memset(costs, 0, (size_t)step->centers.rows * sizeof(double));
+    memset(worker->counts, 0, (size_t)step->centers.rows * sizeof(int));
+
+    for (i = worker->begin; i < worker->end; i++) {
+        data_point = ROW(step->data_points, i);
+        c = index_nearest(&step->index, data_point, c);
+        costs[c] += squared_dist(data_point, ROW(&step->centers, c), step->centers.cols);
+        worker->counts[c]++;
+    }
+}
+
+/* Samples the worker's points with probability min(1, m x sensitivity / total), weighted by its inverse. */
+static void coreset_sample_task(struct worker *worker, void *arg) {
+    struct coreset_step *step = arg;
+    const double *data_point;
+    double sensitivity, probability;
+    int i, c = 0, n = 0, capacity = 0;
+    int *sampled = NULL;
+    double *sampled_weights = NULL;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        data_point = ROW(step->data_points, i);
+        c = index_nearest(&step->index, data_point, c);
+
+        sensitivity = 4.0 * step->data_points->rows / step->sizes[c];
+        if (step->mean_cost > 0)
+            sensitivity += step->alpha * (squared_dist(data_point, ROW(&step->centers, c), step->centers.cols)
+                                          + 2 * step->costs[c] / step->sizes[c]) / step->mean_cost;
+        probability = step->m * sensitivity / step->total_sensitivity;
+
+        if (point_coin(step->seed, 0, i) < probability) {
+            if (n == capacity) {
+                capacity = capacity < 256 ? 256 : 2 * capacity;
+                sampled = realloc(sampled, (size_t)capacity * sizeof(int));
+                sampled_weights = realloc(sampled_weights, (size_t)capacity * sizeof(double));
+                if (sampled == NULL || sampled_weights == NULL)
+                    mem_error();
+            }
+            sampled[n] = i;
+            sampled_weights[n] = probability < 1 ? 1 / probability : 1;
+            n++;
+        }
+    }
+
+    step->sampled[worker->id] = sampled;
+    step->sampled_weights[worker->id] = sampled_weights;
+    step->n_sampled[worker->id] = n;
+}
+
+/*
+ * k-means over a coreset of about m of the data points: weighted k-means++ chooses K of its points, and weighted
+ * Lloyd (k_means with the coreset weights) runs from them. labels, if not NULL, then receives the label of every
+ * data point under the final centroids, in one more pass over the data. Returns the size of the coreset, or -1 if it
+ * has fewer than K distinct points.
+ */
+int coreset_k_means(const struct context *ctx, struct arena *arena, struct matrix *data_points, int m,
+                    unsigned long seed, int n_threads, struct run_stats *stats, struct matrix *centroids,
+                    int *labels) {
+    struct context coreset_ctx = *ctx;
+    struct matrix coreset, initial_centroids;
+    struct centroid_index index;
+    struct mt19937 rng;
+    int *indices, *rows, *chosen;
+    double *weights;
+    int n, i;
+
+    n = build_coreset(ctx, arena, data_points, m, seed, n_threads, &indices, &weights);
+    if (n < ctx->K)
+        return -1;
+
+    coreset_ctx.N = n;
+    coreset = alloc_matrix(arena, n, ctx->d);
+    rows = arena_alloc(arena, (size_t)n * sizeof(int));
+    for (i = 0; i < n; i++) {
+        memcpy(ROW(&coreset, i), ROW(data_points, indices[i]), ctx->d * sizeof(double));
+        rows[i] = i;
+    }
+
+    chosen = arena_alloc(arena, (size_t)ctx->K * sizeof(int));
+    mt19937_seed(&rng, (uint32_t)seed);
+    if (recluster_candidates(&coreset_ctx, arena, &coreset, rows, weights, n, &rng, chosen) < 0)
+        return -1;
+    initial_centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    for (i = 0; i < ctx->K; i++)
+        memcpy(ROW(&initial_centroids, i), ROW(&coreset, chosen[i]), ctx->d * sizeof(double));
+
+    *centroids = k_means(&coreset_ctx, arena, &coreset, NULL, weights, &initial_centroids, n_threads,
+                         ALGORITHM_LLOYD, NULL, stats, NULL);
+
+    if (labels != NULL) {
+        init_arena(&index.arena);
+        build_centroid_index(&index, centroids);
+        predict_labels(&index, data_points, n_threads, labels);
+        free_arena(&index.arena);
+    }
+
+    return n;
+}
+
+/** Batched runs **/
+
+/*
+ * fit_many runs many independent k-means++ seedings and fits over the same read-only data points. Every run is
+ * single threaded with its own context and arena, and the workers take the next run from a shared queue as soon as
+ * they finish one, so runs of very different costs keep every thread busy.
+ */
+void run_batched(struct arena *arena, struct matrix *data_points, struct batched_run *runs, int n_runs,
+                 int n_threads) {
+    struct context ctx;
+    struct worker_pool pool;
+    struct batched_runs_step step;
+    int i;
+
+    /* The pool splits nothing: its workers only share the queue */
+    ctx.N = n_runs;
+    ctx.K = 0;
+    ctx.d = 0;
+    init_worker_pool(&pool, &ctx, arena, n_threads);
+
+    step.data_points = data_points;
+    step.runs = runs;
+    step.n_runs = n_runs;
+    step.next = 0;
+    step.order = arena_alloc(arena, (size_t)n_runs * sizeof(struct keyed_row));
+    for (i = 0; i < n_runs; i++) {
+        step.order[i].key = -(double)runs[i].K * runs[i].iter;
+        step.order[i].row = i;
+    }
+    qsort(step.order, n_runs, sizeof(struct keyed_row), compare_keyed_rows);
+    pthread_mutex_init(&step.lock, NULL);
+
+    run_worker_pool(&pool, batched_runs_task, &step);
+
+    pthread_mutex_destroy(&step.lock);
+    destroy_worker_pool(&pool);
+}
+
+static void batched_runs_task(struct worker *worker, void *arg) {
+    struct batched_runs_step *step = arg;
+    int next;
+
+    (void)worker;
+    for (;;) {
+        pthread_mutex_lock(&step->lock);
+        next = step->next < step->n_runs ? step->order[step->next++].row : -1;
+        pthread_mutex_unlock(&step->lock);
+
+        if (next < 0)
+            return;
+        run_one_batched(step->data_points, &step->runs[next]);
+    }
+}
+
+/* Seeds one run with k-means++, fits it, and writes its results into run. */
+void run_one_batched(struct matrix *data_points, struct batched_run *run) {
+    struct context ctx;
+    struct arena arena;
+    struct matrix initial_centroids, centroids;
+    struct run_stats stats;
+    int i;
+
+    ctx.N = data_points->rows;
+    ctx.d = data_points->cols;
+    ctx.K = run->K;
+    ctx.iter = run->iter;
+    ctx.eps = run->eps;
+    init_arena(&arena);
+
+    run->status = init_pp(&ctx, &arena, data_points, run->seed, 1, run->indices);
+    if (run->status == 0) {
+        initial_centroids = alloc_matrix(&arena, ctx.K, ctx.d);
+        for (i = 0; i < ctx.K; i++)
+            memcpy(ROW(&initial_centroids, i), ROW(data_points, run->indices[i]), ctx.d * sizeof(double));
+
+        stats.trace = NULL;
+        centroids = k_means(&ctx, &arena, data_points, NULL, NULL, &initial_centroids, 1, run->algorithm, NULL,
+                            &stats, NULL);
+        copy_first_K_vectors(&run->centroids, &centroids);
+        run->iterations = stats.iterations;
+        run->inertia = compute_inertia(data_points, &run->centroids);
+    }
+
+    free_arena(&arena);
+}
+
+/* The sum of the squared distances of the data points to their closest centroid. */
+double compute_inertia(struct matrix *data_points, struct matrix *centroids) {
+    double best, second, inertia = 0;
+    int i;
+
+    for (i = 0; i < data_points->rows; i++) {
+        arg_min_two_dist(ROW(data_points, i), centroids, &best, &second);
+        inertia += best;
+    }
+
+    return inertia;
+}
+
+/** Sharded runs **/
+
+/*
+ * A sharded run splits the points between processes the way k_means splits them between its workers: shard s of S
+ * owns the points [N * s / S, N * (s + 1) / S) and keeps their labels and its partial sums and counts in memory it
+ * shares with the coordinator. Every iteration each shard runs assign_shard, and the coordinator combine_shards,
+ * which reduces the partial sums in shard order like get_new_centroids, so the run ends with the centroids k_means
+ * gives with S threads.
+ */
+
+/* Whether an iteration (from 1) sums every point again, given the points reassigned by the previous one. */
+int refresh_sums_due(int iteration, int reassigned, int N) {
+    return iteration % SUMS_REFRESH_PERIOD == 0 || 4LL * reassigned > N;
+}
+
+/*
+ * Assigns the points of a shard to the centroids with the Lloyd kernels of k_means, updating the labels, sums and
+ * counts of the shard (summed again from every point if refresh is set). Returns the number of reassigned points.
+ */
+int assign_shard(struct arena *arena, struct matrix *points, struct matrix *centroids, int *labels,
+                 struct matrix *sums, int *counts, int refresh) {
+    struct context ctx;
+    struct worker_pool pool;
+    struct lloyd_step step;
+    int reassigned;
+
+    ctx.N = points->rows;
+    ctx.d = points->cols;
+    ctx.K = centroids->rows;
+    ctx.iter = 1;
+    ctx.eps = 0;
+    init_worker_pool(&pool, &ctx, arena, 1);
+
+    /* The shard's own sums and counts stand in for those of the single worker */
+    pool.workers[0].sums = *sums;
+    pool.workers[0].counts = counts;
+
+    step.data_points = points;
+    step.data_points32 = NULL;
+    step.centroids = centroids;
+    step.labels = labels;
+    step.algorithm = ALGORITHM_LLOYD;
+    step.bounds = NULL;
+    step.gemm = NULL;
+    step.first_pass = 0;
+    step.refresh_sums = refresh;
+    step.weights = NULL;
+    step.file = NULL;
+    step.assign_range = ctx.d <= SMALL_D_MAX ? lloyd_range_fixed_d[ctx.d] : lloyd_range;
+    assign_data_points_to_clusters(&pool, &step);
+
+    reassigned = pool.workers[0].reassigned;
+    destroy_worker_pool(&pool);
+
+    return reassigned;
+}
+
+/*
+ * Sets the centroids to the means of the clusters summed by the n shards, an empty cluster keeping its centroid.
+ * Returns whether the run has converged, with the test of k_means.
+ */
+int combine_shards(struct arena *arena, struct matrix *centroids, struct matrix *sums, int **counts, int n,
+                   double eps, int reassigned) {
+    struct context ctx;
+    struct worker_pool pool;
+    struct matrix new_centroids;
+    int t, converged;
+
+    ctx.N = 0;
+    ctx.d = centroids->cols;
+    ctx.K = centroids->rows;
+    ctx.iter = 1;
+    ctx.eps = eps;
+
+    /* get_new_centroids only reads the sums and counts of the workers of the pool it is given */
+    pool.ctx = &ctx;
+    pool.n_threads = n;
+    pool.weighted = 0;
+    pool.workers = arena_alloc(arena, (size_t)n * sizeof(struct worker));
+    for (t = 0; t < n; t++) {
+        pool.workers[t].sums = sums[t];
+        pool.workers[t].counts = counts[t];
+    }
+
+    new_centroids = alloc_matrix(arena, ctx.K, ctx.d);
+    get_new_centroids(&pool, &new_centroids, centroids);
+    converged = reassigned == 0 || compute_flag_delta(&ctx, centroids, &new_centroids);
+    copy_first_K_vectors(centroids, &new_centroids);
+
+    return converged;
+}
+
+/** Sparse points **/
+
+/*
+ * Sparse points are never densified: a point meets the centroids through the expanded squared distance
+ * |x|^2 - 2 x.c + |c|^2, whose dot products only read the centroid coordinates of its non-zeros, and joins the
+ * partial sum of its cluster non-zero by non-zero. An iteration costs O(nnz x K) and the points take O(nnz) memory,
+ * only the centroids and the partial sums being dense. The expanded form rounds differently from the direct
+ * differences, so a point almost equidistant from two centroids may get another label than the dense fit gives it.
+ */
+
+/*
+ * Lloyd over CSR points, with the convergence test, the empty clusters and the incremental partial sums of k_means.
+ * Returns the K final centroids, allocated from the arena; labels, if not NULL, receives the N last labels.
+ */
+struct matrix sparse_k_means(const struct context *ctx, struct arena *arena, const struct csr_matrix *points,
+                             struct matrix *centroids_, int n_threads, struct run_stats *stats, int *labels) {
+    int iteration_number = 0, flag_delta = 0, first_pass = 1;
+    int t, reassigned = ctx->N;
+    struct worker_pool pool;
+    struct sparse_step step;
+    struct matrix centroids, new_centroids, tmp;
+    long long allocations = arena->allocations, allocated_bytes = arena->allocated_bytes;
+
+    centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    new_centroids = alloc_matrix(arena, ctx->K, ctx->d);
+    init_worker_pool(&pool, ctx, arena, n_threads);
+    init_sparse_step(&step, arena, &pool, points, ctx->K, ctx->d);
+    step.labels = labels != NULL ? labels : arena_alloc(arena, (size_t)ctx->N * sizeof(int));
+
+    copy_first_K_vectors(&centroids, centroids_);
+
+    while ((flag_delta == 0) && (iteration_number < ctx->iter)) {
+
+        iteration_number++;
+        step.refresh_sums = first_pass || refresh_sums_due(iteration_number, reassigned, ctx->N);
+
+        prepare_sparse_centroids(&step, &centroids);
+        run_worker_pool(&pool, sparse_assign_task, &step);
+
+        reassigned = 0;
+        for (t = 0; t < pool.n_threads; t++)
+            reassigned += pool.workers[t].reassigned;
+        if (first_pass)
+            reassigned = ctx->N;
+
+        get_new_centroids(&pool, &new_centroids, &centroids);
+        flag_delta = reassigned == 0 || compute_flag_delta(ctx, &centroids, &new_centroids);
+
+        tmp = centroids;
+        centroids = new_centroids;
+        new_centroids = tmp;
+        first_pass = 0;
+    }
+
+    stats->iterations = iteration_number;
+    stats->distance_evaluations = 0;
+    for (t = 0; t < pool.n_threads; t++)
+        stats->distance_evaluations += pool.workers[t].distance_evaluations;
+    stats->skipped_distance_evaluations = (long long)iteration_number * ctx->N * ctx->K - stats->distance_evaluations;
+    stats->allocations = arena->allocations - allocations;
+    stats->allocated_bytes = arena->allocated_bytes - allocated_bytes;
+
+    destroy_worker_pool(&pool);
+
+    return centroids;
+}
+
+/* Writes the index of the closest centroid of every CSR point into labels. */
+void sparse_predict(struct arena *arena, const struct csr_matrix *points, struct matrix *centroids, int n_threads,
+                    int *labels) {
+    struct context ctx;
+    struct worker_pool pool;
+    struct sparse_step step;
+
+    /* The workers only need their share of the points, so their pool is shaped for a single centroid */
+    ctx.N = points->rows;
+    ctx.d = centroids->cols;
+    ctx.K = 1;
+    ctx.iter = 1;
+    ctx.eps = 0;
+    if (points->rows < PREDICT_POOL_MIN_ROWS)
+        n_threads = 1;
+    init_worker_pool(&pool, &ctx, arena, n_threads);
+
+    init_sparse_step(&step, arena, &pool, points, centroids->rows, centroids->cols);
+    step.labels = labels;
+    prepare_sparse_centroids(&step, centroids);
+    run_worker_pool(&pool, sparse_predict_task, &step);
+
+    destroy_worker_pool(&pool);
+}
+
+/* Allocates the transposed centroids and norms of a step over K centroids of dimension d, and K scores per worker. */
+void init_sparse_step(struct sparse_step *step, struct arena *arena, struct worker_pool *pool,
+                      const struct csr_matrix *points, int K, int d) {
+    int t;
+
+    step->points = points;
+    step->transposed = alloc_matrix(arena, d, K);
+    step->centroid_norms = arena_alloc(arena, (size_t)K * sizeof(double));
+    step->labels = NULL;
+    step->refresh_sums = 1;
+
+    for (t = 0; t < pool->n_threads; t++)
+        pool->workers[t].tile = arena_alloc(arena, (size_t)K * sizeof(double));
+}
+
+/*
+ * Transposes the centroids, so that the K coordinates a non-zero of a point is multiplied with are contiguous,
+ * and computes their squared norms.
+ */
+void prepare_sparse_centroids(struct sparse_step *step, struct matrix *centroids) {
+    const double *centroid;
+    int c, j;
+
+    for (c = 0; c < centroids->rows; c++) {
+        centroid = ROW(centroids, c);
+        for (j = 0; j < centroids->cols; j++)
+            ROW(&step->transposed, j)[c] = centroid[j];
+        step->centroid_norms[c] = dot_product(centroid, centroid, centroids->cols);
+    }
+}
+
+/*
+ * Returns the closest centroid to point i, the lowest index among the smallest |c|^2 - 2 x.c (|x|^2 is the same for
+ * every centroid). The K dot products are accumulated in scores, one non-zero of the point at a time.
+ */
+int sparse_arg_min(const struct sparse_step *step, int i, double *scores) {
+    const struct csr_matrix *points = step->points;
+    const double *column;
+    double value, score, min_score = DBL_MAX;
+    long long k;
+    int c, K = step->transposed.cols, label = 0;
+
+    memset(scores, 0, (size_t)K * sizeof(double));
+    for (k = points->indptr[i]; k < points->indptr[i + 1]; k++) {
+        value = points->values[k];
+        column = ROW(&step->transposed, points->indices[k]);
+        for (c = 0; c < K; c++)
+            scores[c] += value * column[c];
+    }
+
+    for (c = 0; c < K; c++) {
+        score = step->centroid_norms[c] - 2 * scores[c];
+        if (score < min_score) {
+            min_score = score;
+            label = c;
+        }
+    }
+
+    return label;
+}
+
+/* Labels the points owned by the worker and brings its partial sums up to date, as assign_task does. */
+static void sparse_assign_task(struct worker *worker, void *arg) {
+    struct sparse_step *step = arg;
+    int i, label;
+
+    if (step->refresh_sums)
+        clear_partial_sums(worker);
+    worker->reassigned = 0;
+
+    for (i = worker->begin; i < worker->end; i++) {
+        label = sparse_arg_min(step, i, worker->tile);
+        update_sparse_partial_sums(worker, step, step->labels[i], label, i);
+        step->labels[i] = label;
+    }
+
+    worker->distance_evaluations += (long long)(worker->end - worker->begin) * step->transposed.cols;
+}
+
+static void sparse_predict_task(struct worker *worker, void *arg) {
+    struct sparse_step *step = arg;
+    int i;
+
+    for (i = worker->begin; i < worker->end; i++)
+        step->labels[i] = sparse_arg_min(step, i, worker->tile);
+}
+
+static void add_sparse_to_partial_sums(struct worker *worker, int label, const struct csr_matrix *points, int i) {
+    double *sum = ROW(&worker->sums, label);
+    long long k;
+
+    for (k = points->indptr[i]; k < points->indptr[i + 1]; k++)
+        sum[points->indices[k]] += points->values[k];
+    worker->counts[label]++;
+}
+
+static void remove_sparse_from_partial_sums(struct worker *worker, int label, const struct csr_matrix *points,
+                                            int i) {
+    double *sum = ROW(&worker->sums, label);
+    long long k;
+
+    for (k = points->indptr[i]; k < points->indptr[i + 1]; k++)
+        sum[points->indices[k]] -= points->values[k];
+    worker->counts[label]--;
+}
+
+/* update_partial_sums for sparse point i: only its non-zeros are added or removed. */
+static void update_sparse_partial_sums(struct worker *worker, const struct sparse_step *step, int old_label,
+                                       int label, int i) {
+    if (label != old_label) {
+        worker->reassigned++;
+        if (!step->refresh_sums)
+            remove_sparse_from_partial_sums(worker, old_label, step->points, i);
+    }
+    if (label != old_label || step->refresh_sums)
+        add_sparse_to_partial_sums(worker, label, step->points, i);
+}
+
+/** Persistent models **/
+
+/*
+ * A model keeps its training points so it can be refitted, and the sums and counts of its clusters so that
+ * model_add_points and model_drop_points update the centroids in time proportional to the points added or dropped.
+ * A warm started fit then only needs the few Lloyd iterations it takes the labels of the older points to settle.
+ */
+void init_model(struct model *model, struct matrix *initial_centroids, int K, int iter, double eps) {
+    model->ctx.N = 0;
+    model->ctx.d = initial_centroids->cols;
+    model->ctx.K = K;
+    model->ctx.iter = iter;
+    model->ctx.eps = eps;
+    model->capacity = 0;
+    model->points.values = NULL;
+    model->points.rows = 0;
+    model->points.cols = model->ctx.d;
+    model->points.stride = (model->ctx.d + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+    model->labels = NULL;
+    model->iterations = 0;
+
+    init_arena(&model->arena);
+    model->centroids = alloc_matrix(&model->arena, K, model->ctx.d);
+    model->sums = alloc_matrix(&model->arena, K, model->ctx.d);
+    model->counts = arena_alloc(&model->arena, (size_t)K * sizeof(int));
+    copy_first_K_vectors(&model->centroids, initial_centroids);
+
+    init_arena(&model->index.arena);
+    build_centroid_index(&model->index, &model->centroids);
+}
+
+void free_model(struct model *model) {
+    free(model->points.values);
+    free(model->labels);
+    free_arena(&model->arena);
+    free_arena(&model->index.arena);
+}
+
+/* Makes room for rows points in total, at least doubling the capacity so appending stays amortized linear. */
+void reserve_model_points(struct model *model, int rows) {
+    int capacity = model->capacity;
+    double *values;
+    int *labels;
+
+    if (rows <= capacity)
+        return;
+    while (capacity < rows)
+        capacity = capacity < 1024 ? 1024 : (capacity > INT_MAX / 2 ? INT_MAX : capacity * 2);
+
+    values = realloc(model->points.values, (size_t)capacity * model->points.stride * sizeof(double));
+    if (values == NULL)
+        mem_error();
+    model->points.values = values;
+
+    labels = realloc(model->labels, (size_t)capacity * sizeof(int));
+    if (labels == NULL)
+        mem_error();
+    model->labels = labels;
+
+    model->capacity = capacity;
+}
+
+/* Appends points, labels them with the current centroids and adds them to the sums of their clusters. */
+void model_add_points(struct model *model, struct matrix *points) {
+    const double *point;
+    double *sum;
+    int i, j, label = 0, first = model->ctx.N;
+
+    reserve_model_points(model, first + points->rows);
+
+    for (i = 0; i < points->rows; i++) {
+        point = ROW(points, i);
+        memcpy(ROW(&model->points, first + i), point, model->ctx.d * sizeof(double));
+
+        label = index_nearest(&model->index, point, label);
+        model->labels[first + i] = label;
+        sum = ROW(&model->sums, label);
+        for (j = 0; j < model->ctx.d; j++)
+            sum[j] += point[j];
+        model->counts[label]++;
+    }
+
+    model->ctx.N += points->rows;
+    model->points.rows = model->ctx.N;
+}
+
+/* Forgets the n oldest points, taking them out of the sums of their clusters. */
+void model_drop_points(struct model *model, int n) {
+    const double *point;
+    double *sum;
+    int i, j, label;
+
+    if (n > model->ctx.N)
+        n = model->ctx.N;
+    if (n <= 0)
+        return;
+
+    for (i = 0; i < n; i++) {
+        point = ROW(&model->points, i);
+        label = model->labels[i];
+        sum = ROW(&model->sums, label);
+        for (j = 0; j < model->ctx.d; j++)
+            sum[j] -= point[j];
+        model->counts[label]--;
+    }
+
+    model->ctx.N -= n;
+    model->points.rows = model->ctx.N;
+    memmove(model->points.values, ROW(&model->points, n),
+            (size_t)model->ctx.N * model->points.stride * sizeof(double));
+    memmove(model->labels, model->labels + n, (size_t)model->ctx.N * sizeof(int));
+}
+
+/* Sets every centroid to the mean of its cluster. An empty cluster keeps its centroid. */
+void model_update_centroids(struct model *model) {
+    double *centroid;
+    const double *sum;
+    int i, j;
+
+    for (i = 0; i < model->ctx.K; i++) {
+        if (model->counts[i] == 0)
+            continue;
+        centroid = ROW(&model->centroids, i);
+        sum = ROW(&model->sums, i);
+        for (j = 0; j < model->ctx.d; j++)
+            centroid[j] = sum[j];
+        divide_by_scalar(centroid, model->counts[i], model->ctx.d);
+    }
+
+    build_centroid_index(&model->index, &model->centroids);
+}
+
+/*
+ * Runs at most iter iterations of k_means over the points held, starting from the current centroids, and sums the
+ * clusters of the resulting labels again.
+ */
+void model_fit(struct model *model, int iter, int n_threads, int algorithm) {
+    struct context ctx = model->ctx;
+    struct arena arena;
+    struct matrix centroids;
+    struct run_stats stats;
+    double *sum;
+    const double *point;
+    int i, j, label;
+
+    model->iterations = 0;
+    if (model->ctx.N == 0 || iter <= 0)
+        return;
+
+    ctx.iter = iter;
+    init_arena(&arena);
+    stats.trace = NULL;
+    centroids = k_means(&ctx, &arena, &model->points, NULL, NULL, &model->centroids, n_threads, algorithm, NULL,
+                        &stats, model->labels);
+    copy_first_K_vectors(&model->centroids, &centroids);
+    model->iterations = stats.iterations;
+    free_arena(&arena);
+    build_centroid_index(&model->index, &model->centroids);
+
+    memset(model->sums.values, 0, (size_t)model->ctx.K * model->sums.stride * sizeof(double));
+    memset(model->counts, 0, (size_t)model->ctx.K * sizeof(int));
+    for (i = 0; i < model->ctx.N; i++) {
+        point = ROW(&model->points, i);
+        label = model->labels[i];
+        sum = ROW(&model->sums, label);
+        for (j = 0; j < model->ctx.d; j++)
+            sum[j] += point[j];
+        model->counts[label]++;
+    }
+}
+
+/* Writes the index of the closest centroid of every point into labels. */
+void model_predict(struct model *model, struct matrix *points, int n_threads, int *labels) {
+    predict_labels(&model->index, points, n_threads, labels);
+}
+
+/*
+ * Labels points with the centroids of an index, on n_threads workers. Small batches are labelled by the calling
+ * thread without allocating anything.
+ */
+void predict_labels(struct centroid_index *index, struct matrix *points, int n_threads, int *labels) {
+    struct context ctx;
+    struct arena arena;
+    struct worker_pool pool;
+    struct predict_step step;
+
+    if (n_threads == 1 || points->rows < PREDICT_POOL_MIN_ROWS) {
+        index_predict(index, points, 0, points->rows, labels);
+        return;
+    }
+
+    /* The workers only need their share of the points, so their pool is shaped for a single centroid */
+    ctx.N = points->rows;
+    ctx.d = points->cols;
+    ctx.K = 1;
+    ctx.iter = 1;
+    ctx.eps = 0;
+    init_arena(&arena);
+    init_worker_pool(&pool, &ctx, &arena, n_threads);
+
+    step.index = index;
+    step.points = points;
+    step.labels = labels;
+    run_worker_pool(&pool, predict_task, &step);
+
+    destroy_worker_pool(&pool);
+    free_arena(&arena);
+}
+
+static void predict_task(struct worker *worker, void *arg) {
+    struct predict_step *step = arg;
+
+    index_predict(step->index, step->points, worker->begin, worker->end, step->labels);
+}
+
+/** Centroid index **/
+
+/*
+ * The index gives the same label as arg_min_dist, the lowest index among the closest centroids, so predict agrees
+ * with fit. Both searches compare the same squared_dist values and only rule a centroid out when it is strictly
+ * farther than the best one so far: the k-d tree because the squared distance to a splitting plane, rounded, never
+ * exceeds the rounded squared distance to a centroid on its other side, and the scan through BOUND_SLACK as in Elkan.
+ */
+void build_centroid_index(struct centroid_index *index, struct matrix *centroids) {
+    int K = centroids->rows, d = centroids->cols;
+    int i, j, n_nodes = 0, finite = 1;
+    const double *centroid;
+    double half;
+
+    free_arena(&index->arena);
+    index->centroids = centroids;
+    index->nodes = NULL;
+    index->order = NULL;
+    index->half_distances = NULL;
+    index->separations = NULL;
+
+    for (i = 0; finite && i < K; i++) {
+        centroid = ROW(centroids, i);
+        for (j = 0; j < d; j++)
+            finite &= isfinite(centroid[j]) != 0;
+    }
+
+    if (K < INDEX_MIN_K || !finite || (d > KD_TREE_MAX_D && K > INDEX_BOUNDS_MAX_K)) {
+        index->kind = INDEX_SCAN;
+        return;
+    }
+
+    if (d <= KD_TREE_MAX_D) {
+        index->kind = INDEX_KD_TREE;
+        index->order = arena_alloc(&index->arena, (size_t)K * sizeof(int));
+        index->nodes = arena_alloc(&index->arena, (size_t)2 * K * sizeof(struct kd_node));
+        for (i = 0; i < K; i++)
+            index->order[i] = i;
+        build_kd_node(index, &n_nodes, 0, K);
+        return;
+    }
+
+    index->kind = INDEX_BOUNDS;
+    index->half_distances = arena_alloc(&index->arena, (size_t)K * K * sizeof(double));
+    index->separations = arena_alloc(&index->arena, (size_t)K * sizeof(double));
+    for (i = 0; i < K; i++)
+        index->separations[i] = DBL_MAX;
+    for (i = 0; i < K; i++) {
+        for (j = i + 1; j < K; j++) {
+            half = 0.5 * sqrt(squared_dist(ROW(centroids, i), ROW(centroids, j), d)) * (1 - BOUND_SLACK);
+            index->half_distances[(size_t)i * K + j] = half;
+            index->half_distances[(size_t)j * K + i] = half;
+            if (half < index->separations[i])
+                index->separations[i] = half;
+            if (half < index->separations[j])
+                index->separations[j] = half;
+        }
+    }
+}
+
+/*
+ * Builds the subtree over order[begin, end) and returns its node. Nodes are split at the median of their widest
+ * coordinate, so a tree of K centroids has fewer than 2K nodes and a depth of about log2(K / KD_LEAF_SIZE).
+ */
+static int build_kd_node(struct centroid_index *index, int *n_nodes, int begin, int end) {
+    struct matrix *centroids = index->centroids;
+    int id = (*n_nodes)++;
+    struct kd_node *node = &index->nodes[id];
+    int i, j, mid, axis = -1;
+    double low, high, value, widest = 0;
+
+    node->axis = -1;
+    node->begin = begin;
+    node->end = end;
+    if (end - begin <= KD_LEAF_SIZE)
+        return id;
+
+    for (j = 0; j < centroids->cols; j++) {
+        low = high = ROW(centroids, index->order[begin])[j];
+        for (i = begin + 1; i < end; i++) {
+            value = ROW(centroids, index->order[i])[j];
+            if (value < low)
+                low = value;
+            if (value > high)
+                high = value;
+        }
+        if (high - low > widest) {
+            widest = high - low;
+            axis = j;
+        }
+    }
+    if (axis < 0)   /* The centroids are all the same point */
+        return id;
+
+    mid = begin + (end - begin) / 2;
+    select_along_axis(index, axis, begin, end, mid);
+    node->axis = axis;
+    node->split = ROW(centroids, index->order[mid])[axis];
+    node->left = build_kd_node(index, n_nodes, begin, mid);
+    node->right = build_kd_node(index, n_nodes, mid, end);
+
+    return id;
+}
+
+/*
+ * Reorders order[begin, end) so that order[mid] is the centroid of rank mid along axis: no centroid before it has
+ * a larger coordinate and none after it a smaller one.
+ */
+static void select_along_axis(struct centroid_index *index, int axis, int begin, int end, int mid) {
+    struct matrix *centroids = index->centroids;
+    int *order = index->order;
+    int low = begin, high = end - 1, i, j, tmp;
+    double pivot;
+
+    while (low < high) {
+        pivot = ROW(centroids, order[low + (high - low) / 2])[axis];
+        i = low;
+        j = high;
+        while (i <= j) {
+            while (ROW(centroids, order[i])[axis] < pivot)
+                i++;
+            while (ROW(centroids, order[j])[axis] > pivot)
+                j--;
+            if (i <= j) {
+                tmp = order[i];
+                order[i++] = order[j];
+                order[j--] = tmp;
+            }
+        }
+        if (mid <= j)
+            high = j;
+        else if (mid >= i)
+            low = i;
+        else
+            break;
+    }
+}
+
+/* The index of the closest centroid to point. guess is a likely answer, such as the label of the previous point. */
+int index_nearest(const struct centroid_index *index, const double *point, int guess) {
+    switch (index->kind) {
+        case INDEX_KD_TREE:
+            return kd_tree_nearest(index, point);
+        case INDEX_BOUNDS:
+            return bounds_nearest(index, point, guess);
+        default:
+            return arg_min_dist(point, index->centroids);
+    }
+}
+
+/* Depth first search of the k-d tree, nearer side first, with a fixed stack of the sides left for later. */
+static int kd_tree_nearest(const struct centroid_index *index, const double *point) {
+    struct matrix *centroids = index->centroids;
+    const struct kd_node *node;
+    int stack[KD_MAX_DEPTH];
+    double bounds[KD_MAX_DEPTH];
+    int top = 0, k, c, label = -1;
+    double best = DBL_MAX, distance, diff;
+
+    stack[top] = 0;
+    bounds[top++] = 0;
+    while (top > 0) {
+        top--;
+        if (bounds[top] > best)
+            continue;
+        node = &index->nodes[stack[top]];
+
+        while (node->axis >= 0) {
+            diff = point[node->axis] - node->split;
+            stack[top] = diff < 0 ? node->right : node->left;
+            bounds[top++] = diff * diff;
+            node = &index->nodes[diff < 0 ? node->left : node->right];
+        }
+
+        for (k = node->begin; k < node->end; k++) {
+            c = index->order[k];
+            distance = squared_dist(point, ROW(centroids, c), centroids->cols);
+            if (distance < best || (distance == best && c < label)) {
+                best = distance;
+                label = c;
+            }
+        }
+    }
+
+    return label;
+}
+
+/* Scans the centroids from guess on, skipping those at least twice as far from the best centroid as the point is. */
+static int bounds_nearest(const struct centroid_index *index, const double *point, int guess) {
+    struct matrix *centroids = index->centroids;
+    int K = centroids->rows, d = centroids->cols;
+    int j, label;
+    double best, upper, distance;
+
+    if (guess < 0 || guess >= K)
+        guess = 0;
+    label = guess;
+    best = squared_dist(point, ROW(centroids, guess), d);
+    if (!(best < DBL_MAX))   /* Not a finite point: no bound holds */
+        return arg_min_dist(point, centroids);
+    upper = sqrt(best) * (1 + BOUND_SLACK);
+    if (upper < index->separations[guess])   /* No other centroid can be as close */
+        return guess;
+
+    for (j = 0; j < K; j++) {
+        if (j == guess || upper < index->half_distances[(size_t)label * K + j])
+            continue;
+        distance = squared_dist(point, ROW(centroids, j), d);
+        if (distance < best || (distance == best && j < label)) {
+            best = distance;
+            label = j;
+            upper = sqrt(best) * (1 + BOUND_SLACK);
+        }
+    }
+
+    return label;
+}
+
+/* Labels the points [begin, end), each search starting from the label of the previous point. */
+void index_predict(const struct centroid_index *index, struct matrix *points, int begin, int end, int *labels) {
+    int i, label = 0;
+
+    for (i = begin; i < end; i++) {
+        label = index_nearest(index, ROW(points, i), label);
+        labels[i] = label;
+    }
+}
+
+/** Text point files **/
+
+/*
+ * A text point file has one point per line, its values separated by commas (as in the input files of
+ * kmeans_pp.py) or blanks. Blank lines are skipped and every other line must have the same number of values.
+ * The text is cut at line breaks into one chunk per worker, and the chunks are parsed in parallel.
+ */
+
+/* Reads a whole stream into a NUL terminated buffer. Returns NULL with errno set on failure. */
+char* read_text_stream(FILE *in, size_t *length) {
+    struct stat info;
+    char *text, *tmp;
+    size_t capacity = 1 << 16, count = 0, got;
+
+    /* A regular file is read in one go */
+    if (fstat(fileno(in), &info) == 0 && S_ISREG(info.st_mode) && (size_t)info.st_size + 1 > capacity)
+        capacity = (size_t)info.st_size + 1;
+
+    text = malloc(capacity + 1);
+    if (text == NULL)
+        mem_error();
+
+    while ((got = fread(text + count, 1, capacity - count, in)) > 0) {
+        count += got;
+        if (count == capacity) {
+            capacity *= 2;
+            tmp = realloc(text, capacity + 1);
+            if (tmp == NULL) {
+                free(text);
+                mem_error();
+            }
+            text = tmp;
+        }
+    }
+
+    if (ferror(in)) {
+        free(text);
+        return NULL;
+    }
+
+    text[count] = '\0';
+    *length = count;
+    return text;
+}
+
+/* Reads the file at path into a NUL terminated buffer. Returns NULL with errno set on failure. */
+char* read_text_file(const char *path, size_t *length) {
+    FILE *in;
+    char *text;
+    int error;
+
+    in = fopen(path, "rb");
+    if (in == NULL)
+        return NULL;
+
+    text = read_text_stream(in, length);
+    error = errno;
+    fclose(in);
+    errno = error;
+
+    return text;
+}
+
+/*
+ * Parses the number at p like strtod, and stores where it ends in *end.
+ * Plain decimals with at most 19 significant digits and a small exponent (every value of the input files) take
+ * Clinger's fast path: the digits and the power of ten are both exact doubles, so one IEEE multiplication or
+ * division rounds the result correctly, to the same double strtod returns. Anything else goes to strtod.
+ */
+double parse_double(const char *p, char **end) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *s = p, *after_mantissa;
+    uint64_t mantissa = 0;
+    int negative = 0, digits = 0, significant = 0, exponent = 0, e = 0, e_negative = 0;
+    double value;
+
+    if (*s == '-' || *s == '+')
+        negative = *s++ == '-';
+
+    for (; (unsigned)(*s - '0') < 10; s++, digits++) {
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+            significant += mantissa != 0;
+        }
+        else {
+            significant = 20;
+        }
+    }
+    if (*s == '.') {
+        for (s++; (unsigned)(*s - '0') < 10; s++, digits++) {
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*s - '0');
+                significant += mantissa != 0;
+                exponent--;
+            }
+            else {
+                significant = 20;
+            }
+        }
+    }
+    after_mantissa = s;
+
+    if (digits > 0 && (*s == 'e' || *s == 'E')) {
+        s++;
+        if (*s == '-' || *s == '+')
+            e_negative = *s++ == '-';
+        if ((unsigned)(*s - '0') < 10) {
+            for (; (unsigned)(*s - '0') < 10; s++)
+                if (e < 10000)
+                    e = e * 10 + (*s - '0');
+            exponent += e_negative ? -e : e;
+        }
+        else {
+            s = after_mantissa;  /* "1e" is the number 1 followed by an "e" */
+        }
+    }
+
+    /* Hexadecimal, nan, inf, too many digits or a large exponent */
+    if (digits == 0 || significant > 19 || mantissa > ((uint64_t)1 << 53) || exponent < -22 || exponent > 22
+            || isalpha((unsigned char)*s) || *s == '.')
+        return strtod(p, end);
+
+    value = (double)mantissa;
+    if (exponent < 0)
+        value /= powers_of_ten[-exponent];
+    else
+        value *= powers_of_ten[exponent];
+
+    *end = (char *)s;
+    return negative ? -value : value;
+}
+
+/*
+ * Parses the lines in [p, end) into chunk->table (values malloc'ed, rows x cols, no padding).
+ * Returns 0, or -1 with chunk->table.error and the line of the chunk it was found on.
+ */
+int parse_text_range(const char *p, const char *end, struct text_chunk *chunk) {
+    struct text_table *table = &chunk->table;
+    char *next;
+    double *values, *tmp;
+    size_t capacity, count = 0;
+    int cols, line = 0;
+
+    table->values = NULL;
+    table->rows = 0;
+    table->cols = 0;
+    table->error = NULL;
+
+    /* A first guess of one value per 8 characters saves most of the reallocations */
+    capacity = (size_t)(end - p) / 8 + 16;
+    values = malloc(capacity * sizeof(double));
+    if (values == NULL)
+        mem_error();
+
+    while (p < end) {
+        line++;
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        if (p < end && *p == '\n') {  /* Blank line */
+            p++;
+            continue;
+        }
+        if (p == end)
+            break;
+
+        for (cols = 0; ; cols++) {
+            if (count == capacity) {
+                capacity *= 2;
+                tmp = realloc(values, capacity * sizeof(double));
+                if (tmp == NULL) {
+                    free(values);
+                    mem_error();
+                }
+                values = tmp;
+            }
+
+            /* strtod would skip a line break, and read the first value of the next line */
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (p == end || *p == '\n' || *p == '\r') {
+                table->error = "expected a number";
+                break;
+            }
+            values[count] = parse_double(p, &next);
+            if (next == p) {
+                table->error = "expected a number";
+                break;
+            }
+            count++;
+            p = next;
+
+            while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                p++;
+            if (p < end && *p == ',')
+                p++;
+            else if (p == end || *p == '\n')
+                break;
+            else if (p[-1] != ' ' && p[-1] != '\t') {
+                table->error = "expected a separator";
+                break;
+            }
+        }
+
+        if (table->error == NULL && table->rows > 0 && cols + 1 != table->cols)
+            table->error = "the number of values differs from the previous lines";
+        if (table->error != NULL) {
+            table->error_line = line;
+            free(values);
+            return -1;
+        }
+
+        table->cols = cols + 1;
+        table->rows++;
+        if (p < end)
+            p++;
+    }
+
+    chunk->lines = line;
+    table->values = values;
+    return 0;
+}
+
+/* Parses the chunks owned by a worker. */
+static void parse_chunks_task(struct worker *worker, void *arg) {
+    struct parse_step *step = arg;
+    int i;
+
+    for (i = worker->begin; i < worker->end; i++)
+        step->status[i] = parse_text_range(step->chunks[i].begin, step->chunks[i].end, &step->chunks[i]);
+}
+
+/*
+ * Parses the text of a point file on the workers of pool into table->values (malloc'ed, rows x cols, no
+ * padding). Returns 0, or -1 with table->error and table->error_line describing the first bad line.
+ */
+int parse_text_table(struct worker_pool *pool, const char *text, size_t length, struct text_table *table) {
+    const struct context *ctx = pool->ctx;
+    struct parse_step step;
+    struct text_chunk *chunk;
+    size_t offset, at = 0;
+    int n_chunks, i, lines = 0, status = 0;
+
+    /* Small files are not worth the hand-off */
+    n_chunks = pool->n_threads;
+    if (length < (size_t)n_chunks * PARSE_CHUNK_MIN_BYTES)
+        n_chunks = (int)(length / PARSE_CHUNK_MIN_BYTES);
+    if (n_chunks < 1)
+        n_chunks = 1;
+
+    step.chunks = malloc((size_t)n_chunks * (sizeof(struct text_chunk) + sizeof(int)));
+    if (step.chunks == NULL)
+        mem_error();
+    step.status = (int *)(step.chunks + n_chunks);
+
+    /* Every chunk ends right after a line break, so that no line is cut in two */
+    for (i = 0; i < n_chunks; i++) {
+        chunk = &step.chunks[i];
+        chunk->begin = text + at;
+        offset = i == n_chunks - 1 ? length : length / n_chunks * (i + 1);
+        if (offset < at)
+            offset = at;
+        while (offset > 0 && offset < length && text[offset - 1] != '\n')
+            offset++;
+        chunk->end = text + offset;
+        at = offset;
+    }
+
+    partition_worker_pool(pool, n_chunks);
+    run_worker_pool(pool, parse_chunks_task, &step);
+
+    /* The chunks must agree on the number of columns; the first error in file order is the one reported */
+    table->values = NULL;
+    table->rows = 0;
+    table->cols = 0;
+    table->error = NULL;
+    for (i = 0; i < n_chunks; i++) {
+        chunk = &step.chunks[i];
+        if (step.status[i] == 0 && chunk->table.rows > 0 && table->rows > 0 && chunk->table.cols != table->cols) {
+            step.status[i] = -1;
+            chunk->table.error = "the number of values differs from the previous lines";
+            chunk->table.error_line = 1;
+            while (chunk->begin[0] == '\n' || chunk->begin[0] == '\r') {  /* Find its first non blank line */
+                chunk->begin++;
+                chunk->table.error_line += chunk->begin[-1] == '\n';
+            }
+        }
+        if (step.status[i] < 0) {
+            table->error = chunk->table.error;
+            table->error_line = lines + chunk->table.error_line;
+            status = -1;
+            break;
+        }
+        if (chunk->table.rows > 0)
+            table->cols = chunk->table.cols;
+        table->rows += chunk->table.rows;
+        lines += chunk->lines;
+    }
+
+    if (status == 0) {
+        table->values = malloc(((size_t)table->rows * table->cols + 1) * sizeof(double));
+        if (table->values == NULL)
+            mem_error();
+        for (i = 0, at = 0; i < n_chunks; i++) {
+            memcpy(table->values + at, step.chunks[i].table.values,
+                   (size_t)step.chunks[i].table.rows * table->cols * sizeof(double));
+            at += (size_t)step.chunks[i].table.rows * table->cols;
+        }
+    }
+
+    for (i = 0; i < n_chunks; i++)
+        if (step.status[i] == 0)
+            free(step.chunks[i].table.values);
+    partition_worker_pool(pool, ctx->N);
+    free(step.chunks);
+
+    return status;
+}
+
+/* Reads and parses the point file at path. Returns 0, or -1 with table->error (NULL for an OS error in errno). */
+int load_text_table(struct worker_pool *pool, const char *path, struct text_table *table) {
+    char *text;
+    size_t length;
+    int status;
+
+    text = read_text_file(path, &length);
+    if (text == NULL) {
+        table->values = NULL;
+        table->error = NULL;
+        table->os_error = errno;
+        return -1;
+    }
+
+    status = parse_text_table(pool, text, length, table);
+    free(text);
+
+    return status;
+}
+
+static int compare_keyed_rows(const void *a, const void *b) {
+    const struct keyed_row *x = a, *y = b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    return (x->row > y->row) - (x->row < y->row);
+}
+
+/* Sorts the rows of a table by their key (the first value), keeping the file order between equal keys. */
+struct keyed_row* sort_table_keys(struct text_table *table) {
+    struct keyed_row *sorted;
+    int i;
+
+    sorted = malloc(((size_t)table->rows + 1) * sizeof(struct keyed_row));
+    if (sorted == NULL)
+        mem_error();
+
+    for (i = 0; i < table->rows; i++) {
+        sorted[i].key = table->values[(size_t)i * table->cols];
+        sorted[i].row = i;
+    }
+    qsort(sorted, table->rows, sizeof(struct keyed_row), compare_keyed_rows);
+
+    return sorted;
+}
+
+/*
+ * Inner joins two tables on their first column, like pandas.merge followed by a sort on the key: every pair of
+ * rows with the same key gives one point, made of the other values of the first row followed by the other
+ * values of the second one. The points come sorted by key into *points, a dense matrix, and their keys into *keys,
+ * both allocated with malloc for the caller to free or hand over to Python. Returns 0, or -1 if a key is not finite.
+ */
+int join_tables(struct text_table *left, struct text_table *right, struct matrix *points, long long **keys) {
+    struct keyed_row *a, *b;
+    const double *x, *y;
+    double key;
+    int i = 0, j = 0, i_end, j_end, s, t, rows = 0, cols, at;
+
+    a = sort_table_keys(left);
+    b = sort_table_keys(right);
+
+    for (i = 0; i < left->rows; i++)
+        if (!isfinite(a[i].key))
+            break;
+    for (j = 0; j < right->rows; j++)
+        if (!isfinite(b[j].key))
+            break;
+    if (i < left->rows || j < right->rows) {
+        free(a);
+        free(b);
+        return -1;
+    }
+
+    /* Count the joined rows first so that they can go straight into the matrix returned to Python */
+    for (i = 0, j = 0; i < left->rows && j < right->rows; ) {
+        if (a[i].key < b[j].key) {
+            i++;
+        }
+        else if (b[j].key < a[i].key) {
+            j++;
+        }
+        else {
+            for (i_end = i; i_end < left->rows && a[i_end].key == a[i].key; i_end++);
+            for (j_end = j; j_end < right->rows && b[j_end].key == b[j].key; j_end++);
+            rows += (i_end - i) * (j_end - j);
+            i = i_end;
+            j = j_end;
+        }
+    }
+
+    /* An empty file has no columns at all, and then no values besides the keys either */
+    cols = (left->cols > 1 ? left->cols - 1 : 0) + (right->cols > 1 ? right->cols - 1 : 0);
+    points->values = malloc(((size_t)rows * cols + 1) * sizeof(double));
+    *keys = malloc(((size_t)rows + 1) * sizeof(long long));
+    if (points->values == NULL || *keys == NULL)
+        mem_error();
+    points->rows = rows;
+    points->cols = cols;
+    points->stride = cols;
+
+    for (i = 0, j = 0, at = 0; i < left->rows && j < right->rows; ) {
+        if (a[i].key < b[j].key) {
+            i++;
+        }
+        else if (b[j].key < a[i].key) {
+            j++;
+        }
+        else {
+            key = a[i].key;
+            for (i_end = i; i_end < left->rows && a[i_end].key == key; i_end++);
+            for (j_end = j; j_end < right->rows && b[j_end].key == key; j_end++);
+
+            for (s = i; s < i_end; s++) {
+                for (t = j; t < j_end; t++, at++) {
+                    x = left->values + (size_t)a[s].row * left->cols;
+                    y = right->values + (size_t)b[t].row * right->cols;
+                    memcpy(ROW(points, at), x + 1, (left->cols - 1) * sizeof(double));
+                    memcpy(ROW(points, at) + left->cols - 1, y + 1, (right->cols - 1) * sizeof(double));
+                    (*keys)[at] = (long long)key;
+                }
+            }
+            i = i_end;
+            j = j_end;
+        }
+    }
+
+    free(a);
+    free(b);
+
+    return 0;
+}
+
+/** Binary point files **/
+
+/*
+ * A point file is a POINT_FILE_HEADER_SIZE bytes header followed by the rows of an N x d row-major matrix of
+ * little-endian float64 ('d') or float32 ('f') values, starting at header.data_offset (a multiple of the value size,
+ * so the mapped values are aligned).
+ * open_point_file maps the whole file read-only, so fit_file clusters it in place without loading it.
+ */
+
+/* Maps path and checks its header. Returns 0, or -1 with *error describing the problem (errno is kept). */
+int open_point_file(const char *path, struct point_file *file, const char **error) {
+    struct point_file_header header;
+    struct stat info;
+    size_t item_bytes, row_bytes, rows_bytes;
+    int fd;
+
+    file->base = NULL;
+    file->length = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *error = NULL;
+        return -1;
+    }
+
+    if (fstat(fd, &info) < 0 || read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        *error = "the file is too short to hold a point file header";
+        close(fd);
+        return -1;
+    }
+
+    if (memcmp(header.magic, POINT_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version != POINT_FILE_VERSION) {
+        *error = "not a point file (bad magic or version)";
+        close(fd);
+        return -1;
+    }
+    if (header.dtype != 'd' && header.dtype != 'f') {
+        *error = "unknown point file dtype";
+        close(fd);
+        return -1;
+    }
+
+    item_bytes = header.dtype == 'd' ? sizeof(double) : sizeof(float);
+    if (header.rows == 0 || header.cols == 0 || header.rows > INT_MAX || header.cols > INT_MAX
+            || header.data_offset < sizeof(header) || header.data_offset > (uint64_t)info.st_size) {
+        *error = "the point file header does not match the file size";
+        close(fd);
+        return -1;
+    }
+    if (header.data_offset % item_bytes != 0) {
+        *error = "the point file data offset is not a multiple of the value size";
+        close(fd);
+        return -1;
+    }
+
+    /* The sizes are checked before they are multiplied, so a corrupt header cannot wrap them around */
+    row_bytes = (size_t)header.cols * item_bytes;
+    if (header.rows > (SIZE_MAX - header.data_offset) / row_bytes
+            || header.rows > ((uint64_t)info.st_size - header.data_offset) / row_bytes) {
+        *error = "the point file header does not match the file size";
+        close(fd);
+        return -1;
+    }
+    rows_bytes = (size_t)header.rows * row_bytes;
+
+    file->length = header.data_offset + rows_bytes;
+    file->base = mmap(NULL, file->length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file->base == MAP_FAILED) {
+        file->base = NULL;
+        *error = NULL;
+        return -1;
+    }
+
+    /* Every pass reads the file front to back */
+    madvise(file->base, file->length, MADV_SEQUENTIAL);
+
+    file->dtype = (char)header.dtype;
+    file->data = (char *)file->base + header.data_offset;
+    file->points.values = file->dtype == 'd' ? (double *)file->data : NULL;
+    file->points.rows = (int)header.rows;
+    file->points.cols = (int)header.cols;
+    file->points.stride = (int)header.cols;
+    file->points32.values = file->dtype == 'f' ? (float *)file->data : NULL;
+    file->points32.rows = file->points.rows;
+    file->points32.cols = file->points.cols;
+    file->points32.stride = file->points.stride;
+    file->row_bytes = row_bytes;
+    file->block_rows = (int)(POINT_FILE_BLOCK_BYTES / row_bytes);
+    if (file->block_rows < 1)
+        file->block_rows = 1;
+
+    return 0;
+}
+
+void close_point_file(struct point_file *file) {
+    if (file->base != NULL)
+        munmap(file->base, file->length);
+    file->base = NULL;
+}
+
+/* Gives the kernel a paging hint for the pages holding only rows [begin, end). */
+void advise_point_file(struct point_file *file, int begin, int end, int advice) {
+    uintptr_t page = (uintptr_t)page_size();
+    uintptr_t first = (uintptr_t)file->data + (size_t)begin * file->row_bytes;
+    uintptr_t last = (uintptr_t)file->data + (size_t)end * file->row_bytes;
+
+    first = (first + page - 1) / page * page;
+    last = last / page * page;
+    if (last <= first)
+        return;
+
+    madvise((void *)first, last - first, advice == POINT_FILE_WILL_NEED ? MADV_WILLNEED : MADV_DONTNEED);
+}
+
+long page_size() {
+    static long size = 0;
+
+    if (size == 0)
+        size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? size : 4096;
+}
+
+/*
+ * Writes the rows of points as a float64 point file, or the rows of points32 as a float32 one when it is not NULL.
+ * Returns 0, or -1 with errno set.
+ */
+int write_point_file(const char *path, struct matrix *points, struct matrix_f *points32) {
+    struct point_file_header header;
+    FILE *out;
+    size_t item = points32 != NULL ? sizeof(float) : sizeof(double);
+    int rows = points32 != NULL ? points32->rows : points->rows;
+    int cols = points32 != NULL ? points32->cols : points->cols;
+    int stride = points32 != NULL ? points32->stride : points->stride;
+    const char *values = points32 != NULL ? (const char *)points32->values : (const char *)points->values;
+    int i, status = 0;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = POINT_FILE_VERSION;
+    header.dtype = points32 != NULL ? 'f' : 'd';
+    header.rows = (uint64_t)rows;
+    header.cols = (uint64_t)cols;
+    header.data_offset = sizeof(header);
+
+    out = fopen(path, "wb");
+    if (out == NULL)
+        return -1;
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1)
+        status = -1;
+
+    if (stride == cols) {
+        if (status == 0 && fwrite(values, item * cols, rows, out) != (size_t)rows)
+            status = -1;
+    }
+    else {
+        for (i = 0; status == 0 && i < rows; i++)
+            if (fwrite(values + (size_t)i * stride * item, item, cols, out) != (size_t)cols)
+                status = -1;
+    }
+
+    if (fclose(out) != 0)
+        status = -1;
+
+    return status;
+}
+
+/** Distance kernels **/
+
+/*
+ * All the kernels compute the squared Euclidean distance between the first n entries of u and v, and all of them
+ * sum it in the same order, so they return the same double: entry i goes to lane i % DISTANCE_LANES, every lane
+ * adds its entries in order, and the lanes are then added pairwise as the halves of a vector register, lane l with
+ * lane l + 4, then l with l + 2, then 0 with 1. The vector kernels keep the lanes in registers (padding the last
+ * block with zeros, which leaves every lane unchanged) and multiply and add separately, without FMA; setup.py
+ * turns off floating point contraction so that the compiler does not fuse them either.
+ * init_distance_kernels picks the widest kernel the CPU supports when the module is imported.
+ */
+
+/*
+ * The scalar form of the shared order. It is inlined into the fixed dimension instances of lloyd_range, where the
+ * compiler unrolls it, so they find the labels squared_dist gives whichever kernel it uses.
+ */
+static inline double squared_dist_lanes(const double *u, const double *v, int n) {
+    double lanes[DISTANCE_LANES] = {0};
+    double diff;
+    int i;
+
+    /* The first block is stored rather than added to zero, which the compiler cannot leave out */
+    for (i = 0; i < n && i < DISTANCE_LANES; i++) {
+        diff = u[i] - v[i];
+        lanes[i] = diff * diff;
+    }
+    for (; i < n; i++) {
+        diff = u[i] - v[i];
+        lanes[i % DISTANCE_LANES] += diff * diff;
+    }
+    /* Lane j is empty (zero) when j >= n, and adding it would not change the sum, so it is skipped */
+    for (i = 0; i < 4 && i + 4 < n; i++)
+        lanes[i] += lanes[i + 4];
+    for (i = 0; i < 2 && i + 2 < n; i++)
+        lanes[i] += lanes[i + 2];
+    if (n > 1)
+        lanes[0] += lanes[1];
+
+    return lanes[0];
+}
+
+double squared_dist_scalar(const double *u, const double *v, int n) {
+    return squared_dist_lanes(u, v, n);
+}
+
+/*
+ * The panel kernels compute the scores norms[l] - 2 x[p].c[l] of GEMM_PANEL_ROWS points x and the GEMM_PANEL
+ * centroids c of a panel packed by pack_centroids, into out[p * out_stride + l].
+ */
+
+double dot_product(const double *u, const double *v, int n) {
+    int i = 0;
+    double sum = 0;
+
+    for (; i < n; i++)
+        sum += u[i] * v[i];
+
+    return sum;
+}
+
+static void score_panel_scalar(const double *const *x, const double *panel, const double *norms, int n,
+                               double *out, int out_stride) {
+    double acc[GEMM_PANEL_ROWS][GEMM_PANEL];
+    double value;
+    int i, p, l;
+
+    memset(acc, 0, sizeof(acc));
+    for (i = 0; i < n; i++) {
+        for (p = 0; p < GEMM_PANEL_ROWS; p++) {
+            value = x[p][i];
+            for (l = 0; l < GEMM_PANEL; l++)
+                acc[p][l] += value * panel[(size_t)i * GEMM_PANEL + l];
+        }
+    }
+
+    for (p = 0; p < GEMM_PANEL_ROWS; p++)
+        for (l = 0; l < GEMM_PANEL; l++)
+            out[(size_t)p * out_stride + l] = norms[l] - 2 * acc[p][l];
+}
+
+/*
+ * The float32 kernels compute the same distance between float32 points and the float32 copy of the centroids.
+ * They sum in float32 (twice the lanes of float64), which keeps about 7 significant digits of the distance.
+ */
+
+double squared_dist_f32_scalar(const float *u, const float *v, int n) {
+    int i = 0;
+    float diff, sum = 0;
+
+    for (; i < n; i++) {
+        diff = u[i] - v[i];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+#if KMEANS_X86_KERNELS
+
+static double squared_dist_sse2(const double *u, const double *v, int n) {
+    __m128d acc[4], diff;
+    double lanes[2];
+    int i = 0, j;
+
+    for (j = 0; j < 4; j++)
+        acc[j] = _mm_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+        for (j = 0; j < 4; j++) {
+            diff = _mm_sub_pd(_mm_loadu_pd(u + i + 2 * j), _mm_loadu_pd(v + i + 2 * j));
+            acc[j] = _mm_add_pd(acc[j], _mm_mul_pd(diff, diff));
+        }
+    }
+    for (j = 0; i + 2 <= n; i += 2, j++) {
+        diff = _mm_sub_pd(_mm_loadu_pd(u + i), _mm_loadu_pd(v + i));
+        acc[j] = _mm_add_pd(acc[j], _mm_mul_pd(diff, diff));
+    }
+    if (i < n) {
+        /* The last entry, in the low lane of its pair */
+        diff = _mm_sub_sd(_mm_load_sd(u + i), _mm_load_sd(v + i));
+        acc[j] = _mm_add_pd(acc[j], _mm_mul_pd(diff, diff));
+    }
+
+    acc[0] = _mm_add_pd(_mm_add_pd(acc[0], acc[2]), _mm_add_pd(acc[1], acc[3]));
+    _mm_storeu_pd(lanes, acc[0]);
+    return lanes[0] + lanes[1];
+}
+
+__attribute__((target("avx2")))
+static double squared_dist_avx2(const double *u, const double *v, int n) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd(), diff0, diff1;
+    __m256i mask;
+    __m128d half;
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        diff0 = _mm256_sub_pd(_mm256_loadu_pd(u + i), _mm256_loadu_pd(v + i));
+        diff1 = _mm256_sub_pd(_mm256_loadu_pd(u + i + 4), _mm256_loadu_pd(v + i + 4));
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(diff0, diff0));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(diff1, diff1));
+    }
+    if (i < n) {
+        /* The last partial block of 8, with the lanes past n masked out of the loads */
+        mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - i), _mm256_setr_epi64x(0, 1, 2, 3));
+        diff0 = _mm256_sub_pd(_mm256_maskload_pd(u + i, mask), _mm256_maskload_pd(v + i, mask));
+        mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n - i), _mm256_setr_epi64x(4, 5, 6, 7));
+        diff1 = _mm256_sub_pd(_mm256_maskload_pd(u + i + 4, mask), _mm256_maskload_pd(v + i + 4, mask));
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(diff0, diff0));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(diff1, diff1));
+    }
+
+    acc0 = _mm256_add_pd(acc0, acc1);
+    half = _mm_add_pd(_mm256_castpd256_pd128(acc0), _mm256_extractf128_pd(acc0, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+__attribute__((target("avx512f")))
+static double squared_dist_avx512(const double *u, const double *v, int n) {
+    __m512d acc = _mm512_setzero_pd(), diff;
+    __m256d quarter;
+    __m128d half;
+    __mmask8 mask;
+    int i = 0;
+
+    for (; i < n; i += 8) {
+        /* Full or partial blocks of 8, with the lanes past n masked out of the loads */
+        mask = (n - i >= 8) ? (__mmask8)0xFF : (__mmask8)((1u << (n - i)) - 1);
+        diff = _mm512_sub_pd(_mm512_maskz_loadu_pd(mask, u + i), _mm512_maskz_loadu_pd(mask, v + i));
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(diff, diff));
+    }
+
+    quarter = _mm256_add_pd(_mm512_castpd512_pd256(acc), _mm512_extractf64x4_pd(acc, 1));
+    half = _mm_add_pd(_mm256_castpd256_pd128(quarter), _mm256_extractf128_pd(quarter, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+/* 4 points x 8 centroids held in 8 registers; every dimension costs 2 loads, 4 broadcasts and 8 FMAs. */
+__attribute__((target("avx2,fma")))
+static void score_panel_avx2(const double *const *x, const double *panel, const double *norms, int n,
+                             double *out, int out_stride) {
+    __m256d acc00 = _mm256_setzero_pd(), acc01 = _mm256_setzero_pd(), acc10 = _mm256_setzero_pd();
+    __m256d acc11 = _mm256_setzero_pd(), acc20 = _mm256_setzero_pd(), acc21 = _mm256_setzero_pd();
+    __m256d acc30 = _mm256_setzero_pd(), acc31 = _mm256_setzero_pd();
+    __m256d c0, c1, value, minus_two = _mm256_set1_pd(-2);
+    int i = 0;
+
+    for (; i < n; i++, panel += GEMM_PANEL) {
+        c0 = _mm256_loadu_pd(panel);
+        c1 = _mm256_loadu_pd(panel + 4);
+        value = _mm256_broadcast_sd(x[0] + i);
+        acc00 = _mm256_fmadd_pd(value, c0, acc00);
+        acc01 = _mm256_fmadd_pd(value, c1, acc01);
+        value = _mm256_broadcast_sd(x[1] + i);
+        acc10 = _mm256_fmadd_pd(value, c0, acc10);
+        acc11 = _mm256_fmadd_pd(value, c1, acc11);
+        value = _mm256_broadcast_sd(x[2] + i);
+        acc20 = _mm256_fmadd_pd(value, c0, acc20);
+        acc21 = _mm256_fmadd_pd(value, c1, acc21);
+        value = _mm256_broadcast_sd(x[3] + i);
+        acc30 = _mm256_fmadd_pd(value, c0, acc30);
+        acc31 = _mm256_fmadd_pd(value, c1, acc31);
+    }
+
+    c0 = _mm256_loadu_pd(norms);
+    c1 = _mm256_loadu_pd(norms + 4);
+    _mm256_storeu_pd(out, _mm256_fmadd_pd(minus_two, acc00, c0));
+    _mm256_storeu_pd(out + 4, _mm256_fmadd_pd(minus_two, acc01, c1));
+    out += out_stride;
+    _mm256_storeu_pd(out, _mm256_fmadd_pd(minus_two, acc10, c0));
+    _mm256_storeu_pd(out + 4, _mm256_fmadd_pd(minus_two, acc11, c1));
+    out += out_stride;
+    _mm256_storeu_pd(out, _mm256_fmadd_pd(minus_two, acc20, c0));
+    _mm256_storeu_pd(out + 4, _mm256_fmadd_pd(minus_two, acc21, c1));
+    out += out_stride;
+    _mm256_storeu_pd(out, _mm256_fmadd_pd(minus_two, acc30, c0));
+    _mm256_storeu_pd(out + 4, _mm256_fmadd_pd(minus_two, acc31, c1));
+}
+
+static double squared_dist_f32_sse2(const float *u, const float *v, int n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(), diff0, diff1;
+    float lanes[4], sum;
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        diff0 = _mm_sub_ps(_mm_loadu_ps(u + i), _mm_loadu_ps(v + i));
+        diff1 = _mm_sub_ps(_mm_loadu_ps(u + i + 4), _mm_loadu_ps(v + i + 4));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(diff0, diff0));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(diff1, diff1));
+    }
+    if (i + 4 <= n) {
+        diff0 = _mm_sub_ps(_mm_loadu_ps(u + i), _mm_loadu_ps(v + i));
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(diff0, diff0));
+        i += 4;
+    }
+
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < n; i++)
+        sum += (u[i] - v[i]) * (u[i] - v[i]);
+
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double squared_dist_f32_avx2(const float *u, const float *v, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(), diff0, diff1;
+    __m128 half;
+    float sum;
+    int i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        diff0 = _mm256_sub_ps(_mm256_loadu_ps(u + i), _mm256_loadu_ps(v + i));
+        diff1 = _mm256_sub_ps(_mm256_loadu_ps(u + i + 8), _mm256_loadu_ps(v + i + 8));
+        acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+        acc1 = _mm256_fmadd_ps(diff1, diff1, acc1);
+    }
+    if (i + 8 <= n) {
+        diff0 = _mm256_sub_ps(_mm256_loadu_ps(u + i), _mm256_loadu_ps(v + i));
+        acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+        i += 8;
+    }
+
+    acc0 = _mm256_add_ps(acc0, acc1);
+    half = _mm_add_ps(_mm256_castps256_ps128(acc0), _mm256_extractf128_ps(acc0, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    sum = _mm_cvtss_f32(half);
+    for (; i < n; i++)
+        sum += (u[i] - v[i]) * (u[i] - v[i]);
+
+    return sum;
+}
+
+__attribute__((target("avx512f")))
+static double squared_dist_f32_avx512(const float *u, const float *v, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(), diff0, diff1;
+    __mmask16 mask;
+    int i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        diff0 = _mm512_sub_ps(_mm512_loadu_ps(u + i), _mm512_loadu_ps(v + i));
+        diff1 = _mm512_sub_ps(_mm512_loadu_ps(u + i + 16), _mm512_loadu_ps(v + i + 16));
+        acc0 = _mm512_fmadd_ps(diff0, diff0, acc0);
+        acc1 = _mm512_fmadd_ps(diff1, diff1, acc1);
+    }
+    for (; i < n; i += 16) {
+        /* Full or partial blocks of 16, with the lanes past n masked out of the loads */
+        mask = (n - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        diff0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, u + i), _mm512_maskz_loadu_ps(mask, v + i));
+        acc0 = _mm512_fmadd_ps(diff0, diff0, acc0);
+    }
+
+    return _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+}
+
+#endif
+
+/*
+ * The MYKMEANSSP_SIMD environment variable ("scalar", "sse2", "avx2" or "avx512") caps the selection,
+ * which is how the vector kernels are compared with the scalar reference.
+ */
+void init_distance_kernels() {
+    const char *cap = getenv("MYKMEANSSP_SIMD");
+
+    squared_dist_kernel = squared_dist_scalar;
+    squared_dist_f32_kernel = squared_dist_f32_scalar;
+    score_panel_kernel = score_panel_scalar;
+    distance_kernel_name = "scalar";
+    if (cap != NULL && strcmp(cap, "scalar") == 0)
+        return;
+
+#if KMEANS_X86_KERNELS
+    __builtin_cpu_init();
+    squared_dist_kernel = squared_dist_sse2;
+    squared_dist_f32_kernel = squared_dist_f32_sse2;
+    distance_kernel_name = "sse2";
+    if (cap != NULL && strcmp(cap, "sse2") == 0)
+        return;
+
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        squared_dist_kernel = squared_dist_avx2;
+        squared_dist_f32_kernel = squared_dist_f32_avx2;
+        score_panel_kernel = score_panel_avx2;
+        distance_kernel_name = "avx2";
+    }
+    if (cap != NULL && strcmp(cap, "avx2") == 0)
+        return;
+
+    if (__builtin_cpu_supports("avx512f")) {
+        squared_dist_kernel = squared_dist_avx512;
+        squared_dist_f32_kernel = squared_dist_f32_avx512;
+        distance_kernel_name = "avx512";
+    }
+#endif
+}
+
+/* The squared distance between two n-dimensional points. */
+double squared_dist(const double *u, const double *v, int n) {
+    return squared_dist_kernel(u, v, n);
+}
+
+/** Worker pool **/
+
+/*
+ * The calling thread acts as worker 0, so a pool of one thread runs every task inline and starts no threads.
+ * Worker t owns the data points [begin, end) of a static, contiguous partition of the N points, and the tasks
+ * read the shape of the run from the context. A context without points (N = 0), as the text parser's, does not
+ * cap the number of threads.
+ */
+void init_worker_pool(struct worker_pool *pool, const struct context *ctx, struct arena *arena, int n_threads) {
+    struct worker *worker;
+    int t;
+
+    if (n_threads <= 0)
+        n_threads = available_cpus();
+    if (ctx->N > 0 && n_threads > ctx->N)
+        n_threads = ctx->N;
+    if (n_threads < 1)
+        n_threads = 1;
+
+    pool->ctx = ctx;
+    pool->n_threads = n_threads;
+    pool->weighted = 0;
+    pool->workers = arena_alloc(arena, (size_t)n_threads * sizeof(struct worker));
+    pool->task = NULL;
+    pool->arg = NULL;
+    pool->generation = 0;
+    pool->pending = 0;
+    pool->stop = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->work_done, NULL);
+
+    for (t = 0; t < n_threads; t++) {
+        worker = &pool->workers[t];
+        worker->pool = pool;
+        worker->id = t;
+        worker->begin = (int)((long long)ctx->N * t / n_threads);
+        worker->end = (int)((long long)ctx->N * (t + 1) / n_threads);
+        /* Separate arena chunks keep the partial results of different workers on different cache lines */
+        worker->sums = alloc_matrix(arena, ctx->K, ctx->d);
+        worker->counts = arena_alloc(arena, (size_t)ctx->K * sizeof(int));
+        worker->weights = arena_alloc(arena, (size_t)ctx->K * sizeof(double));
+        worker->distance_evaluations = 0;
+        worker->scratch = arena_alloc(arena, (size_t)ctx->d * sizeof(double));
+        worker->tile = NULL;
+        worker->block_sum = 0;
+        worker->block_count = 0;
+        worker->reassigned = 0;
+    }
+
+    for (t = 1; t < n_threads; t++) {
+        if (pthread_create(&pool->workers[t].thread, NULL, worker_main, &pool->workers[t]) != 0) {
+            /* Could not start more threads: give the remaining points to the threads that did start */
+            pool->n_threads = t;
+            pool->workers[t - 1].end = ctx->N;
+            break;
+        }
+    }
+}
+
+/* Splits the items [0, n) between the workers again, for the tasks that do not work on the N data points. */
+void partition_worker_pool(struct worker_pool *pool, int n) {
+    int t = 0;
+
+    for (; t < pool->n_threads; t++) {
+        pool->workers[t].begin = (int)((long long)n * t / pool->n_threads);
+        pool->workers[t].end = (int)((long long)n * (t + 1) / pool->n_threads);
+    }
+}
+
+/* Runs task on every worker and returns once all of them are done. */
+void run_worker_pool(struct worker_pool *pool, void (*task)(struct worker *, void *), void *arg) {
+    if (pool->n_threads == 1) {
+        task(&pool->workers[0], arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->pending = pool->n_threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    task(&pool->workers[0], arg);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->work_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void destroy_worker_pool(struct worker_pool *pool) {
+    int t;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (t = 1; t < pool->n_threads; t++)
+        pthread_join(pool->workers[t].thread, NULL);
+
+    pthread_cond_destroy(&pool->work_done);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+static void* worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct worker_pool *pool = worker->pool;
+    unsigned long seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->task(worker, pool->arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_signal(&pool->work_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+int available_cpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int)n : 1;
+}
+
+/** Memory management **/
+
+void init_arena(struct arena *arena) {
+    arena->blocks = NULL;
+    arena->allocations = 0;
+    arena->allocated_bytes = 0;
+}
+
+/* Returns a zeroed, ARENA_ALIGNMENT aligned chunk of size bytes, which lives until free_arena is called. */
+void* arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->blocks;
+    size_t capacity;
+    void *chunk;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    arena->allocations++;
+    arena->allocated_bytes += (long long)size;
+
+    if (block == NULL || block->capacity - block->used < size) {
+        capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        /* The block header and its data share one allocation, over-allocated so the first chunk can be aligned */
+        block = calloc(sizeof(struct arena_block) + capacity + ARENA_ALIGNMENT, 1);
+        if (block == NULL) {   /* Memory allocation failed */
+            mem_error();
+        }
+        block->data = (char *)(block + 1);
+        block->capacity = capacity + ARENA_ALIGNMENT;
+        block->used = ARENA_ALIGNMENT - (size_t)((uintptr_t)block->data % ARENA_ALIGNMENT);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+
+    chunk = block->data + block->used;
+    block->used += size;
+
+    return chunk;
+}
+
+void free_arena(struct arena *arena) {
+    struct arena_block *block = arena->blocks, *next;
+
+    while (block != NULL) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+struct matrix alloc_matrix(struct arena *arena, int rows, int cols) {
+    struct matrix m;
+
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = (cols + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+    m.values = arena_alloc(arena, (size_t)rows * (size_t)m.stride * sizeof(double));
+
+    return m;
+}
+
+/* The float32 rows are padded to the same 32 bytes. */
+struct matrix_f alloc_matrix_f(struct arena *arena, int rows, int cols) {
+    struct matrix_f m;
+
+    m.rows = rows;
+    m.cols = cols;
+    m.stride = (cols + 2 * ROW_ALIGNMENT - 1) / (2 * ROW_ALIGNMENT) * (2 * ROW_ALIGNMENT);
+    m.values = arena_alloc(arena, (size_t)rows * (size_t)m.stride * sizeof(float));
+
+    return m;
+}
+
+void mem_error(){
+    printf("Failed to allocate memory\n");
+
+    exit(1);
+}
+
+
+/**  HW2 CODE  **/
+
+/*
+ * A matrix received from Python.
+ * When the object exports a C-contiguous float64 buffer, m.values points straight into it and the view is held
+ * until release_py_matrix; otherwise the values were copied into the arena.
+ * A float32 buffer converted with keep_float32 is held the same way by m32 instead, and m only has its shape.
+ */
+struct py_matrix {
+    struct matrix m;
+    struct matrix_f m32;
+    char dtype;     /* 'f' when the values are in m32, 'd' when they are in m. */
+    Py_buffer view;
+    int has_view;   /* view is held and must be released. */
+    int is_buffer;  /* obj exported a buffer (as opposed to a list of lists). */
+};
+
+/*
+ * A CSR matrix received from Python. Its indices and values point straight into the caller's buffers when they are
+ * int32 and float64, and the views are held until release_py_csr; otherwise they were copied into the arena, like
+ * indptr always is.
+ */
+struct py_csr {
+    struct csr_matrix m;
+    Py_buffer views[3];  /* indptr, indices, data */
+    int n_views;         /* The first n_views views are held. */
+};
+
+static PyObject* k_means_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "centroids", "iter", "eps", "K", "n_threads", "algorithm", "info",
+                             "batch_size", "max_no_improvement", "seed", "trace", "callback", "callback_every",
+                             "weights", NULL};
+
+    PyObject *list_of_lists;
+    PyObject *list_of_lists2;
+    PyObject *python_centroids;
+    PyObject *info = NULL;
+    PyObject *callback = Py_None;
+    PyObject *weights_object = Py_None;
+
+    struct context ctx;
+    struct arena arena;
+    struct matrix centroids;
+    struct py_matrix vectors, initial_centroids;
+    Py_buffer weights;
+    struct run_stats stats;
+    int n_threads = 1;
+    const char *algorithm_name = "lloyd";
+    int algorithm;
+    int batch_size = 0;
+    int max_no_improvement = 10;
+    unsigned long seed = 0;
+    int keep_trace = 0, callback_every = 1;
+    struct run_trace trace;
+    struct python_trace py_trace;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OOidi|isO!iikpOiO", kwlist,
+                                    &list_of_lists, &list_of_lists2, &ctx.iter, &ctx.eps, &ctx.K, &n_threads,
+                                    &algorithm_name, &PyDict_Type, &info,
+                                    &batch_size, &max_no_improvement, &seed,
+                                    &keep_trace, &callback, &callback_every, &weights_object)) {
+        return NULL; /* In the CPython API, a NULL value is never valid for a
+                        PyObject* so it is used to signal that an error has occurred. */
+    }
+
+    algorithm = parse_algorithm(algorithm_name);
+    if (algorithm < 0 || check_n_threads(n_threads) < 0)
+        return NULL;
+    if (keep_trace && info == NULL) {
+        PyErr_SetString(PyExc_ValueError, "trace=True needs an info dict to receive the trace");
+        return NULL;
+    }
+    if (callback != Py_None && !PyCallable_Check(callback)) {
+        PyErr_SetString(PyExc_TypeError, "callback must be callable");
+        return NULL;
+    }
+    if ((keep_trace || callback != Py_None) && batch_size > 0) {
+        PyErr_SetString(PyExc_ValueError, "trace and callback only apply to full-batch k-means (batch_size=0)");
+        return NULL;
+    }
+    if (weights_object != Py_None && (algorithm != ALGORITHM_LLOYD || batch_size > 0)) {
+        PyErr_SetString(PyExc_ValueError, "weights only apply to full-batch 'lloyd'");
+        return NULL;
+    }
+
+    /* Sparse points run Lloyd on their own kernels */
+    if (is_csr_object(list_of_lists)) {
+        if (algorithm != ALGORITHM_LLOYD || batch_size > 0 || keep_trace || callback != Py_None
+                || weights_object != Py_None) {
+            PyErr_SetString(PyExc_ValueError, "sparse data only runs full-batch 'lloyd', without trace, callback or "
+                                              "weights");
+            return NULL;
+        }
+        return fit_sparse(&ctx, list_of_lists, list_of_lists2, n_threads, info);
+    }
+
+    /* Mini-batch k-means over batches that are streamed in rather than held in one matrix */
+    if (batch_size > 0 && !PyObject_CheckBuffer(list_of_lists) && !PyList_Check(list_of_lists))
+        return fit_minibatch_stream(&ctx, list_of_lists, list_of_lists2, batch_size, max_no_improvement, n_threads,
+                                    info);
+
+    init_arena(&arena);
+
+    /* float32 data points stay float32 for unweighted Lloyd */
+    if (convert_from_python_to_c(list_of_lists, &arena, &vectors,
+                                 batch_size <= 0 && algorithm == ALGORITHM_LLOYD && weights_object == Py_None) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+    if (convert_from_python_to_c(list_of_lists2, &arena, &initial_centroids, 0) < 0) {
+        release_py_matrix(&vectors);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx.N = vectors.m.rows;
+    ctx.d = vectors.m.cols;
+
+    weights.buf = NULL;
+    if (weights_object != Py_None && get_weights_buffer(weights_object, &weights, ctx.N) < 0) {
+        release_py_matrix(&initial_centroids);
+        release_py_matrix(&vectors);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    if (ctx.K <= 0 || initial_centroids.m.rows < ctx.K || initial_centroids.m.cols != ctx.d) {
+        PyErr_SetString(PyExc_ValueError, "centroids must have at least K rows and the same dimension as the data");
+        python_centroids = NULL;
+    }
+    else {
+        stats.trace = NULL;
+        if (keep_trace || callback != Py_None) {
+            py_trace.callback = callback != Py_None ? callback : NULL;
+            py_trace.failed = 0;
+            init_run_trace(&trace, callback_every, py_trace.callback != NULL ? call_python_trace : NULL, &py_trace);
+            stats.trace = &trace;
+        }
+
+        /* The run only touches C memory, so other Python threads may run meanwhile. The callback takes the GIL
+           back through the saved thread state. */
+        py_trace.thread_state = PyEval_SaveThread();
+        if (batch_size > 0)
+            centroids = minibatch_k_means(&ctx, &arena, &vectors.m, &initial_centroids.m, batch_size,
+                                          max_no_improvement, seed, n_threads, &stats);
+        else
+            centroids = k_means(&ctx, &arena, vectors.dtype == 'd' ? &vectors.m : NULL,
+                                vectors.dtype == 'f' ? &vectors.m32 : NULL, weights.buf, &initial_centroids.m,
+                                n_threads, algorithm, NULL, &stats, NULL);
+        PyEval_RestoreThread(py_trace.thread_state);
+
+        /* Answer in the same kind the caller used: a buffer for buffers, lists for lists */
+        if (stats.trace != NULL && py_trace.failed)
+            python_centroids = NULL;
+        else if (vectors.is_buffer)
+            python_centroids = convert_from_c_to_buffer(&centroids);
+        else
+            python_centroids = convert_from_c_to_python(&centroids);
+
+        if (python_centroids != NULL && info != NULL && fill_info(info, &stats) < 0)
+            Py_CLEAR(python_centroids);
+        if (python_centroids != NULL && keep_trace && fill_trace(info, &trace) < 0)
+            Py_CLEAR(python_centroids);
+        if (stats.trace != NULL)
+            free_run_trace(&trace);
+    }
+
+    if (weights.buf != NULL)
+        PyBuffer_Release(&weights);
+    release_py_matrix(&initial_centroids);
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+
+    return python_centroids;
+}
+
+/* fit over CSR points. Returns the centroids as a buffer. */
+static PyObject* fit_sparse(struct context *ctx, PyObject *data, PyObject *centroids_object, int n_threads,
+                            PyObject *info)
+{
+    PyObject *python_centroids = NULL;
+    struct arena arena;
+    struct py_csr points;
+    struct py_matrix initial_centroids;
+    struct matrix centroids;
+    struct run_stats stats;
+
+    init_arena(&arena);
+    if (convert_csr_from_python(data, &arena, &points) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+    if (convert_from_python_to_c(centroids_object, &arena, &initial_centroids, 0) < 0) {
+        release_py_csr(&points);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx->N = points.m.rows;
+    ctx->d = points.m.cols;
+
+    if (ctx->K <= 0 || initial_centroids.m.rows < ctx->K || initial_centroids.m.cols != ctx->d) {
+        PyErr_SetString(PyExc_ValueError, "centroids must have at least K rows and the same dimension as the data");
+    }
+    else {
+        stats.trace = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        centroids = sparse_k_means(ctx, &arena, &points.m, &initial_centroids.m, n_threads, &stats, NULL);
+        Py_END_ALLOW_THREADS
+
+        python_centroids = convert_from_c_to_buffer(&centroids);
+        if (python_centroids != NULL && info != NULL && fill_info(info, &stats) < 0)
+            Py_CLEAR(python_centroids);
+    }
+
+    release_py_matrix(&initial_centroids);
+    release_py_csr(&points);
+    free_arena(&arena);
+
+    return python_centroids;
+}
+
+/*
+ * Mini-batch k-means over the batches yielded by an iterator. Every item is a two-dimensional buffer or list of
+ * lists with d columns, and is processed in slices of at most batch_size rows, so only one item is ever resident.
+ * Returns the centroids as a buffer.
+ */
+static PyObject* fit_minibatch_stream(struct context *ctx, PyObject *batches, PyObject *centroids_object,
+                                      int batch_size, int max_no_improvement, int n_threads, PyObject *info)
+{
+    PyObject *iterator, *item;
+    PyObject *python_centroids = NULL;
+    struct arena arena, batch_arena;
+    struct py_matrix initial_centroids, batch;
+    struct matrix slice;
+    struct worker_pool pool;
+    struct minibatch mb;
+    struct run_stats stats;
+    int row, converged = 0, failed = 0;
+    long long evaluations = 0, batch_allocations = 0, batch_bytes = 0;
+
+    iterator = PyObject_GetIter(batches);
+    if (iterator == NULL)
+        return NULL;
+
+    init_arena(&arena);
+
+    if (convert_from_python_to_c(centroids_object, &arena, &initial_centroids, 0) < 0) {
+        Py_DECREF(iterator);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx->d = initial_centroids.m.cols;
+    if (ctx->K <= 0 || initial_centroids.m.rows < ctx->K) {
+        PyErr_SetString(PyExc_ValueError, "centroids must have at least K rows");
+        release_py_matrix(&initial_centroids);
+        Py_DECREF(iterator);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx->N = batch_size;
+    init_worker_pool(&pool, ctx, &arena, n_threads);
+    init_minibatch(ctx, &mb, &arena, &initial_centroids.m, batch_size, max_no_improvement, MINIBATCH_STREAM_ALPHA);
+    release_py_matrix(&initial_centroids);
+
+    while (!converged && !failed && mb.steps < ctx->iter && (item = PyIter_Next(iterator)) != NULL) {
+        init_arena(&batch_arena);
+
+        if (convert_from_python_to_c(item, &batch_arena, &batch, 0) < 0) {
+            failed = 1;
+        }
+        else {
+            if (batch.m.cols != ctx->d) {
+                PyErr_SetString(PyExc_ValueError, "every batch must have the same dimension as the centroids");
+                failed = 1;
+            }
+
+            for (row = 0; !failed && !converged && row < batch.m.rows && mb.steps < ctx->iter; row += batch_size) {
+                slice = batch.m;
+                slice.values = ROW(&batch.m, row);
+                slice.rows = batch.m.rows - row < batch_size ? batch.m.rows - row : batch_size;
+
+                Py_BEGIN_ALLOW_THREADS
+                converged = minibatch_step(&pool, &mb, &slice);
+                Py_END_ALLOW_THREADS
+                evaluations += (long long)slice.rows * ctx->K;
+            }
+
+            release_py_matrix(&batch);
+        }
+
+        batch_allocations += batch_arena.allocations;
+        batch_bytes += batch_arena.allocated_bytes;
+        free_arena(&batch_arena);
+        Py_DECREF(item);
+    }
+    Py_DECREF(iterator);
+
+    destroy_worker_pool(&pool);
+
+    if (!failed && !PyErr_Occurred()) {
+        python_centroids = convert_from_c_to_buffer(&mb.centroids);
+
+        stats.iterations = mb.steps;
+        stats.distance_evaluations = evaluations;
+        stats.skipped_distance_evaluations = 0;
+        stats.allocations = arena.allocations + batch_allocations;
+        stats.allocated_bytes = arena.allocated_bytes + batch_bytes;
+        if (python_centroids != NULL && info != NULL && fill_info(info, &stats) < 0)
+            Py_CLEAR(python_centroids);
+    }
+
+    free_arena(&arena);
+
+    return python_centroids;
+}
+
+/*
+ * init_pp(data, K, seed, n_threads=1) -> list of the K indices of the data points chosen as initial centroids.
+ */
+static PyObject* init_pp_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "K", "seed", "n_threads", NULL};
+
+    PyObject *data;
+    struct context ctx;
+    unsigned long seed;
+    int n_threads = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oik|i", kwlist, &data, &ctx.K, &seed, &n_threads) ||
+        check_n_threads(n_threads) < 0)
+        return NULL;
+
+    return run_seeding(&ctx, data, seed, n_threads, 0, 0, 0);
+}
+
+/*
+ * init_parallel(data, K, seed, rounds=5, oversampling=0, n_threads=1) -> list of the K indices of the data
+ * points chosen as initial centroids by k-means||.
+ */
+static PyObject* init_parallel_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "K", "seed", "rounds", "oversampling", "n_threads", NULL};
+
+    PyObject *data;
+    struct context ctx;
+    unsigned long seed;
+    int rounds = 5;
+    double oversampling = 0;
+    int n_threads = 1;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oik|idi", kwlist,
+                                     &data, &ctx.K, &seed, &rounds, &oversampling, &n_threads) ||
+        check_n_threads(n_threads) < 0)
+        return NULL;
+
+    if (rounds < 0) {
+        PyErr_SetString(PyExc_ValueError, "rounds must be non-negative");
+        return NULL;
+    }
+
+    return run_seeding(&ctx, data, seed, n_threads, 1, rounds, oversampling);
+}
+
+/*
+ * save_points(path, data) -> None. Writes data as a point file that fit_file can cluster, in float32 when data is a
+ * float32 buffer and in float64 otherwise.
+ */
+static PyObject* save_points_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "data", NULL};
+
+    PyObject *path_object, *data;
+    struct arena arena;
+    struct py_matrix vectors;
+    const char *path;
+    int status;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O", kwlist, PyUnicode_FSConverter, &path_object, &data))
+        return NULL;
+    path = PyBytes_AS_STRING(path_object);
+
+    init_arena(&arena);
+
+    /* float32 data is saved as a float32 point file */
+    if (convert_from_python_to_c(data, &arena, &vectors, 1) < 0) {
+        Py_DECREF(path_object);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = write_point_file(path, &vectors.m, vectors.dtype == 'f' ? &vectors.m32 : NULL);
+    Py_END_ALLOW_THREADS
+
+    if (status < 0)
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path_object));
+
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+    Py_DECREF(path_object);
+
+    if (status < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/*
+ * fit_file(path, centroids, iter, eps, K, n_threads=1, algorithm='lloyd', info=None) -> the centroids as a buffer.
+ * Runs fit over the points of a point file, which stay memory mapped instead of being loaded.
+ */
+static PyObject* fit_file_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path", "centroids", "iter", "eps", "K", "n_threads", "algorithm", "info", NULL};
+
+    PyObject *path_object, *centroids_object;
+    PyObject *python_centroids = NULL;
+    PyObject *info = NULL;
+    struct context ctx;
+    struct arena arena;
+    struct point_file file;
+    struct py_matrix initial_centroids;
+    struct matrix centroids;
+    struct run_stats stats;
+    const char *error;
+    int n_threads = 1;
+    const char *algorithm_name = "lloyd";
+    int algorithm;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&Oidi|isO!", kwlist,
+                                     PyUnicode_FSConverter, &path_object, &centroids_object, &ctx.iter, &ctx.eps,
+                                     &ctx.K, &n_threads, &algorithm_name, &PyDict_Type, &info))
+        return NULL;
+
+    algorithm = parse_algorithm(algorithm_name);
+    if (algorithm < 0 || check_n_threads(n_threads) < 0) {
+        Py_DECREF(path_object);
+        return NULL;
+    }
+
+    if (open_point_file(PyBytes_AS_STRING(path_object), &file, &error) < 0) {
+        if (error == NULL)
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path_object));
+        else
+            PyErr_Format(PyExc_ValueError, "%s: %s", PyBytes_AS_STRING(path_object), error);
+        Py_DECREF(path_object);
+        return NULL;
+    }
+    Py_DECREF(path_object);
+
+    if (file.dtype == 'f' && algorithm != ALGORITHM_LLOYD) {
+        PyErr_SetString(PyExc_ValueError, "float32 point files only run with algorithm='lloyd'");
+        close_point_file(&file);
+        return NULL;
+    }
+
+    init_arena(&arena);
+
+    if (convert_from_python_to_c(centroids_object, &arena, &initial_centroids, 0) < 0) {
+        close_point_file(&file);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx.N = file.points.rows;
+    ctx.d = file.points.cols;
+
+    if (ctx.K <= 0 || initial_centroids.m.rows < ctx.K || initial_centroids.m.cols != ctx.d) {
+        PyErr_SetString(PyExc_ValueError, "centroids must have at least K rows and the same dimension as the data");
+    }
+    else {
+        stats.trace = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        centroids = k_means(&ctx, &arena, file.dtype == 'd' ? &file.points : NULL,
+                            file.dtype == 'f' ? &file.points32 : NULL, NULL, &initial_centroids.m, n_threads,
+                            algorithm, &file, &stats, NULL);
+        Py_END_ALLOW_THREADS
+
+        python_centroids = convert_from_c_to_buffer(&centroids);
+        if (python_centroids != NULL && info != NULL && fill_info(info, &stats) < 0)
+            Py_CLEAR(python_centroids);
+    }
+
+    release_py_matrix(&initial_centroids);
+    close_point_file(&file);
+    free_arena(&arena);
+
+    return python_centroids;
+}
+
+/*
+ * fit_many(data, configs, n_threads=0) -> a list with the result of every config. Every config is a dict of
+ * K, seed=0, iter=300, eps=0.001 and algorithm='lloyd', which runs init_pp(data, K, seed) and then fit.
+ */
+static PyObject* fit_many_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "configs", "n_threads", NULL};
+
+    PyObject *data, *configs, *sequence, *item;
+    PyObject *results = NULL;
+    struct arena arena;
+    struct py_matrix vectors;
+    struct batched_run *runs;
+    Py_ssize_t n_runs;
+    int n_threads = 0;
+    int i, failed = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|i", kwlist, &data, &configs, &n_threads) ||
+        check_n_threads(n_threads) < 0)
+        return NULL;
+
+    sequence = PySequence_Fast(configs, "configs must be a sequence of dicts");
+    if (sequence == NULL)
+        return NULL;
+    n_runs = PySequence_Fast_GET_SIZE(sequence);
+    if (n_runs > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "too many configs");
+        Py_DECREF(sequence);
+        return NULL;
+    }
+
+    init_arena(&arena);
+
+    if (convert_from_python_to_c(data, &arena, &vectors, 0) < 0) {
+        Py_DECREF(sequence);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    /* Every result is allocated here, so the runs themselves only touch their own arena */
+    runs = arena_alloc(&arena, (size_t)(n_runs > 0 ? n_runs : 1) * sizeof(struct batched_run));
+    for (i = 0; i < n_runs; i++) {
+        item = PySequence_Fast_GET_ITEM(sequence, i);
+        if (parse_batched_run(item, i, vectors.m.rows, &runs[i]) < 0) {
+            failed = 1;
+            break;
+        }
+        runs[i].indices = arena_alloc(&arena, (size_t)runs[i].K * sizeof(int));
+        runs[i].centroids = alloc_matrix(&arena, runs[i].K, vectors.m.cols);
+    }
+    Py_DECREF(sequence);
+
+    if (!failed && n_runs > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        run_batched(&arena, &vectors.m, runs, (int)n_runs, n_threads);
+        Py_END_ALLOW_THREADS
+    }
+
+    for (i = 0; !failed && i < n_runs; i++) {
+        if (runs[i].status < 0) {
+            PyErr_Format(PyExc_ValueError, "configs[%d]: the data has fewer than K distinct points", i);
+            failed = 1;
+        }
+    }
+
+    if (!failed)
+        results = PyList_New(n_runs);
+    for (i = 0; results != NULL && i < n_runs; i++) {
+        item = batched_run_to_python(&runs[i]);
+        if (item == NULL)
+            Py_CLEAR(results);
+        else
+            PyList_SET_ITEM(results, i, item);
+    }
+
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+
+    return results;
+}
+
+/* Returns 0 if every one of the n labels is a cluster in [0, K), or -1 with a ValueError set. */
+static int check_shard_labels(const int *labels, int n, int K) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (labels[i] < 0 || labels[i] >= K) {
+            PyErr_Format(PyExc_ValueError, "labels[%d] is %d, not a cluster in [0, %d); pass refresh=True to "
+                         "assign the shard from scratch", i, labels[i], K);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * shard_assign(data, centroids, labels, sums, counts, refresh) -> the number of reassigned points.
+ * One iteration of a shard of a sharded run: labels (N int32), sums (K x d float64) and counts (K int32) are the
+ * state of the shard, updated in place.
+ */
+static PyObject* shard_assign_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "centroids", "labels", "sums", "counts", "refresh", NULL};
+
+    PyObject *data, *centroids_object, *labels_object, *sums_object, *counts_object;
+    PyObject *result = NULL;
+    struct arena arena;
+    struct py_matrix points, centroids;
+    struct matrix sums;
+    Py_buffer labels_view, sums_view, counts_view;
+    int refresh, reassigned;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOOOp", kwlist, &data, &centroids_object, &labels_object,
+                                     &sums_object, &counts_object, &refresh))
+        return NULL;
+
+    init_arena(&arena);
+    if (convert_from_python_to_c(data, &arena, &points, 0) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+    if (convert_from_python_to_c(centroids_object, &arena, &centroids, 0) < 0) {
+        release_py_matrix(&points);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    if (centroids.m.cols != points.m.cols) {
+        PyErr_SetString(PyExc_ValueError, "the centroids must have the same dimension as the data");
+    }
+    else if (get_output_buffer(labels_object, &labels_view, 'i', points.m.rows, "labels") == 0) {
+        if (get_output_buffer(sums_object, &sums_view, 'd', (Py_ssize_t)centroids.m.rows * centroids.m.cols,
+                              "sums") == 0) {
+            if (get_output_buffer(counts_object, &counts_view, 'i', centroids.m.rows, "counts") == 0) {
+                sums.values = sums_view.buf;
+                sums.rows = centroids.m.rows;
+                sums.cols = centroids.m.cols;
+                sums.stride = sums.cols;
+
+                /* Without a refresh the old labels index sums and counts, so they must be clusters */
+                if (refresh || check_shard_labels(labels_view.buf, points.m.rows, centroids.m.rows) == 0) {
+                    Py_BEGIN_ALLOW_THREADS
+                    reassigned = assign_shard(&arena, &points.m, &centroids.m, labels_view.buf, &sums,
+                                              counts_view.buf, refresh);
+                    Py_END_ALLOW_THREADS
+
+                    result = PyLong_FromLong(reassigned);
+                }
+                PyBuffer_Release(&counts_view);
+            }
+            PyBuffer_Release(&sums_view);
+        }
+        PyBuffer_Release(&labels_view);
+    }
+
+    release_py_matrix(&centroids);
+    release_py_matrix(&points);
+    free_arena(&arena);
+
+    return result;
+}
+
+/*
+ * combine_shards(centroids, sums, counts, eps, iteration, reassigned) -> (converged, refresh).
+ * The coordinator's part of an iteration of a sharded run: sums (S x K x d float64) and counts (S x K int32) hold
+ * the state of every shard, and centroids (K x d float64) is updated in place. refresh tells the shards whether
+ * the next iteration sums every point again.
+ */
+static PyObject* combine_shards_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"centroids", "sums", "counts", "eps", "iteration", "reassigned", NULL};
+
+    PyObject *centroids_object, *sums_object, *counts_object;
+    PyObject *result = NULL;
+    Py_buffer centroids_view, sums_view, counts_view;
+    struct arena arena;
+    struct matrix centroids, *sums;
+    int **counts;
+    double eps;
+    int iteration, reassigned, n_shards, K, d, t, converged = 0, N = 0, k;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOOdii", kwlist, &centroids_object, &sums_object,
+                                     &counts_object, &eps, &iteration, &reassigned))
+        return NULL;
+
+    if (get_output_buffer(sums_object, &sums_view, 'd', 1, "sums") < 0)
+        return NULL;
+    if (sums_view.ndim != 3 || sums_view.shape[0] > INT_MAX || sums_view.shape[1] > INT_MAX
+            || sums_view.shape[2] > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "sums must be a three-dimensional buffer of S x K x d sums");
+        PyBuffer_Release(&sums_view);
+        return NULL;
+    }
+    n_shards = (int)sums_view.shape[0];
+    K = (int)sums_view.shape[1];
+    d = (int)sums_view.shape[2];
+
+    if (get_output_buffer(centroids_object, &centroids_view, 'd', (Py_ssize_t)K * d, "centroids") < 0) {
+        PyBuffer_Release(&sums_view);
+        return NULL;
+    }
+    if (get_output_buffer(counts_object, &counts_view, 'i', (Py_ssize_t)n_shards * K, "counts") < 0) {
+        PyBuffer_Release(&centroids_view);
+        PyBuffer_Release(&sums_view);
+        return NULL;
+    }
+
+    init_arena(&arena);
+    centroids.values = centroids_view.buf;
+    centroids.rows = K;
+    centroids.cols = d;
+    centroids.stride = d;
+    sums = arena_alloc(&arena, (size_t)(n_shards > 0 ? n_shards : 1) * sizeof(struct matrix));
+    counts = arena_alloc(&arena, (size_t)(n_shards > 0 ? n_shards : 1) * sizeof(int *));
+    for (t = 0; t < n_shards; t++) {
+        sums[t].values = (double *)sums_view.buf + (size_t)t * K * d;
+        sums[t].rows = K;
+        sums[t].cols = d;
+        sums[t].stride = d;
+        counts[t] = (int *)counts_view.buf + (size_t)t * K;
+        for (k = 0; k < K; k++)
+            N += counts[t][k];
+    }
+
+    if (n_shards > 0 && K > 0 && d > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        converged = combine_shards(&arena, &centroids, sums, counts, n_shards, eps, reassigned);
+        Py_END_ALLOW_THREADS
+    }
+    result = Py_BuildValue("(NN)", PyBool_FromLong(converged),
+                           PyBool_FromLong(refresh_sums_due(iteration + 1, reassigned, N)));
+
+    free_arena(&arena);
+    PyBuffer_Release(&counts_view);
+    PyBuffer_Release(&centroids_view);
+    PyBuffer_Release(&sums_view);
+
+    return result;
+}
+
+/*
+ * coreset(data, K, m, seed=0, n_threads=1) -> (indices, weights). The points of a coreset of about m of the data
+ * points for K clusters, as int32 indices into data, and their float64 weights.
+ */
+static PyObject* coreset_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "K", "m", "seed", "n_threads", NULL};
+
+    PyObject *data, *python_indices, *python_weights, *result = NULL;
+    struct context ctx;
+    struct arena arena;
+    struct py_matrix vectors;
+    unsigned long seed = 0;
+    int m, n, n_threads = 1;
+    int *indices;
+    double *weights;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii|ki", kwlist, &data, &ctx.K, &m, &seed, &n_threads) ||
+        check_n_threads(n_threads) < 0)
+        return NULL;
+    if (seed > 0xFFFFFFFFUL) {
+        PyErr_SetString(PyExc_ValueError, "seed must be between 0 and 2**32 - 1");
+        return NULL;
+    }
+    if (m <= 0) {
+        PyErr_SetString(PyExc_ValueError, "m must be positive");
+        return NULL;
+    }
+
+    init_arena(&arena);
+    if (convert_from_python_to_c(data, &arena, &vectors, 0) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx.N = vectors.m.rows;
+    ctx.d = vectors.m.cols;
+    ctx.iter = 0;
+    ctx.eps = 0;
+
+    if (ctx.K <= 0 || ctx.K > ctx.N) {
+        PyErr_SetString(PyExc_ValueError, "K must be between 1 and the number of data points");
+    }
+    else {
+        Py_BEGIN_ALLOW_THREADS
+        n = build_coreset(&ctx, &arena, &vectors.m, m, seed, n_threads, &indices, &weights);
+        Py_END_ALLOW_THREADS
+
+        python_indices = convert_array_to_buffer(indices, n, sizeof(int), "i");
+        python_weights = python_indices != NULL ? convert_array_to_buffer(weights, n, sizeof(double), "d") : NULL;
+        if (python_weights != NULL)
+            result = PyTuple_Pack(2, python_indices, python_weights);
+        Py_XDECREF(python_indices);
+        Py_XDECREF(python_weights);
+    }
+
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+
+    return result;
+}
+
+/*
+ * fit_coreset(data, K, m, iter=300, eps=0.001, seed=0, n_threads=1, labels=None, info=None) -> the K final
+ * centroids of weighted Lloyd over a coreset of about m of the data points, as a buffer.
+ */
+static PyObject* fit_coreset_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "K", "m", "iter", "eps", "seed", "n_threads", "labels", "info", NULL};
+
+    PyObject *data, *labels_object = Py_None, *info = NULL, *python_centroids = NULL, *value;
+    struct context ctx;
+    struct arena arena;
+    struct py_matrix vectors;
+    struct matrix centroids;
+    struct run_stats stats;
+    Py_buffer labels;
+    unsigned long seed = 0;
+    int m, n, n_threads = 1, status;
+
+    ctx.iter = 300;
+    ctx.eps = 0.001;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Oii|idkiOO!", kwlist, &data, &ctx.K, &m, &ctx.iter, &ctx.eps,
+                                     &seed, &n_threads, &labels_object, &PyDict_Type, &info) ||
+        check_n_threads(n_threads) < 0)
+        return NULL;
+    if (seed > 0xFFFFFFFFUL) {
+        PyErr_SetString(PyExc_ValueError, "seed must be between 0 and 2**32 - 1");
+        return NULL;
+    }
+    if (m <= 0) {
+        PyErr_SetString(PyExc_ValueError, "m must be positive");
+        return NULL;
+    }
+
+    init_arena(&arena);
+    if (convert_from_python_to_c(data, &arena, &vectors, 0) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx.N = vectors.m.rows;
+    ctx.d = vectors.m.cols;
+
+    labels.buf = NULL;
+    if (labels_object != Py_None && get_output_buffer(labels_object, &labels, 'i', ctx.N, "labels") < 0) {
+        release_py_matrix(&vectors);
+        free_arena(&arena);
+        return NULL;
+    }
+
+    if (ctx.K <= 0 || ctx.K > ctx.N) {
+        PyErr_SetString(PyExc_ValueError, "K must be between 1 and the number of data points");
+    }
+    else {
+        stats.trace = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        n = coreset_k_means(&ctx, &arena, &vectors.m, m, seed, n_threads, &stats, &centroids, labels.buf);
+        Py_END_ALLOW_THREADS
+
+        if (n < 0) {
+            PyErr_SetString(PyExc_ValueError, "the coreset has fewer than K distinct points; increase m");
+        }
+        else {
+            python_centroids = convert_from_c_to_buffer(&centroids);
+            if (python_centroids != NULL && info != NULL) {
+                status = fill_info(info, &stats);
+                value = status < 0 ? NULL : PyLong_FromLong(n);
+                status = value == NULL ? -1 : PyDict_SetItemString(info, "coreset_size", value);
+                Py_XDECREF(value);
+                if (status < 0)
+                    Py_CLEAR(python_centroids);
+            }
+        }
+    }
+
+    if (labels.buf != NULL)
+        PyBuffer_Release(&labels);
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+
+    return python_centroids;
+}
+
+/*
+ * load_joined(path1, path2, n_threads=0) -> (keys, points). Inner joins two text point files on their first
+ * column and returns the keys as an int64 buffer and the other values as a float64 buffer, both sorted by key.
+ */
+static PyObject* load_joined_module_imp(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"path1", "path2", "n_threads", NULL};
+
+    PyObject *path_objects[2];
+    PyObject *python_keys, *python_points, *result = NULL;
+    struct context ctx;
+    struct arena arena;
+    struct worker_pool pool;
+    struct text_table tables[2];
+    struct matrix points;
+    long long *keys;
+    int n_threads = 0;
+    int i, status[2] = {-1, -1}, join_status = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O&O&|i", kwlist, PyUnicode_FSConverter, &path_objects[0],
+                                     PyUnicode_FSConverter, &path_objects[1], &n_threads))
+        return NULL;
+    if (check_n_threads(n_threads) < 0) {
+        Py_DECREF(path_objects[0]);
+        Py_DECREF(path_objects[1]);
+        return NULL;
+    }
+
+    init_arena(&arena);
+
+    /* The pool splits the text of each file between its workers, and has no points or clusters */
+    ctx.N = 0;
+    ctx.K = 0;
+    ctx.d = 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    init_worker_pool(&pool, &ctx, &arena, n_threads);
+    for (i = 0; i < 2; i++) {
+        status[i] = load_text_table(&pool, PyBytes_AS_STRING(path_objects[i]), &tables[i]);
+        if (status[i] < 0)
+            break;
+    }
+    destroy_worker_pool(&pool);
+
+    if (status[0] == 0 && status[1] == 0)
+        join_status = join_tables(&tables[0], &tables[1], &points, &keys);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < 2; i++) {
+        if (status[i] == 0)
+            continue;
+        if (tables[i].error == NULL) {
+            errno = tables[i].os_error;
+            PyErr_SetFromErrnoWithFilename(PyExc_OSError, PyBytes_AS_STRING(path_objects[i]));
+        }
+        else {
+            PyErr_Format(PyExc_ValueError, "%s:%d: %s", PyBytes_AS_STRING(path_objects[i]), tables[i].error_line,
+                         tables[i].error);
+        }
+        break;
+    }
+
+    if (!PyErr_Occurred() && join_status < 0)
+        PyErr_SetString(PyExc_ValueError, "the keys in the first column must be finite numbers");
+
+    /* The joined rows were written straight into the memory the buffers hand over to Python */
+    if (!PyErr_Occurred()) {
+        python_keys = wrap_array(self, keys, "q", sizeof(long long), points.rows, -1);
+        if (python_keys == NULL)
+            free(points.values);
+        python_points = python_keys != NULL ? wrap_array(self, points.values, "d", sizeof(double), points.rows,
+                                                         points.cols) : NULL;
+        if (python_points != NULL)
+            result = PyTuple_Pack(2, python_keys, python_points);
+        Py_XDECREF(python_keys);
+        Py_XDECREF(python_points);
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (status[i] == 0)
+            free(tables[i].values);
+        Py_DECREF(path_objects[i]);
+    }
+    free_arena(&arena);
+
+    return result;
+}
+
+/* Runs init_pp, or init_parallel if parallel is set, and returns the chosen indices as a list. */
+static PyObject* run_seeding(struct context *ctx, PyObject *data, unsigned long seed, int n_threads,
+                             int parallel, int rounds, double oversampling)
+{
+    PyObject *python_indices = NULL;
+    struct arena arena;
+    struct py_matrix vectors;
+    int *indices;
+    int status, i;
+
+    if (seed > 0xFFFFFFFFUL) {
+        PyErr_SetString(PyExc_ValueError, "seed must be between 0 and 2**32 - 1");
+        return NULL;
+    }
+
+    init_arena(&arena);
+
+    if (convert_from_python_to_c(data, &arena, &vectors, 0) < 0) {
+        free_arena(&arena);
+        return NULL;
+    }
+
+    ctx->N = vectors.m.rows;
+    ctx->d = vectors.m.cols;
+
+    if (ctx->K <= 0 || ctx->K > ctx->N) {
+        PyErr_SetString(PyExc_ValueError, "K must be between 1 and the number of data points");
+    }
+    else {
+        indices = arena_alloc(&arena, (size_t)ctx->K * sizeof(int));
+
+        Py_BEGIN_ALLOW_THREADS
+        if (parallel)
+            status = init_parallel(ctx, &arena, &vectors.m, seed, rounds, oversampling, n_threads, indices);
+        else
+            status = init_pp(ctx, &arena, &vectors.m, seed, n_threads, indices);
+        Py_END_ALLOW_THREADS
+
+        if (status < 0) {
+            PyErr_SetString(PyExc_ValueError, "the data has fewer than K distinct points");
+        }
+        else {
+            python_indices = PyList_New(ctx->K);
+            for (i = 0; python_indices != NULL && i < ctx->K; i++)
+                PyList_SET_ITEM(python_indices, i, PyLong_FromLong(indices[i]));
+        }
+    }
+
+    release_py_matrix(&vectors);
+    free_arena(&arena);
+
+    return python_indices;
+}
+
+/* Maps the algorithm option of fit to an ALGORITHM_* constant, or returns -1 with a Python exception set. */
+static int parse_algorithm(const char *name) {
+    if (strcmp(name, "lloyd") == 0)
+        return ALGORITHM_LLOYD;
+    if (strcmp(name, "hamerly") == 0)
+        return ALGORITHM_HAMERLY;
+    if (strcmp(name, "elkan") == 0)
+        return ALGORITHM_ELKAN;
+
+    PyErr_Format(PyExc_ValueError, "unknown algorithm '%s' (expected 'lloyd', 'hamerly' or 'elkan')", name);
+    return -1;
+}
+
+/* Rejects a negative n_threads option (0 means one worker per CPU). Returns -1 with a Python exception set. */
+static int check_n_threads(int n_threads) {
+    if (n_threads >= 0)
+        return 0;
+
+    PyErr_SetString(PyExc_ValueError, "n_threads must be non-negative (0 means one per available CPU)");
+    return -1;
+}
+
+/* Reads configs[index] of fit_many into run. Returns -1 with a Python exception set. */
+static int parse_batched_run(PyObject *config, int index, int n_points, struct batched_run *run) {
+    static char *kwlist[] = {"K", "seed", "iter", "eps", "algorithm", NULL};
+
+    PyObject *no_args;
+    const char *algorithm_name = "lloyd";
+    int status;
+
+    if (!PyDict_Check(config)) {
+        PyErr_Format(PyExc_TypeError, "configs[%d] must be a dict", index);
+        return -1;
+    }
+
+    run->seed = 0;
+    run->iter = 300;
+    run->eps = 0.001;
+    no_args = PyTuple_New(0);
+    if (no_args == NULL)
+        return -1;
+    status = PyArg_ParseTupleAndKeywords(no_args, config, "i|kids:fit_many", kwlist, &run->K, &run->seed,
+                                         &run->iter, &run->eps, &algorithm_name);
+    Py_DECREF(no_args);
+    if (!status)
+        return -1;
+
+    run->algorithm = parse_algorithm(algorithm_name);
+    if (run->algorithm < 0)
+        return -1;
+
+    if (run->K <= 0 || run->K > n_points) {
+        PyErr_Format(PyExc_ValueError, "configs[%d]: K must be between 1 and the number of data points", index);
+        return -1;
+    }
+    if (run->seed > 0xFFFFFFFFUL) {
+        PyErr_Format(PyExc_ValueError, "configs[%d]: seed must be between 0 and 2**32 - 1", index);
+        return -1;
+    }
+
+    run->status = 0;
+    run->iterations = 0;
+    run->inertia = 0;
+    return 0;
+}
+
+/* The result of one run of fit_many: a dict of centroids (a buffer), indices, inertia and iterations. */
+static PyObject* batched_run_to_python(struct batched_run *run) {
+    PyObject *result, *value;
+    int i, status = 0;
+
+    result = PyDict_New();
+    if (result == NULL)
+        return NULL;
+
+    value = convert_from_c_to_buffer(&run->centroids);
+    status = value == NULL ? -1 : PyDict_SetItemString(result, "centroids", value);
+    Py_XDECREF(value);
+
+    if (status == 0) {
+        value = PyList_New(run->K);
+        for (i = 0; value != NULL && i < run->K; i++)
+            PyList_SET_ITEM(value, i, PyLong_FromLong(run->indices[i]));
+        status = value == NULL ? -1 : PyDict_SetItemString(result, "indices", value);
+        Py_XDECREF(value);
+    }
+
+    if (status == 0) {
+        value = PyFloat_FromDouble(run->inertia);
+        status = value == NULL ? -1 : PyDict_SetItemString(result, "inertia", value);
+        Py_XDECREF(value);
+    }
+
+    if (status == 0) {
+        value = PyLong_FromLong(run->iterations);
+        status = value == NULL ? -1 : PyDict_SetItemString(result, "iterations", value);
+        Py_XDECREF(value);
+    }
+
+    if (status < 0)
+        Py_CLEAR(result);
+    return result;
+}
+
+/* Stores the counters of a run into the info dict passed to fit. Returns -1 with a Python exception set. */
+static int fill_info(PyObject *info, struct run_stats *stats) {
+    PyObject *value;
+    int status;
+
+    value = PyLong_FromLong(stats->iterations);
+    status = value == NULL ? -1 : PyDict_SetItemString(info, "iterations", value);
+    Py_XDECREF(value);
+    if (status < 0)
+        return -1;
+
+    value = PyLong_FromLongLong(stats->distance_evaluations);
+    status = value == NULL ? -1 : PyDict_SetItemString(info, "distance_evaluations", value);
+    Py_XDECREF(value);
+    if (status < 0)
+        return -1;
+
+    value = PyLong_FromLongLong(stats->skipped_distance_evaluations);
+    status = value == NULL ? -1 : PyDict_SetItemString(info, "skipped_distance_evaluations", value);
+    Py_XDECREF(value);
+    if (status < 0)
+        return -1;
+
+    value = PyLong_FromLongLong(stats->allocations);
+    status = value == NULL ? -1 : PyDict_SetItemString(info, "allocations", value);
+    Py_XDECREF(value);
+    if (status < 0)
+        return -1;
+
+    value = PyLong_FromLongLong(stats->allocated_bytes);
+    status = value == NULL ? -1 : PyDict_SetItemString(info, "allocated_bytes", value);
+    Py_XDECREF(value);
+
+    return status;
+}
+
+static PyObject* iteration_stats_to_python(const struct iteration_stats *record) {
+    return Py_BuildValue("{s:i,s:d,s:d,s:d,s:i,s:d,s:L}",
+                         "iteration", record->iteration,
+                         "assign_seconds", record->assign_seconds,
+                         "update_seconds", record->update_seconds,
+                         "inertia", record->inertia,
+                         "reassigned", record->reassigned,
+                         "max_shift", record->max_shift,
+                         "allocations", record->allocations);
+}
+
+/*
+ * Runs the Python callback of a traced fit with the record of the iteration, holding the GIL only for the call.
+ * The run stops if the callback returns False, or raises.
+ */
+static int call_python_trace(struct run_trace *trace, const struct iteration_stats *record) {
+    struct python_trace *py_trace = trace->callback_data;
+    PyObject *value, *result = NULL;
+    int stop;
+
+    PyEval_RestoreThread(py_trace->thread_state);
+
+    value = iteration_stats_to_python(record);
+    if (value != NULL) {
+        result = PyObject_CallOneArg(py_trace->callback, value);
+        Py_DECREF(value);
+    }
+    if (result == NULL) {
+        py_trace->failed = 1;
+        stop = 1;
+    } else {
+        stop = result == Py_False;
+        Py_DECREF(result);
+    }
+
+    py_trace->thread_state = PyEval_SaveThread();
+    return stop;
+}
+
+/* Stores the records of a traced run in info['trace'], one dict per iteration. */
+static int fill_trace(PyObject *info, struct run_trace *trace) {
+    PyObject *records, *value;
+    int i, status;
+
+    records = PyList_New(trace->count);
+    if (records == NULL)
+        return -1;
+
+    for (i = 0; i < trace->count; i++) {
+        value = iteration_stats_to_python(&trace->iterations[i]);
+        if (value == NULL) {
+            Py_DECREF(records);
+            return -1;
+        }
+        PyList_SET_ITEM(records, i, value);
+    }
+
+    status = PyDict_SetItemString(info, "trace", records);
+    Py_DECREF(records);
+    return status;
+}
+
+/*
+ * Returns the struct module type code ('d' or 'f') of a buffer format holding native floating point numbers,
+ * or 0 if the format is not supported.
+ */
+static char buffer_item_type(const char *format) {
+    const int one = 1;
+    const int little_endian = (*(const char *)&one == 1);
+
+    if (format == NULL)   /* Plain unsigned bytes */
+        return 0;
+
+    /* Native ('@', '=') and explicit byte orders matching the machine are all fine */
+    if (*format == '@' || *format == '=' || (*format == '<' && little_endian) || (*format == '>' && !little_endian))
+        format++;
+
+    if ((*format == 'd' || *format == 'f') && format[1] == '\0')
+        return *format;
+
+    return 0;
+}
+
+/* The size (4 or 8) of the native signed integers a buffer holds, or 0 if it holds anything else. */
+static int integer_item_size(Py_buffer *view) {
+    const int one = 1;
+    const int little_endian = (*(const char *)&one == 1);
+    const char *format = view->format;
+
+    if (format == NULL || (view->itemsize != 4 && view->itemsize != 8))
+        return 0;
+    if (*format == '@' || *format == '=' || (*format == '<' && little_endian) || (*format == '>' && !little_endian))
+        format++;
+
+    if ((*format == 'i' || *format == 'l' || *format == 'q' || *format == 'n') && format[1] == '\0')
+        return (int)view->itemsize;
+    return 0;
+}
+
+/* Whether a buffer holds native 32-bit signed integers, that a C int array can be written into. */
+static int is_int32_buffer(Py_buffer *view) {
+    return sizeof(int) == 4 && integer_item_size(view) == 4;
+}
+
+/*
+ * Gets into view a writable C-contiguous buffer of at least items native float64 ('d') or int32 ('i') values.
+ * Returns 0, or -1 with a Python exception naming the argument set.
+ */
+static int get_output_buffer(PyObject *obj, Py_buffer *view, char type, Py_ssize_t items, const char *name) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return -1;
+
+    if ((type == 'i' ? !is_int32_buffer(view) : buffer_item_type(view->format) != type)
+            || view->len / view->itemsize < items) {
+        PyErr_Format(PyExc_ValueError, "%s must be a writable %s buffer of at least %zd items", name,
+                     type == 'i' ? "int32" : "float64", items);
+        PyBuffer_Release(view);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Gets into view the n weights of a weighted fit, a C-contiguous buffer of n non-negative finite float64 values.
+ * Returns 0, or -1 with a Python exception set.
+ */
+static int get_weights_buffer(PyObject *obj, Py_buffer *view, int n) {
+    const double *weights;
+    int i;
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return -1;
+
+    weights = view->buf;
+    if (buffer_item_type(view->format) != 'd' || view->len / view->itemsize != n) {
+        PyErr_SetString(PyExc_ValueError, "weights must be a float64 buffer of one weight per data point");
+        PyBuffer_Release(view);
+        return -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (!(weights[i] >= 0) || !isfinite(weights[i])) {
+            PyErr_SetString(PyExc_ValueError, "weights must be non-negative and finite");
+            PyBuffer_Release(view);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Fills out with the two-dimensional matrix held by obj, which is either an object exporting a C-contiguous
+ * float64/float32 buffer (a NumPy array, a memoryview, ...) or a list of lists of floats.
+ * float32 buffers are widened to float64, unless keep_float32 is set.
+ * Returns 0 on success, or -1 with a Python exception set.
+ */
+static int convert_from_python_to_c(PyObject *obj, struct arena *arena, struct py_matrix *out, int keep_float32) {
+    Py_buffer *view = &out->view;
+    char type;
+    int i, j;
+
+    out->has_view = 0;
+    out->is_buffer = 0;
+    out->dtype = 'd';
+
+    if (!PyObject_CheckBuffer(obj)) {
+        if (!PyList_Check(obj) || PyList_Size(obj) == 0 || !PyList_Check(PyList_GetItem(obj, 0))) {
+            PyErr_SetString(PyExc_TypeError, "expected a non-empty list of lists or a two-dimensional buffer");
+            return -1;
+        }
+        out->m = convert_from_list_to_c(obj, arena);
+        return PyErr_Occurred() ? -1 : 0;
+    }
+
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return -1;
+
+    type = buffer_item_type(view->format);
+    if (view->ndim != 2 || type == 0 || view->shape[0] == 0 || view->shape[1] == 0
+            || view->shape[0] > INT_MAX || view->shape[1] > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "expected a non-empty two-dimensional float64 or float32 buffer");
+        PyBuffer_Release(view);
+        return -1;
+    }
+
+    if (type == 'd') {
+        /* Zero-copy: the rows of the matrix are the rows of the buffer */
+        out->m.values = view->buf;
+        out->m.rows = (int)view->shape[0];
+        out->m.cols = (int)view->shape[1];
+        out->m.stride = out->m.cols;
+        out->has_view = 1;
+        out->is_buffer = 1;
+        return 0;
+    }
+
+    if (keep_float32) {
+        /* Zero-copy too, in single precision */
+        out->m32.values = view->buf;
+        out->m32.rows = (int)view->shape[0];
+        out->m32.cols = (int)view->shape[1];
+        out->m32.stride = out->m32.cols;
+        out->m.values = NULL;
+        out->m.rows = out->m32.rows;
+        out->m.cols = out->m32.cols;
+        out->m.stride = out->m32.cols;
+        out->dtype = 'f';
+        out->has_view = 1;
+        out->is_buffer = 1;
+        return 0;
+    }
+
+    /* float32 is widened into the arena */
+    out->m = alloc_matrix(arena, (int)view->shape[0], (int)view->shape[1]);
+    for (i = 0; i < out->m.rows; i++) {
+        const float *src = (const float *)view->buf + (size_t)i * out->m.cols;
+        double *row = ROW(&out->m, i);
+        for (j = 0; j < out->m.cols; j++)
+            row[j] = src[j];
+    }
+    PyBuffer_Release(view);
+    out->is_buffer = 1;
+
+    return 0;
+}
+
+static void release_py_matrix(struct py_matrix *pm) {
+    if (pm->has_view)
+        PyBuffer_Release(&pm->view);
+    pm->has_view = 0;
+}
+
+/* Whether fit or predict was given sparse points: a scipy.sparse matrix, or an (indptr, indices, data, d) tuple. */
+static int is_csr_object(PyObject *obj) {
+    return PyTuple_Check(obj) || PyObject_HasAttrString(obj, "indptr");
+}
+
+/*
+ * Gets new references to the indptr, indices and data of a CSR object into parts, and its shape into rows and cols
+ * (rows is -1 for a tuple, whose indptr gives it). Returns 0, or -1 with a Python exception set.
+ */
+static int get_csr_parts(PyObject *obj, PyObject **parts, Py_ssize_t *rows, Py_ssize_t *cols) {
+    static const char *names[3] = {"indptr", "indices", "data"};
+    PyObject *attribute;
+    int i, status = 0;
+
+    *rows = -1;
+    if (PyTuple_Check(obj)) {
+        if (PyTuple_GET_SIZE(obj) != 4) {
+            PyErr_SetString(PyExc_ValueError, "sparse data must be an (indptr, indices, data, d) tuple");
+            return -1;
+        }
+        *cols = PyNumber_AsSsize_t(PyTuple_GET_ITEM(obj, 3), PyExc_OverflowError);
+        if (*cols == -1 && PyErr_Occurred())
+            return -1;
+        for (i = 0; i < 3; i++) {
+            parts[i] = PyTuple_GET_ITEM(obj, i);
+            Py_INCREF(parts[i]);
+        }
+        return 0;
+    }
+
+    /* A scipy.sparse matrix in another format has an indptr too, over its columns for CSC */
+    attribute = PyObject_GetAttrString(obj, "format");
+    if (attribute == NULL)
+        PyErr_Clear();
+    else if (!PyUnicode_Check(attribute) || PyUnicode_CompareWithASCIIString(attribute, "csr") != 0)
+        status = -1;
+    Py_XDECREF(attribute);
+    if (status < 0) {
+        PyErr_SetString(PyExc_ValueError, "sparse data must be in CSR format (see scipy.sparse tocsr)");
+        return -1;
+    }
+
+    attribute = PyObject_GetAttrString(obj, "shape");
+    if (attribute == NULL)
+        return -1;
+    status = PyTuple_Check(attribute) && PyArg_ParseTuple(attribute, "nn", rows, cols) ? 0 : -1;
+    Py_DECREF(attribute);
+    if (status < 0) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "the shape of sparse data must be a (rows, cols) tuple");
+        return -1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        parts[i] = PyObject_GetAttrString(obj, names[i]);
+        if (parts[i] == NULL) {
+            while (--i >= 0)
+                Py_DECREF(parts[i]);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static long long integer_item(Py_buffer *view, Py_ssize_t k) {
+    if (view->itemsize == 4)
+        return ((const int32_t *)view->buf)[k];
+    return ((const int64_t *)view->buf)[k];
+}
+
+/*
+ * Fills out with the CSR matrix held by obj, whose indptr and indices are one-dimensional buffers of int32 or int64
+ * and data one of float64 or float32. The structure is checked in full, so the kernels can trust every index.
+ * Returns 0 on success, or -1 with a Python exception set.
+ */
+static int convert_csr_from_python(PyObject *obj, struct arena *arena, struct py_csr *out) {
+    PyObject *parts[3];
+    Py_buffer *views = out->views;
+    Py_ssize_t rows, cols, nnz, i;
+    long long *indptr, index;
+    int *indices;
+    double *values;
+    int status = 0;
+
+    out->n_views = 0;
+    if (get_csr_parts(obj, parts, &rows, &cols) < 0)
+        return -1;
+
+    for (i = 0; i < 3 && status == 0; i++) {
+        status = PyObject_GetBuffer(parts[i], &views[i], PyBUF_C_CONTIGUOUS | PyBUF_FORMAT);
+        if (status == 0)
+            out->n_views++;
+    }
+    for (i = 0; i < 3; i++)
+        Py_DECREF(parts[i]);
+    if (status < 0) {
+        release_py_csr(out);
+        return -1;
+    }
+
+    if (rows < 0)
+        rows = views[0].len / views[0].itemsize - 1;
+    nnz = views[1].len / views[1].itemsize;
+    if (views[0].ndim != 1 || integer_item_size(&views[0]) == 0 || views[0].len / views[0].itemsize != rows + 1
+            || views[1].ndim != 1 || integer_item_size(&views[1]) == 0
+            || views[2].ndim != 1 || buffer_item_type(views[2].format) == 0 || views[2].len / views[2].itemsize != nnz
+            || rows <= 0 || rows > INT_MAX || cols <= 0 || cols > INT_MAX) {
+        PyErr_SetString(PyExc_ValueError, "sparse data must have at least one row and column, an int32/int64 indptr "
+                                          "with one more item than rows, and int32/int64 indices and float64/float32 "
+                                          "data of the same length");
+        release_py_csr(out);
+        return -1;
+    }
+
+    indptr = arena_alloc(arena, (size_t)(rows + 1) * sizeof(long long));
+    for (i = 0; i <= rows; i++) {
+        indptr[i] = integer_item(&views[0], i);
+        if ((i == 0 && indptr[i] != 0) || (i > 0 && indptr[i] < indptr[i - 1]) || indptr[i] > nnz) {
+            PyErr_SetString(PyExc_ValueError, "the indptr of sparse data must rise from 0 to at most its non-zeros");
+            release_py_csr(out);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < indptr[rows]; i++) {
+        index = integer_item(&views[1], i);
+        if (index < 0 || index >= cols) {
+            PyErr_SetString(PyExc_ValueError, "the indices of sparse data must be columns in [0, d)");
+            release_py_csr(out);
+            return -1;
+        }
+    }
+
+    /* int32 indices and float64 values are read in place, the others are converted into the arena */
+    if (is_int32_buffer(&views[1])) {
+        indices = views[1].buf;
+    } else {
+        indices = arena_alloc(arena, (size_t)(nnz > 0 ? nnz : 1) * sizeof(int));
+        for (i = 0; i < nnz; i++)
+            indices[i] = (int)integer_item(&views[1], i);
+    }
+    if (buffer_item_type(views[2].format) == 'd') {
+        values = views[2].buf;
+    } else {
+        values = arena_alloc(arena, (size_t)(nnz > 0 ? nnz : 1) * sizeof(double));
+        for (i = 0; i < nnz; i++)
+            values[i] = ((const float *)views[2].buf)[i];
+    }
+
+    out->m.indptr = indptr;
+    out->m.indices = indices;
+    out->m.values = values;
+    out->m.rows = (int)rows;
+    out->m.cols = (int)cols;
+
+    return 0;
+}
+
+static void release_py_csr(struct py_csr *pc) {
+    while (pc->n_views > 0)
+        PyBuffer_Release(&pc->views[--pc->n_views]);
+}
+
+static struct matrix convert_from_list_to_c(PyObject *list_of_lists, struct arena *arena) {
+    PyObject *list;
+    PyObject *item;
+    struct matrix m;
+    double *row;
+
+    int rows = PyObject_Length(list_of_lists);
+    int cols = PyObject_Length(PyList_GetItem(list_of_lists, 0));
+
+    m = alloc_matrix(arena, rows, cols);
+
+    int i,j;
+    for (i = 0; i < rows; i++) {
+        list = PyList_GetItem(list_of_lists, i);
+        row = ROW(&m, i);
+        for (j = 0; j < cols; j++) {
+            item = PyList_GetItem(list, j);
+            if (item == NULL)
+                return m;
+            row[j] = PyFloat_AsDouble(item);
+        }
+    }
+
+    return m;
+}
+
+static PyObject* convert_from_c_to_python(struct matrix *centroids){
+    PyObject *list_of_lists;
+
+    list_of_lists = PyList_New(centroids->rows);
+
+    int i,j;
+    for (i = 0; i < centroids->rows; i++) {
+        PyList_SetItem(list_of_lists, i, PyList_New(centroids->cols));
+        const double *row = ROW(centroids, i);
+        for (j = 0; j < centroids->cols; j++) {
+            PyObject* python_double = Py_BuildValue("d", row[j]);
+            PyList_SetItem(PyList_GetItem(list_of_lists, i), j, python_double);
+        }
+    }
+
+    return list_of_lists;
+}
+
+/*
+ * Returns a matrix (the centroids, or loaded points) as a rows x cols float64 memoryview over a bytearray.
+ * numpy.asarray wraps it without copying.
+ */
+static PyObject* convert_from_c_to_buffer(struct matrix *m) {
+    PyObject *bytes, *view, *shaped;
+    double *dst;
+    int i;
+
+    bytes = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)m->rows * m->cols * (Py_ssize_t)sizeof(double));
+    if (bytes == NULL)
+        return NULL;
+
+    dst = (double *)PyByteArray_AS_STRING(bytes);
+    for (i = 0; i < m->rows; i++)
+        memcpy(dst + (size_t)i * m->cols, ROW(m, i), m->cols * sizeof(double));
+
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (view == NULL)
+        return NULL;
+
+    shaped = PyObject_CallMethod(view, "cast", "s(ii)", "d", m->rows, m->cols);
+    Py_DECREF(view);
+
+    return shaped;
+}
+
+/* Returns n items of item_size bytes as a one-dimensional buffer of the given struct module format. */
+static PyObject* convert_array_to_buffer(const void *items, int n, size_t item_size, const char *format) {
+    PyObject *bytes, *view, *cast;
+
+    bytes = PyByteArray_FromStringAndSize((const char *)items, (Py_ssize_t)n * (Py_ssize_t)item_size);
+    if (bytes == NULL)
+        return NULL;
+
+    view = PyMemoryView_FromObject(bytes);
+    Py_DECREF(bytes);
+    if (view == NULL)
+        return NULL;
+
+    cast = PyObject_CallMethod(view, "cast", "s", format);
+    Py_DECREF(view);
+
+    return cast;
+}
+
+/* The per-interpreter state of the module. */
+struct module_state {
+    PyObject *array_type;  /* The type of the arrays wrap_array returns. */
+};
+
+/*
+ * An array in memory allocated with malloc, which it owns and frees, exported with the buffer protocol so that
+ * memoryview and numpy.asarray wrap it without a copy. Unlike memoryview.cast, it can have no rows.
+ */
+struct array_object {
+    PyObject_HEAD
+    void *items;
+    const char *format;     /* The struct module format of an item. */
+    int ndim;               /* 1 for a vector, 2 for a rows x cols matrix. */
+    Py_ssize_t len;
+    Py_ssize_t itemsize;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+};
+
+static int array_object_getbuffer(struct array_object *self, Py_buffer *view, int flags)
+{
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->items;
+    view->len = self->len;
+    view->readonly = 0;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->format : NULL;
+    view->ndim = self->ndim;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? self->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+
+    return 0;
+}
+
+static void array_object_dealloc(struct array_object *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    free(self->items);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+static PyType_Slot arrayObjectSlots[] = {
+    {Py_tp_doc, (void *)PyDoc_STR("A float64 or int64 array returned by load_joined, read with memoryview or "
+                                  "numpy.asarray.")},
+    {Py_tp_dealloc, array_object_dealloc},
+    {Py_bf_getbuffer, array_object_getbuffer},
+    {0, NULL}
+};
+
+static PyType_Spec arrayObjectSpec = {
+    "mykmeanssp.Array",
+    sizeof(struct array_object),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    arrayObjectSlots
+};
+
+/*
+ * Hands items (allocated with malloc) over to a memoryview of rows items, or of rows x cols items if cols >= 0.
+ * items is freed with the view, or at once if the view cannot be made.
+ */
+static PyObject* wrap_array(PyObject *module, void *items, const char *format, Py_ssize_t itemsize, int rows,
+                            int cols)
+{
+    struct module_state *state = PyModule_GetState(module);
+    PyTypeObject *type = (PyTypeObject *)state->array_type;
+    struct array_object *array;
+    PyObject *view;
+
+    array = (struct array_object *)type->tp_alloc(type, 0);
+    if (array == NULL) {
+        free(items);
+        return NULL;
+    }
+
+    array->items = items;
+    array->format = format;
+    array->itemsize = itemsize;
+    array->ndim = cols >= 0 ? 2 : 1;
+    array->shape[0] = rows;
+    array->shape[1] = cols >= 0 ? cols : 1;
+    array->strides[0] = array->shape[1] * itemsize;
+    array->strides[1] = itemsize;
+    array->len = (Py_ssize_t)rows * array->shape[1] * itemsize;
+
+    view = PyMemoryView_FromObject((PyObject *)array);
+    Py_DECREF(array);
+
+    return view;
+}
+
+/*
+ * mykmeanssp.KMeans: a model that keeps its training points, centroids and cluster sums between calls.
+ * Its methods release the GIL while they compute, and an object is used by one thread at a time.
+ */
+struct kmeans_object {
+    PyObject_HEAD
+    struct model model;
+    int initialized;
+    int busy;           /* A method is running with the GIL released. */
+    int n_threads;
+    int algorithm;
+    int partial_iter;   /* Warm started iterations run by partial_fit. */
+};
+
+static int kmeans_object_init(struct kmeans_object *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"centroids", "iter", "eps", "n_threads", "algorithm", "partial_iter", NULL};
+
+    PyObject *centroids_object;
+    struct arena arena;
+    struct py_matrix initial_centroids;
+    const char *algorithm_name = "lloyd";
+    int iter = 300, n_threads = 1, partial_iter = 3, algorithm;
+    double eps = 0.001;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|idisi", kwlist, &centroids_object, &iter, &eps, &n_threads,
+                                     &algorithm_name, &partial_iter))
+        return -1;
+
+    algorithm = parse_algorithm(algorithm_name);
+    if (algorithm < 0 || check_n_threads(n_threads) < 0)
+        return -1;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the KMeans object is in use by another thread");
+        return -1;
+    }
+
+    init_arena(&arena);
+    if (convert_from_python_to_c(centroids_object, &arena, &initial_centroids, 0) < 0) {
+        free_arena(&arena);
+        return -1;
+    }
+    if (initial_centroids.m.rows <= 0) {
+        PyErr_SetString(PyExc_ValueError, "centroids must have at least one row");
+        release_py_matrix(&initial_centroids);
+        free_arena(&arena);
+        return -1;
+    }
+
+    if (self->initialized)
+        free_model(&self->model);
+    init_model(&self->model, &initial_centroids.m, initial_centroids.m.rows, iter, eps);
+    self->initialized = 1;
+    self->n_threads = n_threads;
+    self->algorithm = algorithm;
+    self->partial_iter = partial_iter;
+
+    release_py_matrix(&initial_centroids);
+    free_arena(&arena);
+    return 0;
+}
+
+static void kmeans_object_dealloc(struct kmeans_object *self)
+{
+    PyTypeObject *type = Py_TYPE(self);
+
+    if (self->initialized)
+        free_model(&self->model);
+    type->tp_free((PyObject *)self);
+    Py_DECREF(type);
+}
+
+/* Marks the object busy before a method releases the GIL. Returns -1 with a Python exception set. */
+static int begin_model_call(struct kmeans_object *self)
+{
+    if (!self->initialized) {
+        PyErr_SetString(PyExc_RuntimeError, "KMeans.__init__ was not called");
+        return -1;
+    }
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError, "the KMeans object is in use by another thread");
+        return -1;
+    }
+    self->busy = 1;
+    return 0;
+}
+
+/* Converts points given to a method, which must have the dimension of the centroids. */
+static int convert_model_points(struct kmeans_object *self, PyObject *obj, struct arena *arena,
+                                struct py_matrix *out)
+{
+    if (convert_from_python_to_c(obj, arena, out, 0) < 0)
+        return -1;
+    if (out->m.rows > 0 && out->m.cols != self->model.ctx.d) {
+        PyErr_SetString(PyExc_ValueError, "the points must have the same dimension as the centroids");
+        release_py_matrix(out);
+        return -1;
+    }
+    return 0;
+}
+
+/* convert_model_points for sparse points. */
+static int convert_model_csr(struct kmeans_object *self, PyObject *obj, struct arena *arena, struct py_csr *out)
+{
+    if (convert_csr_from_python(obj, arena, out) < 0)
+        return -1;
+    if (out->m.cols != self->model.ctx.d) {
+        PyErr_SetString(PyExc_ValueError, "the points must have the same dimension as the centroids");
+        release_py_csr(out);
+        return -1;
+    }
+    return 0;
+}
+
+/* fit(data) -> self. Replaces the points of the model with data and runs up to iter iterations from the centroids. */
+static PyObject* kmeans_object_fit(struct kmeans_object *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", NULL};
+
+    PyObject *data;
+    struct arena arena;
+    struct py_matrix points;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &data) || begin_model_call(self) < 0)
+        return NULL;
+
+    init_arena(&arena);
+    if (convert_model_points(self, data, &arena, &points) < 0) {
+        free_arena(&arena);
+        self->busy = 0;
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    model_drop_points(&self->model, self->model.ctx.N);
+    model_add_points(&self->model, &points.m);
+    model_fit(&self->model, self->model.ctx.iter, self->n_threads, self->algorithm);
+    Py_END_ALLOW_THREADS
+
+    release_py_matrix(&points);
+    free_arena(&arena);
+    self->busy = 0;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/*
+ * partial_fit(data, drop=0) -> self. Forgets the drop oldest points, folds data into the cluster sums and runs up to
+ * partial_iter iterations from the updated centroids.
+ */
+static PyObject* kmeans_object_partial_fit(struct kmeans_object *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", "drop", NULL};
+
+    PyObject *data;
+    struct arena arena;
+    struct py_matrix points;
+    int drop = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", kwlist, &data, &drop))
+        return NULL;
+    if (drop < 0) {
+        PyErr_SetString(PyExc_ValueError, "drop must be non-negative");
+        return NULL;
+    }
+    if (begin_model_call(self) < 0)
+        return NULL;
+
+    init_arena(&arena);
+    if (convert_model_points(self, data, &arena, &points) < 0) {
+        free_arena(&arena);
+        self->busy = 0;
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    model_drop_points(&self->model, drop);
+    model_add_points(&self->model, &points.m);
+    model_update_centroids(&self->model);
+    model_fit(&self->model, self->partial_iter, self->n_threads, self->algorithm);
+    Py_END_ALLOW_THREADS
+
+    release_py_matrix(&points);
+    free_arena(&arena);
+    self->busy = 0;
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+/*
+ * predict(data) -> the index of the closest centroid of every point, as an int32 buffer. data may be sparse, like
+ * the data of fit.
+ */
+static PyObject* kmeans_object_predict(struct kmeans_object *self, PyObject *args, PyObject *kwargs)
+{
+    static char *kwlist[] = {"data", NULL};
+
+    PyObject *data, *bytes, *view, *labels = NULL;
+    struct arena arena;
+    struct py_matrix points;
+    struct py_csr sparse_points;
+    int sparse, rows;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &data) || begin_model_call(self) < 0)
+        return NULL;
+
+    init_arena(&arena);
+    sparse = is_csr_object(data);
+    if (sparse ? convert_model_csr(self, data, &arena, &sparse_points) < 0
+               : convert_model_points(self, data, &arena, &points) < 0) {
+        free_arena(&arena);
+        self->busy = 0;
+        return NULL;
+    }
+    rows = sparse ? sparse_points.m.rows : points.m.rows;
+
+    /* The labels are written straight into the buffer that is returned */
+    bytes = PyByteArray_FromStringAndSize(NULL, (Py_ssize_t)rows * (Py_ssize_t)sizeof(int));
+    if (bytes != NULL) {
+        if (rows > 0) {
+            Py_BEGIN_ALLOW_THREADS
+            if (sparse)
+                sparse_predict(&arena, &sparse_points.m, &self->model.centroids, self->n_threads,
+                               (int *)PyByteArray_AS_STRING(bytes));
+            else
+                model_predict(&self->model, &points.m, self->n_threads, (int *)PyByteArray_AS_STRING(bytes));
+            Py_END_ALLOW_THREADS
+        }
+
+        view = PyMemoryView_FromObject(bytes);
+        if (view != NULL) {
+            labels = PyObject_CallMethod(view, "cast", "s", "i");
+            Py_DECREF(view);
+        }
+        Py_DECREF(bytes);
+    }
+
+    if (sparse)
+        release_py_csr(&sparse_points);
+    else
+        release_py_matrix(&points);
+    free_arena(&arena);
+    self->busy = 0;
+
+    return labels;
+}
+
+/*
+ * predict_batch(points, out) -> None. The serving path of predict: points is a C-contiguous float64 buffer of one
+ * point or of a batch of them, read in place, and their labels are written into out, a writable C-contiguous int32
+ * buffer with room for them. Nothing is allocated, and small batches are labelled without releasing the GIL.
+ */
+static PyObject* kmeans_object_predict_batch(struct kmeans_object *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Py_buffer points_view, out_view;
+    struct matrix points;
+    int rows = 0;
+
+    if (nargs != 2) {
+        PyErr_SetString(PyExc_TypeError, "predict_batch() takes exactly two arguments (points, out)");
+        return NULL;
+    }
+    if (begin_model_call(self) < 0)
+        return NULL;
+
+    if (PyObject_GetBuffer(args[0], &points_view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        self->busy = 0;
+        return NULL;
+    }
+    if (buffer_item_type(points_view.format) == 'd') {
+        if (points_view.ndim == 1 && points_view.shape[0] == self->model.ctx.d)
+            rows = 1;
+        else if (points_view.ndim == 2 && points_view.shape[1] == self->model.ctx.d && points_view.shape[0] <= INT_MAX)
+            rows = (int)points_view.shape[0];
+        else
+            rows = -1;
+    } else {
+        rows = -1;
+    }
+    if (rows < 0) {
+        PyErr_SetString(PyExc_ValueError, "points must be a float64 buffer of one or more points of the dimension "
+                                          "of the centroids");
+        PyBuffer_Release(&points_view);
+        self->busy = 0;
+        return NULL;
+    }
+
+    if (PyObject_GetBuffer(args[1], &out_view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        PyBuffer_Release(&points_view);
+        self->busy = 0;
+        return NULL;
+    }
+    if (!is_int32_buffer(&out_view) || out_view.len / out_view.itemsize < rows) {
+        PyErr_SetString(PyExc_ValueError, "out must be an int32 buffer with room for a label per point");
+        PyBuffer_Release(&out_view);
+        PyBuffer_Release(&points_view);
+        self->busy = 0;
+        return NULL;
+    }
+
+    points.values = points_view.buf;
+    points.rows = rows;
+    points.cols = self->model.ctx.d;
+    points.stride = points.cols;
+    if (rows < PREDICT_GIL_MIN_ROWS) {
+        index_predict(&self->model.index, &points, 0, rows, out_view.buf);
+    } else {
+        Py_BEGIN_ALLOW_THREADS
+        model_predict(&self->model, &points, self->n_threads, out_view.buf);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyBuffer_Release(&out_view);
+    PyBuffer_Release(&points_view);
+    self->busy = 0;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject* kmeans_object_get_centroids(struct kmeans_object *self, void *closure)
+{
+    if (!self->initialized)
+        Py_RETURN_NONE;
+    return convert_from_c_to_buffer(&self->model.centroids);
+}
+
+static PyObject* kmeans_object_get_counts(struct kmeans_object *self, void *closure)
+{
+    PyObject *counts;
+    int i;
+
+    if (!self->initialized)
+        Py_RETURN_NONE;
+
+    counts = PyList_New(self->model.ctx.K);
+    for (i = 0; counts != NULL && i < self->model.ctx.K; i++)
+        PyList_SET_ITEM(counts, i, PyLong_FromLong(self->model.counts[i]));
+    return counts;
+}
+
+static PyObject* kmeans_object_get_n_points(struct kmeans_object *self, void *closure)
+{
+    return PyLong_FromLong(self->initialized ? self->model.ctx.N : 0);
+}
+
+static PyObject* kmeans_object_get_iterations(struct kmeans_object *self, void *closure)
+{
+    return PyLong_FromLong(self->initialized ? self->model.iterations : 0);
+}
+
+static PyMethodDef kmeansObjectMethods[] = {
+    {"fit",
+      (PyCFunction)(void(*)(void)) kmeans_object_fit,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("fit(data)\n\n"
+                "Replaces the points of the model with data and runs up to iter iterations starting from the current "
+                "centroids. Returns the model.")},
+    {"partial_fit",
+      (PyCFunction)(void(*)(void)) kmeans_object_partial_fit,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("partial_fit(data, drop=0)\n\n"
+                "Forgets the drop oldest points, adds data to the points of the model and to the sums of the "
+                "clusters closest to them, and runs up to partial_iter iterations starting from the updated "
+                "centroids. drop slides a window over the points. Returns the model.")},
+    {"predict",
+      (PyCFunction)(void(*)(void)) kmeans_object_predict,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("predict(data)\n\n"
+                "Returns the index of the closest centroid of every point of data as an int32 buffer. data may be "
+                "sparse, as for mykmeanssp.fit.")},
+    {"predict_batch",
+      (PyCFunction)(void(*)(void)) kmeans_object_predict_batch,
+      METH_FASTCALL,
+      PyDoc_STR("predict_batch(points, out)\n\n"
+                "Writes the index of the closest centroid of every point into out, without allocating. points is a "
+                "C-contiguous float64 buffer holding one point or a batch of points, and out a writable C-contiguous "
+                "int32 buffer with at least as many items. The labels are those of predict, found through an index "
+                "over the centroids: a k-d tree up to 8 dimensions, and above that a scan that skips the centroids "
+                "the triangle inequality rules out.")},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyGetSetDef kmeansObjectGetters[] = {
+    {"centroids", (getter)kmeans_object_get_centroids, NULL, PyDoc_STR("The K x d centroids, as a buffer."), NULL},
+    {"counts", (getter)kmeans_object_get_counts, NULL, PyDoc_STR("The number of points of every cluster."), NULL},
+    {"n_points", (getter)kmeans_object_get_n_points, NULL, PyDoc_STR("The number of points held."), NULL},
+    {"iterations", (getter)kmeans_object_get_iterations, NULL,
+     PyDoc_STR("The iterations run by the last fit or partial_fit."), NULL},
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyType_Slot kmeansObjectSlots[] = {
+    {Py_tp_doc, (void *)PyDoc_STR("KMeans(centroids, iter=300, eps=0.001, n_threads=1, algorithm='lloyd', "
+                                  "partial_iter=3)\n\n"
+                                  "A k-means model that keeps its points, centroids and the sums of its clusters "
+                                  "between calls, starting from the given K centroids. fit and partial_fit run with "
+                                  "n_threads workers, and release the GIL while they compute.")},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, kmeans_object_init},
+    {Py_tp_dealloc, kmeans_object_dealloc},
+    {Py_tp_methods, kmeansObjectMethods},
+    {Py_tp_getset, kmeansObjectGetters},
+    {0, NULL}
+};
+
+static PyType_Spec kmeansObjectSpec = {
+    "mykmeanssp.KMeans",
+    sizeof(struct kmeans_object),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    kmeansObjectSlots
+};
+
+static PyMethodDef kmeansMethods[] = {
+    {"fit",                   /* the Python method name that will be used */
+      (PyCFunction)(void(*)(void)) k_means_module_imp, /* the C-function that implements the Python function and returns static PyObject*  */
+      METH_VARARGS | METH_KEYWORDS, /* flags indicating parameters
+accepted for this function */
+      PyDoc_STR("fit(data, centroids, iter, eps, K, n_threads=1, algorithm='lloyd', info=None, "
+                "batch_size=0, max_no_improvement=10, seed=0, trace=False, callback=None, callback_every=1, "
+                "weights=None)\n\n"
+                "An implementation of kmeans algorithm with smart initialization of the centroids.\n"
+                "The run stops after iter iterations, once no centroid moves by eps or more, or once no point "
+                "changes cluster.\n"
+                "n_threads workers run every Lloyd iteration (0 means one per available CPU, and a negative "
+                "value is a ValueError), and the GIL is released while they do.\n"
+                "algorithm is 'lloyd', 'hamerly' or 'elkan'; the last two skip distance computations with "
+                "the triangle inequality and give the same result as 'lloyd'.\n"
+                "A float32 data buffer runs 'lloyd' in float32, without a float64 copy: the distances are computed "
+                "in float32 and the centroids are still summed in float64. The centroids are returned in float64.\n"
+                "If info is a dict, it receives 'iterations', 'distance_evaluations', "
+                "'skipped_distance_evaluations', 'allocations' and 'allocated_bytes'.\n"
+                "trace=True also stores in info['trace'] a dict per iteration with its 'iteration', "
+                "'assign_seconds', 'update_seconds', 'inertia' (of the points under the centroids they were "
+                "assigned to), 'reassigned' points, 'max_shift' of a centroid and 'allocations'. callback, if given, "
+                "is called with that dict every callback_every iterations, and stops the run by returning False. "
+                "Neither applies to mini-batch k-means.\n"
+                "batch_size > 0 runs mini-batch k-means for at most iter batches, stopping early after "
+                "max_no_improvement batches without a better smoothed inertia (0 disables it). data is then either "
+                "a matrix, sampled with the given seed, or an iterable of matrices streamed one at a time, such as "
+                "kmeans_pp.read_chunks(path, batch_size), which clusters a keyed file without holding all of it "
+                "(see kmeans_pp.fit_minibatch).\n"
+                "data may also be sparse: a scipy.sparse CSR matrix, or an (indptr, indices, data, d) tuple of "
+                "int32/int64, int32/int64 and float64/float32 buffers. Sparse points are never densified, each "
+                "iteration costing O(non-zeros x K), and run 'lloyd' without trace or batches; the centroids are "
+                "returned as a dense buffer.\n"
+                "weights, if given, is a float64 buffer of one non-negative weight per data point for weighted "
+                "'lloyd': every point counts that many times in the means of the clusters, and the traced inertia is "
+                "weighted too.")}, /*  The docstring for the function */
+    {"init_pp",
+      (PyCFunction)(void(*)(void)) init_pp_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("init_pp(data, K, seed, n_threads=1)\n\n"
+                "Chooses K initial centroids with k-means++ and returns the indices of the chosen data points.\n"
+                "The indices are the ones kmeans_pp.init_centroids picks after numpy.random.seed(seed).")},
+    {"init_parallel",
+      (PyCFunction)(void(*)(void)) init_parallel_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("init_parallel(data, K, seed, rounds=5, oversampling=0, n_threads=1)\n\n"
+                "Chooses K initial centroids with k-means|| and returns the indices of the chosen data points.\n"
+                "Every round samples about oversampling (0 means 2 * K) candidates in parallel, and K of them are "
+                "chosen by weighted k-means++. The result does not depend on n_threads.")},
+    {"fit_many",
+      (PyCFunction)(void(*)(void)) fit_many_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("fit_many(data, configs, n_threads=0)\n\n"
+                "Runs init_pp and fit once for every config over the same data, converted once. Every config is a "
+                "dict with K and optionally seed (0), iter (300), eps (0.001) and algorithm ('lloyd').\n"
+                "The runs are independent and spread over n_threads workers (0 means one per available CPU), each "
+                "taking the next run when it finishes one. Returns one dict per config with 'centroids' (a buffer), "
+                "'indices', 'inertia' and 'iterations'; every result equals the one of the same run alone.")},
+    {"shard_assign",
+      (PyCFunction)(void(*)(void)) shard_assign_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("shard_assign(data, centroids, labels, sums, counts, refresh)\n\n"
+                "Runs the assignment of one iteration over the points of a shard of a sharded run (see "
+                "kmeans_sharded.py). labels (an int32 per point), sums (K x d float64) and counts (K int32) are the "
+                "writable state of the shard, zeroed before the first iteration and updated in place: the points that "
+                "changed cluster move between the sums, which are summed again from every point when refresh is set. "
+                "Without refresh every label must already be a cluster in [0, K), or a ValueError is raised. "
+                "Returns the number of points whose label changed.")},
+    {"combine_shards",
+      (PyCFunction)(void(*)(void)) combine_shards_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("combine_shards(centroids, sums, counts, eps, iteration, reassigned)\n\n"
+                "Sets the K x d float64 centroids in place to the means of the clusters summed by the S shards, "
+                "sums being S x K x d float64 and counts S x K int32, reduced in shard order as fit reduces its "
+                "workers. Returns (converged, refresh): whether the run stops after iteration (from 1), which "
+                "reassigned points in total, and whether the next iteration must refresh the sums of the shards.")},
+    {"coreset",
+      (PyCFunction)(void(*)(void)) coreset_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("coreset(data, K, m, seed=0, n_threads=1)\n\n"
+                "Samples a weighted coreset of about m data points for K clusters, in two passes over the data: "
+                "every point is sampled by its sensitivity to a rough solution of K centers, chosen by k-means++ "
+                "among a uniform sample, and weighted by the inverse of its probability. Returns (indices, weights): "
+                "the int32 indices of the sampled points in data and their float64 weights, to be passed with "
+                "data[indices] to fit(..., weights=weights).")},
+    {"fit_coreset",
+      (PyCFunction)(void(*)(void)) fit_coreset_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("fit_coreset(data, K, m, iter=300, eps=0.001, seed=0, n_threads=1, labels=None, info=None)\n\n"
+                "k-means for massive data: builds coreset(data, K, m, seed), seeds it with weighted k-means++ and runs "
+                "weighted Lloyd over it. If labels is a writable int32 buffer of one item per data point, it "
+                "receives the label of every point under the final centroids, in one more pass over the data. "
+                "info, if a dict, receives the keys of fit and 'coreset_size'. Returns the K x d centroids as a "
+                "buffer.")},
+    {"load_joined",
+      (PyCFunction)(void(*)(void)) load_joined_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("load_joined(path1, path2, n_threads=0)\n\n"
+                "Reads two text point files, each parsed by n_threads workers (0 means one per available CPU), "
+                "and inner joins their rows on the first value, like pandas.merge. Returns (keys, points): the int64 keys and the float64 joined rows, sorted by key.")},
+    {"save_points",
+      (PyCFunction)(void(*)(void)) save_points_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("save_points(path, data)\n\n"
+                "Writes data to path as a binary point file: a 64 byte header (magic 'KMPOINTS', version, dtype, "
+                "rows, cols, data offset) followed by the rows, in float32 if data is a float32 buffer and in "
+                "float64 otherwise.")},
+    {"fit_file",
+      (PyCFunction)(void(*)(void)) fit_file_module_imp,
+      METH_VARARGS | METH_KEYWORDS,
+      PyDoc_STR("fit_file(path, centroids, iter, eps, K, n_threads=1, algorithm='lloyd', info=None)\n\n"
+                "Same as fit over the points of a point file written by save_points. The file is memory mapped "
+                "and streamed in blocks every iteration, so it may be larger than the available memory. "
+                "float32 files only run with algorithm='lloyd'.")},
+    {NULL, NULL, 0, NULL}     /* The last entry must be all NULL as shown to act as a
+                                 sentinel. Python looks for this entry to know that all
+                                 of the functions for the module have been defined. */
+};
+
+/*
+ * Initializes the module object of one interpreter. The distance kernels depend only on the CPU, so they are
+ * selected once per process whichever interpreter imports the module first.
+ */
+static int kmeans_module_exec(PyObject *m)
+{
+    struct module_state *state = PyModule_GetState(m);
+    PyObject *type;
+    int status;
+
+    pthread_once(&distance_kernels_once, init_distance_kernels);
+
+    /* Name of the distance kernel picked for this CPU, e.g. "avx2" */
+    if (PyModule_AddStringConstant(m, "simd", distance_kernel_name) < 0)
+        return -1;
+
+    /* The arrays are not created from Python, so their type is kept in the module state rather than exported */
+    state->array_type = PyType_FromModuleAndSpec(m, &arrayObjectSpec, NULL);
+    if (state->array_type == NULL)
+        return -1;
+
+    /* A heap type, so every interpreter has its own KMeans */
+    type = PyType_FromModuleAndSpec(m, &kmeansObjectSpec, NULL);
+    if (type == NULL)
+        return -1;
+    status = PyModule_AddType(m, (PyTypeObject *)type);
+    Py_DECREF(type);
+    return status;
+}
+
+static int kmeans_module_traverse(PyObject *m, visitproc visit, void *arg)
+{
+    struct module_state *state = PyModule_GetState(m);
+
+    Py_VISIT(state->array_type);
+    return 0;
+}
+
+static int kmeans_module_clear(PyObject *m)
+{
+    struct module_state *state = PyModule_GetState(m);
+
+    Py_CLEAR(state->array_type);
+    return 0;
+}
+
+static void kmeans_module_free(void *m)
+{
+    kmeans_module_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot kmeansSlots[] = {
+    {Py_mod_exec, kmeans_module_exec},
+#ifdef Py_MOD_PER_INTERPRETER_GIL_SUPPORTED
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef kmeansmodule = {
+    PyModuleDef_HEAD_INIT,
+    "mykmeanssp", /* name of module */
+    NULL, /* module documentation, may be NULL */
+    sizeof(struct module_state),  /* size of per-interpreter state of the module: the types it creates objects of;
+                                     every call keeps its own state in its own context. */
+    kmeansMethods, /* the PyMethodDef array from before containing the methods of the extension */
+    kmeansSlots,  /* multi-phase initialization, so every interpreter gets its own module object */
+    kmeans_module_traverse,
+    kmeans_module_clear,
+    kmeans_module_free
+};
+
+PyMODINIT_FUNC PyInit_mykmeanssp(void)
+{
+    return PyModuleDef_Init(&kmeansmodule);
+}
@@ -1,6 +1,9 @@
 from setuptools import Extension, setup
 
-module = Extension("mykmeanssp", sources=['mykmeanssp.c'])
+module = Extension("mykmeanssp",
+                   sources=['mykmeanssp.c'],
+                   extra_compile_args=['-pthread', '-ffp-contract=off'],
+                   extra_link_args=['-pthread'])
 setup(name='mykmeanssp',
      version='1.0',
      description='Python wrapper for custom C extension',